@@ -0,0 +1,157 @@
+#include <linux/bitmap.h>
+#include <linux/fs.h>
+#include <linux/sched.h>
+#include <linux/uio.h>
+#include "backing.h"
+#include "file.h"
+
+/**
+ * backing_open - Open the backing file of a device
+ *
+ * @dev: Device pointer
+ * @path: Path of the backing file
+ *
+ * The snapshots and the journal are moved next to the backing file, so they
+ * survive a reboot with it. Chunk i of the data is stored at offset
+ * i * CSL_CHUNK_SIZE of the file.
+ *
+ * Return: 0 on success, negative error code on failure
+ */
+int backing_open(struct csl_device* dev, const char* path) {
+	struct file* file = __file_open(path, O_RDWR | O_CREAT | O_LARGEFILE);
+
+	if (IS_ERR(file)) {
+		pr_err("%sFailed to open backing file %s. Errorcode: %ld\n",
+		       PROMPT, path, PTR_ERR(file));
+		return PTR_ERR(file);
+	}
+
+	if (snprintf(dev->meta_path[0], CSL_PATH_LEN, BACKING_META_PATH, path,
+		     0)
+	    >= CSL_PATH_LEN) {
+		pr_err("%sBacking file path %s is too long\n", PROMPT, path);
+		file_close(file);
+		return -ENAMETOOLONG;
+	}
+
+	snprintf(dev->meta_path[1], CSL_PATH_LEN, BACKING_META_PATH, path, 1);
+	snprintf(dev->jnl_path, CSL_PATH_LEN, BACKING_JOURNAL_PATH, path);
+	dev->backing = file;
+
+	return 0;
+}
+
+/**
+ * backing_close - Close the backing file of a device
+ *
+ * @dev: Device pointer
+ */
+void backing_close(struct csl_device* dev) {
+	bitmap_free(dev->dirty);
+	dev->dirty = NULL;
+
+	if (dev->backing) {
+		file_close(dev->backing);
+		dev->backing = NULL;
+	}
+}
+
+/**
+ * backing_mark_dirty - Mark the chunk of a written block for write-back
+ *
+ * @dev: Device pointer
+ * @p_idx: Physical block index
+ *
+ * Must be called after the block is filled, so a write-back that raced with
+ * the copy writes the chunk again, and before the map points to the block,
+ * so a checkpoint that saw the mapping finds the chunk dirty.
+ */
+void backing_mark_dirty(struct csl_device* dev, u32 p_idx) {
+	if (dev->dirty)
+		set_bit(p_idx >> SEG_SHIFT(dev), dev->dirty);
+}
+
+/**
+ * backing_load - Read the data of a device back from its backing file
+ *
+ * @dev: Device pointer
+ *
+ * The file may end before the last chunk, if the last chunks were never
+ * written back, and those chunks hold no mapped block.
+ *
+ * Return: 0 on success, negative error code on failure
+ */
+int backing_load(struct csl_device* dev) {
+	for (size_t i = 0; i < NR_CHUNKS(dev); i += CSL_BACKING_BATCH) {
+		unsigned int nr =
+		    min_t(size_t, CSL_BACKING_BATCH, NR_CHUNKS(dev) - i);
+		loff_t pos = (loff_t)i << CSL_CHUNK_SHIFT;
+		struct kvec vec[CSL_BACKING_BATCH];
+		struct iov_iter iter;
+		ssize_t ret;
+
+		for (unsigned int j = 0; j < nr; j++) {
+			vec[j].iov_base = dev->chunks[i + j];
+			vec[j].iov_len = CSL_CHUNK_SIZE;
+		}
+
+		iov_iter_kvec(&iter, ITER_DEST, vec, nr,
+			      (size_t)nr << CSL_CHUNK_SHIFT);
+		ret = vfs_iter_read(dev->backing, &iter, &pos, 0);
+		if (ret < 0)
+			return ret;
+		if (ret < (ssize_t)nr << CSL_CHUNK_SHIFT)
+			break;
+
+		cond_resched();
+	}
+
+	return 0;
+}
+
+/**
+ * backing_writeback - Write the dirty chunks back to the backing file
+ *
+ * @dev: Device pointer
+ *
+ * Runs of consecutive dirty chunks are written with one I/O, and the file is
+ * synced at the end. A chunk that fails is written again on the next pass.
+ *
+ * Return: 0 on success, negative error code on failure
+ */
+int backing_writeback(struct csl_device* dev) {
+	size_t nr_chunks = NR_CHUNKS(dev);
+	size_t i = 0;
+	int ret = 0;
+
+	while ((i = find_next_bit(dev->dirty, nr_chunks, i)) < nr_chunks) {
+		loff_t pos = (loff_t)i << CSL_CHUNK_SHIFT;
+		struct kvec vec[CSL_BACKING_BATCH];
+		struct iov_iter iter;
+		unsigned int nr = 0;
+
+		while (nr < CSL_BACKING_BATCH && i + nr < nr_chunks
+		       && test_and_clear_bit(i + nr, dev->dirty)) {
+			vec[nr].iov_base = dev->chunks[i + nr];
+			vec[nr].iov_len = CSL_CHUNK_SIZE;
+			nr++;
+		}
+
+		iov_iter_kvec(&iter, ITER_SOURCE, vec, nr,
+			      (size_t)nr << CSL_CHUNK_SHIFT);
+		if (vfs_iter_write(dev->backing, &iter, &pos, 0)
+		    != (ssize_t)nr << CSL_CHUNK_SHIFT) {
+			for (unsigned int j = 0; j < nr; j++)
+				set_bit(i + j, dev->dirty);
+			ret = -EIO;
+		}
+
+		i += nr;
+		cond_resched();
+	}
+
+	if (!ret)
+		ret = vfs_fsync(dev->backing, 0);
+
+	return ret;
+}
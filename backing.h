@@ -0,0 +1,21 @@
+#include <linux/types.h>
+#include "metadata.h"
+#include "type.h"
+
+#ifndef __CSL_BACKING_OPS
+#define __CSL_BACKING_OPS
+
+/* With a backing file, the metadata is kept next to it instead of in /tmp */
+#define BACKING_META_PATH "%s.meta.%u"
+#define BACKING_JOURNAL_PATH "%s.journal"
+
+/* Consecutive chunks are moved with one I/O of up to CSL_BACKING_BATCH */
+#define CSL_BACKING_BATCH 16
+
+int backing_open(struct csl_device* dev, const char* path);
+void backing_close(struct csl_device* dev);
+void backing_mark_dirty(struct csl_device* dev, u32 p_idx);
+int backing_load(struct csl_device* dev);
+int backing_writeback(struct csl_device* dev);
+
+#endif
@@ -0,0 +1,786 @@
+/*
+ * csl_bench - Microbenchmark of the FTL core in userspace
+ *
+ * Drive the request path of rq.c, with the allocation, mapping and garbage
+ * collection of ftl.c and gc.c, with a synthetic workload or a blkparse
+ * trace, and report the throughput, the domain locks, the garbage collector
+ * pauses and the write amplification. Requests go through one hardware queue
+ * in batches, like the plugged requests the driver gets in queue_rqs, so the
+ * writes of a batch are published together. The garbage collector runs in
+ * the benchmark thread whenever it is woken up, as its thread would, so
+ * every pass is timed as a pause of the writes.
+ *
+ *   make -C bench
+ *   bench/csl_bench -w zipf -n 1000000 -r 30 -p cost-benefit
+ *   blkparse -i sda -o sda.txt && bench/csl_bench -t sda.txt
+ */
+
+#include <getopt.h>
+#include <math.h>
+#include "gc.h"
+#include "lock.h"
+#include "metadata.h"
+#include "rq.h"
+
+#define BENCH_READ 0
+#define BENCH_WRITE 1
+#define BENCH_DISCARD 2
+
+#define BENCH_SEQ 0
+#define BENCH_UNIFORM 1
+#define BENCH_ZIPF 2
+#define BENCH_TRACE 3
+#define BENCH_NR_WORKLOADS 4
+
+/* A plug holds up to 32 requests */
+#define BENCH_DEFAULT_BATCH 32
+
+static const char* workload_names[BENCH_NR_WORKLOADS] = {
+    [BENCH_SEQ] = "seq",
+    [BENCH_UNIFORM] = "uniform",
+    [BENCH_ZIPF] = "zipf",
+    [BENCH_TRACE] = "trace",
+};
+
+/**
+ * struct bench_op - Request of a workload
+ * @op: 				BENCH_READ, BENCH_WRITE or BENCH_DISCARD
+ * @nr: 				Number of sectors
+ * @sector: 				First sector index
+ */
+struct bench_op {
+	unsigned int op;  /* Operation */
+	unsigned int nr;  /* Number of sectors */
+	sector_t sector;  /* First sector */
+};
+
+/**
+ * struct bench - Benchmark state
+ * @dev: 				Device driven by the benchmark
+ * @disk: 				Disk of the device, for its name
+ * @queue: 				Request queue of the device
+ * @hctx: 				Hardware queue of the request queue
+ * @ch: 				Hardware queue data, with the write
+ * 					frontiers
+ * @stats: 				Counters of the hardware queue
+ * @cmds: 				Request data of a batch
+ * @pending: 				Deferred writes of the batch
+ * @tail: 				End of @pending
+ * @batch: 				Requests per batch
+ * @nr_batched: 			Requests of the batch run so far
+ * @buf: 				Data of the requests
+ * @workload: 				Workload index
+ * @nr_ops: 				Number of requests to run
+ * @read_percent: 			Share of reads in a synthetic workload
+ * @io_sectors: 			Request size of a synthetic workload
+ * @theta: 				Skew of the zipf workload
+ * @zetan: 				Zeta of the zipf workload
+ * @eta: 				Eta of the zipf workload
+ * @rand: 				Random state
+ * @cursor: 				Next slot of the sequential workload
+ * @trace: 				Requests of a trace
+ * @nr_trace: 				Number of requests of a trace
+ * @nr_reads: 				Read requests
+ * @nr_writes: 				Write requests
+ * @nr_discards: 			Discard requests
+ * @read_sectors: 			Sectors read
+ * @write_sectors: 			Sectors written
+ * @unmapped_sectors: 			Sectors read that were never written
+ * @nr_stalls: 				Writes that found no free segment
+ * @pauses: 				Duration of every garbage collector pass
+ * @nr_pauses: 				Number of garbage collector passes
+ * @max_pauses: 			Capacity of @pauses
+ */
+struct bench {
+	struct csl_device dev; /* Device */
+	struct gendisk disk;   /* Disk of the device */
+	struct request_queue queue; /* Request queue */
+	struct blk_mq_hw_ctx hctx;  /* Hardware queue */
+	struct csl_hctx* ch;	    /* Hardware queue data */
+	struct csl_stats stats;	    /* Hardware queue counters */
+	struct csl_cmd* cmds;	    /* Request data of a batch */
+	struct csl_cmd* pending;    /* Deferred writes */
+	struct csl_cmd** tail;	    /* End of deferred writes */
+	unsigned int batch;	    /* Requests per batch */
+	unsigned int nr_batched;    /* Requests of the batch */
+	u8* buf;	       /* Request data */
+
+	unsigned int workload;	   /* Workload */
+	u64 nr_ops;		   /* Requests to run */
+	unsigned int read_percent; /* Share of reads */
+	unsigned int io_sectors;   /* Request size */
+	double theta;		   /* Zipf skew */
+	double zetan;		   /* Zipf zeta */
+	double eta;		   /* Zipf eta */
+	u64 rand;		   /* Random state */
+	u64 cursor;		   /* Sequential slot */
+	struct bench_op* trace;	   /* Trace requests */
+	size_t nr_trace;	   /* Number of trace requests */
+
+	u64 nr_reads;	      /* Read requests */
+	u64 nr_writes;	      /* Write requests */
+	u64 nr_discards;      /* Discard requests */
+	u64 read_sectors;     /* Sectors read */
+	u64 write_sectors;    /* Sectors written */
+	u64 unmapped_sectors; /* Sectors read unmapped */
+	u64 nr_stalls;	      /* Writes without free segment */
+	u64* pauses;	      /* Garbage collector pauses */
+	size_t nr_pauses;     /* Number of pauses */
+	size_t max_pauses;    /* Capacity of pauses */
+};
+
+/* The benchmark has neither a journal nor a backing file */
+void journal_append(struct csl_device* dev, struct csl_domain* dom,
+		    unsigned long unit, u32 p_idx, unsigned int nr) {}
+
+void wake_journal(struct csl_device* dev) {}
+
+void backing_mark_dirty(struct csl_device* dev, u32 p_idx) {}
+
+static u64 now_ns(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (u64)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* xorshift64* */
+static u64 next_rand(struct bench* b) {
+	b->rand ^= b->rand >> 12;
+	b->rand ^= b->rand << 25;
+	b->rand ^= b->rand >> 27;
+	return b->rand * 0x2545f4914f6cdd1dULL;
+}
+
+/* Uniform random number in [0, 1) */
+static double next_double(struct bench* b) {
+	return (next_rand(b) >> 11) * (1.0 / (1ULL << 53));
+}
+
+/* Zeta of the @n first ranks for skew @theta */
+static double zeta(u64 n, double theta) {
+	double sum = 0;
+
+	for (u64 i = 1; i <= n; i++)
+		sum += 1 / pow(i, theta);
+
+	return sum;
+}
+
+/**
+ * zipf_init - Prepare the zipf workload
+ *
+ * @b: Benchmark pointer
+ * @n: Number of slots
+ *
+ * Ranks are drawn as in "Quickly Generating Billion-Record Synthetic
+ * Databases" by Gray et al., which needs zeta(n) once.
+ */
+static void zipf_init(struct bench* b, u64 n) {
+	b->zetan = zeta(n, b->theta);
+	b->eta = (1 - pow(2.0 / n, 1 - b->theta))
+		 / (1 - zeta(2, b->theta) / b->zetan);
+}
+
+/* Slot of the next zipf request, the hot ranks are scattered over the
+ * device so they do not all fall into the first domain */
+static u64 zipf_next(struct bench* b, u64 n) {
+	double u = next_double(b);
+	double uz = u * b->zetan;
+	u64 rank;
+
+	if (uz < 1)
+		rank = 0;
+	else if (uz < 1 + pow(0.5, b->theta))
+		rank = 1;
+	else
+		rank = n * pow(b->eta * u - b->eta + 1, 1 / (1 - b->theta));
+
+	return (min(rank, n - 1) * 0x9e3779b97f4a7c15ULL) % n;
+}
+
+/* Next request of a synthetic workload */
+static void next_op(struct bench* b, struct bench_op* op) {
+	u64 slots = TOTAL_SECTORS(&b->dev) / b->io_sectors;
+	u64 slot;
+
+	if (b->workload == BENCH_SEQ)
+		slot = b->cursor++ % slots;
+	else if (b->workload == BENCH_UNIFORM)
+		slot = next_rand(b) % slots;
+	else
+		slot = zipf_next(b, slots);
+
+	op->op = next_rand(b) % 100 < b->read_percent ? BENCH_READ
+							: BENCH_WRITE;
+	op->sector = slot * b->io_sectors;
+	op->nr = b->io_sectors;
+}
+
+/**
+ * load_trace - Load the requests of a blkparse trace
+ *
+ * @b: Benchmark pointer
+ * @path: Path of the default text output of blkparse
+ *
+ * Requests are taken when they are queued, and the ones beyond the device
+ * are wrapped around it. Flushes and other events are skipped.
+ *
+ * Return: 0 on success, negative error code on failure
+ */
+static int load_trace(struct bench* b, const char* path) {
+	FILE* file = fopen(path, "r");
+	size_t max = 0, len = 0;
+	char* line = NULL;
+
+	if (!file) {
+		perror(path);
+		return -errno;
+	}
+
+	while (getline(&line, &len, file) > 0) {
+		unsigned long long sector;
+		char action[4], rwbs[8];
+		struct bench_op* op;
+		unsigned int nr;
+
+		if (sscanf(line, "%*s %*u %*u %*f %*u %3s %7s %llu + %u",
+			   action, rwbs, &sector, &nr)
+			!= 4
+		    || strcmp(action, "Q") || !nr)
+			continue;
+
+		if (b->nr_trace == max) {
+			max = max ? max * 2 : 4096;
+			op = realloc(b->trace, max * sizeof(*op));
+			if (!op) {
+				free(line);
+				fclose(file);
+				return -ENOMEM;
+			}
+			b->trace = op;
+		}
+
+		op = &b->trace[b->nr_trace];
+		if (strchr(rwbs, 'D'))
+			op->op = BENCH_DISCARD;
+		else if (strchr(rwbs, 'W'))
+			op->op = BENCH_WRITE;
+		else if (strchr(rwbs, 'R'))
+			op->op = BENCH_READ;
+		else
+			continue;
+
+		op->sector = sector % TOTAL_SECTORS(&b->dev);
+		op->nr = min_t(sector_t, nr,
+			       TOTAL_SECTORS(&b->dev) - op->sector);
+		b->nr_trace++;
+	}
+
+	free(line);
+	fclose(file);
+
+	if (!b->nr_trace) {
+		fprintf(stderr, "%s: no queued request found\n", path);
+		return -EINVAL;
+	}
+
+	return 0;
+}
+
+/* Run a pass of the garbage collector as its thread would, and time it */
+static unsigned int bench_gc(struct bench* b) {
+	struct csl_device* dev = &b->dev;
+	u64 start = now_ns();
+	unsigned int freed;
+	bool retiring;
+
+	WRITE_ONCE(dev->gc_kick, false);
+	freed = gc_run(dev, &retiring);
+	if (retiring)
+		WRITE_ONCE(dev->gc_kick, true);
+
+	if (b->nr_pauses == b->max_pauses) {
+		size_t max = b->max_pauses ? b->max_pauses * 2 : 1024;
+		u64* pauses = realloc(b->pauses, max * sizeof(u64));
+
+		if (!pauses)
+			return freed;
+		b->pauses = pauses;
+		b->max_pauses = max;
+	}
+	b->pauses[b->nr_pauses++] = now_ns() - start;
+
+	return freed;
+}
+
+/* Start at the data of a request, held by @bio */
+static void bench_iter_init(struct csl_rq_iter* it, struct bio* bio, u8* buf,
+			    sector_t sector, unsigned int nr) {
+	*bio = (struct bio){
+	    .bi_iter = {.bi_sector = sector,
+			.bi_size = nr << CSL_SECTOR_SHIFT},
+	    .bi_buf = buf,
+	};
+	it->bio = bio;
+	it->iter = bio->bi_iter;
+}
+
+/* Publish the deferred writes of the batch, and start the next batch */
+static void bench_publish(struct bench* b) {
+	publish_batch(&b->dev, b->ch, b->pending);
+
+	for (struct csl_cmd* cmd = b->pending; cmd; cmd = cmd->next)
+		cmd->nr_extents = 0;
+
+	b->pending = NULL;
+	b->tail = &b->pending;
+	b->nr_batched = 0;
+}
+
+/**
+ * bench_write - Write sectors through the write path of the driver
+ *
+ * @b: Benchmark pointer
+ * @buf: Data of the sectors
+ * @sector: First sector index
+ * @nr: Number of sectors
+ *
+ * The write is reserved and filled, and its map update is left to the end of
+ * the batch when it fits in the request data. A write that finds no free
+ * segment publishes the batch and runs the garbage collector before it is
+ * written again, as the driver requeues it.
+ *
+ * Return: 0 on success, -ENOSPC if the garbage collector cannot free any
+ * segment
+ */
+static int bench_write(struct bench* b, u8* buf, sector_t sector,
+		       unsigned int nr) {
+	struct csl_device* dev = &b->dev;
+	struct csl_cmd* cmd = &b->cmds[b->nr_batched];
+	struct csl_rq_iter it;
+	struct bio bio;
+
+	for (;;) {
+		bench_iter_init(&it, &bio, buf, sector, nr);
+		if (write_sectors(dev, b->ch, cmd, &it, sector, nr, true)
+		    != -EAGAIN)
+			break;
+
+		b->nr_stalls++;
+		bench_publish(b);
+		cmd = &b->cmds[0];
+		if (!bench_gc(b) && !READ_ONCE(dev->gc_kick))
+			return -ENOSPC;
+	}
+
+	if (cmd->nr_extents) {
+		cmd->next = NULL;
+		*b->tail = cmd;
+		b->tail = &cmd->next;
+	}
+
+	if (READ_ONCE(dev->gc_kick))
+		bench_gc(b);
+
+	return 0;
+}
+
+/* Run a request, split in requests the driver would get */
+static int bench_op(struct bench* b, struct bench_op* op) {
+	struct csl_device* dev = &b->dev;
+	sector_t sector = op->sector;
+	unsigned int nr = op->nr;
+
+	if (op->op == BENCH_DISCARD) {
+		b->nr_discards++;
+		unmap_sectors(dev, b->ch, sector, nr, false);
+		if (++b->nr_batched == b->batch)
+			bench_publish(b);
+		return 0;
+	}
+
+	while (nr) {
+		unsigned int len = min(nr, CSL_MAX_RQ_SECTORS);
+
+		if (op->op == BENCH_READ) {
+			struct csl_rq_iter it;
+			struct bio bio;
+
+			b->nr_reads++;
+			b->read_sectors += len;
+			bench_iter_init(&it, &bio, b->buf, sector, len);
+			b->unmapped_sectors +=
+			    read_sectors(dev, &it, sector, len);
+		} else {
+			b->nr_writes++;
+			b->write_sectors += len;
+			if (bench_write(b, b->buf, sector, len))
+				return -ENOSPC;
+		}
+
+		if (++b->nr_batched == b->batch)
+			bench_publish(b);
+
+		sector += len;
+		nr -= len;
+	}
+
+	return 0;
+}
+
+/**
+ * fill_device - Write the whole device once
+ *
+ * @b: Benchmark pointer
+ *
+ * The garbage collector only has work once every segment was written, so the
+ * workload starts on a full device, and the counters start from there.
+ *
+ * Return: 0 on success, -ENOSPC if the device ran out of space
+ */
+static int fill_device(struct bench* b) {
+	struct csl_device* dev = &b->dev;
+	struct bench_op op = {.op = BENCH_WRITE};
+
+	for (op.sector = 0; op.sector < TOTAL_SECTORS(dev);
+	     op.sector += op.nr) {
+		op.nr = min_t(sector_t, CSL_MAX_RQ_SECTORS,
+			      TOTAL_SECTORS(dev) - op.sector);
+		if (bench_op(b, &op))
+			return -ENOSPC;
+	}
+	bench_publish(b);
+
+	for (unsigned int i = 0; i < dev->nr_domains; i++) {
+		dev->domains[i].nr_host_writes = 0;
+		dev->domains[i].nr_gc_writes = 0;
+		dev->domains[i].nr_collected = 0;
+	}
+	dev->nr_gc_runs = 0;
+	b->nr_writes = b->write_sectors = 0;
+	b->nr_stalls = 0;
+	b->nr_pauses = 0;
+	memset(&b->stats, 0, sizeof(b->stats));
+
+	return 0;
+}
+
+/**
+ * check_map - Check the mapping tables against the segments
+ *
+ * @b: Benchmark pointer
+ *
+ * Every mapped unit must be found again through the reverse map, and the
+ * valid blocks of every segment must match its count.
+ *
+ * Return: 0 if the tables are consistent, -EINVAL otherwise
+ */
+static int check_map(struct bench* b) {
+	struct csl_device* dev = &b->dev;
+	u32* valid = calloc(NR_CHUNKS(dev), sizeof(u32));
+	int ret = 0;
+
+	if (!valid)
+		return -ENOMEM;
+
+	for (unsigned long unit = 0; unit < NR_UNITS(dev); unit++) {
+		u32 p_idx = dev->map[unit];
+
+		if (p_idx == CSL_UNMAPPED)
+			continue;
+
+		if (p_idx >= NR_BLOCKS(dev) || dev->p2l[p_idx] != unit) {
+			fprintf(stderr,
+				"unit %lu maps to block %u of unit %d\n", unit,
+				p_idx,
+				p_idx < NR_BLOCKS(dev) ? (int)dev->p2l[p_idx]
+						       : -1);
+			ret = -EINVAL;
+			goto out;
+		}
+		valid[p_idx >> SEG_SHIFT(dev)]++;
+	}
+
+	for (unsigned int i = 0; i < dev->nr_domains; i++) {
+		for (unsigned int j = 0; j < dev->nr_segs; j++) {
+			struct csl_segment* seg = &dev->domains[i].segs[j];
+
+			if (seg->nr_valid == valid[(size_t)i * dev->nr_segs + j]
+			    && !seg->nr_pending)
+				continue;
+
+			fprintf(stderr,
+				"segment %u of domain %u has %u valid and %u "
+				"pending blocks, %u are mapped\n",
+				j, i, seg->nr_valid, seg->nr_pending,
+				valid[(size_t)i * dev->nr_segs + j]);
+			ret = -EINVAL;
+			goto out;
+		}
+	}
+
+out:
+	free(valid);
+	return ret;
+}
+
+static int compare_u64(const void* a, const void* b) {
+	u64 x = *(const u64*)a, y = *(const u64*)b;
+
+	return (x > y) - (x < y);
+}
+
+/* Print the results of a run of @ns nanoseconds */
+static void print_results(struct bench* b, u64 ops, u64 ns) {
+	struct csl_device* dev = &b->dev;
+	u64 waf = write_amplification(dev);
+	u64 collected = 0, migrated = 0, total = 0;
+	double sec = ns / 1e9;
+
+	for (unsigned int i = 0; i < dev->nr_domains; i++) {
+		collected += dev->domains[i].nr_collected;
+		migrated += dev->domains[i].nr_gc_writes;
+	}
+
+	for (size_t i = 0; i < b->nr_pauses; i++)
+		total += b->pauses[i];
+	qsort(b->pauses, b->nr_pauses, sizeof(u64), compare_u64);
+
+	printf("time: %.3f s, %.0f ops/sec, %.1f MiB/s\n", sec, ops / sec,
+	       ((b->read_sectors + b->write_sectors) << CSL_SECTOR_SHIFT)
+		   / sec / (1 << 20));
+	printf("reads: %llu, %llu MiB, %llu MiB unmapped\n",
+	       (unsigned long long)b->nr_reads,
+	       (unsigned long long)(b->read_sectors >> 11),
+	       (unsigned long long)(b->unmapped_sectors >> 11));
+	printf("writes: %llu, %llu MiB\n", (unsigned long long)b->nr_writes,
+	       (unsigned long long)(b->write_sectors >> 11));
+	printf("discards: %llu\n", (unsigned long long)b->nr_discards);
+	printf("domain locks: %llu, wait %.3f ms, held %.3f ms, %llu "
+	       "stalls\n",
+	       (unsigned long long)b->stats.nr_locks,
+	       b->stats.lock_wait_ns / 1e6, b->stats.lock_hold_ns / 1e6,
+	       (unsigned long long)b->nr_stalls);
+	printf("gc: %zu passes, %llu segments collected, %llu blocks "
+	       "migrated\n",
+	       b->nr_pauses, (unsigned long long)collected,
+	       (unsigned long long)migrated);
+	if (b->nr_pauses)
+		printf("gc pauses: total %.3f ms, mean %.1f us, p50 %.1f us, "
+		       "p99 %.1f us, max %.1f us\n",
+		       total / 1e6, total / 1e3 / b->nr_pauses,
+		       b->pauses[b->nr_pauses / 2] / 1e3,
+		       b->pauses[b->nr_pauses * 99 / 100] / 1e3,
+		       b->pauses[b->nr_pauses - 1] / 1e3);
+	printf("write amplification: %llu.%02llu\n",
+	       (unsigned long long)(waf / 100),
+	       (unsigned long long)(waf % 100));
+}
+
+static void usage(const char* prog) {
+	fprintf(stderr,
+		"Usage: %s [options]\n"
+		"  -c MB      logical capacity (default 64)\n"
+		"  -d N       number of domains (default 4)\n"
+		"  -u N       mapping unit in sectors (default 8)\n"
+		"  -o N       overprovisioned segments in percent (default 7)\n"
+		"  -p POLICY  greedy, cost-benefit or fifo (default greedy)\n"
+		"  -w LOAD    seq, uniform or zipf (default uniform)\n"
+		"  -t FILE    replay a blkparse text trace instead\n"
+		"  -n N       number of requests (default 1000000, or the "
+		"trace)\n"
+		"  -r N       reads in percent (default 0)\n"
+		"  -s N       request size in sectors (default 8)\n"
+		"  -z THETA   zipf skew, between 0 and 1 (default 0.99)\n"
+		"  -S SEED    random seed (default 1)\n"
+		"  -b N       requests per batch (default 32)\n"
+		"  -e         start from an empty device instead of a full "
+		"one\n",
+		prog);
+}
+
+int main(int argc, char** argv) {
+	struct bench b = {
+	    .workload = BENCH_UNIFORM,
+	    .io_sectors = 8,
+	    .theta = 0.99,
+	    .rand = 1,
+	    .batch = BENCH_DEFAULT_BATCH,
+	};
+	struct csl_device* dev = &b.dev;
+	unsigned int capacity_mb = 64, nr_domains = 4, map_unit = 8;
+	unsigned int op_percent = 7, policy = CSL_GC_GREEDY;
+	const char* trace = NULL;
+	bool fill = true;
+	u64 start, ops;
+	int opt, ret;
+
+	while ((opt = getopt(argc, argv, "c:d:u:o:p:w:t:n:r:s:z:S:b:eh"))
+	       != -1) {
+		switch (opt) {
+		case 'c':
+			capacity_mb = strtoul(optarg, NULL, 0);
+			break;
+		case 'd':
+			nr_domains = strtoul(optarg, NULL, 0);
+			break;
+		case 'u':
+			map_unit = strtoul(optarg, NULL, 0);
+			break;
+		case 'o':
+			op_percent = strtoul(optarg, NULL, 0);
+			break;
+		case 'p':
+			for (policy = 0; policy < CSL_NR_GC_POLICIES; policy++)
+				if (!strcmp(optarg, gc_policy_name(policy)))
+					break;
+			if (policy == CSL_NR_GC_POLICIES) {
+				usage(argv[0]);
+				return 1;
+			}
+			break;
+		case 'w':
+			for (b.workload = 0; b.workload < BENCH_TRACE;
+			     b.workload++)
+				if (!strcmp(optarg, workload_names[b.workload]))
+					break;
+			if (b.workload == BENCH_TRACE) {
+				usage(argv[0]);
+				return 1;
+			}
+			break;
+		case 't':
+			trace = optarg;
+			break;
+		case 'n':
+			b.nr_ops = strtoull(optarg, NULL, 0);
+			break;
+		case 'r':
+			b.read_percent = strtoul(optarg, NULL, 0);
+			break;
+		case 's':
+			b.io_sectors = strtoul(optarg, NULL, 0);
+			break;
+		case 'z':
+			b.theta = strtod(optarg, NULL);
+			break;
+		case 'S':
+			b.rand = strtoull(optarg, NULL, 0) ?: 1;
+			break;
+		case 'b':
+			b.batch = strtoul(optarg, NULL, 0);
+			break;
+		case 'e':
+			fill = false;
+			break;
+		default:
+			usage(argv[0]);
+			return opt != 'h';
+		}
+	}
+
+	if (b.theta <= 0 || b.theta >= 1 || b.read_percent > 100
+	    || !b.io_sectors || !b.batch) {
+		usage(argv[0]);
+		return 1;
+	}
+
+	initialize_geometry(dev, capacity_mb, nr_domains, map_unit,
+			    op_percent);
+	dev->gc_policy = policy;
+	snprintf(b.disk.disk_name, sizeof(b.disk.disk_name), "%s0",
+		 DEVICE_NAME);
+	dev->disk = &b.disk;
+	b.io_sectors = min_t(sector_t, b.io_sectors, TOTAL_SECTORS(dev));
+
+	if (trace) {
+		b.workload = BENCH_TRACE;
+		if (load_trace(&b, trace))
+			return 1;
+		if (!b.nr_ops)
+			b.nr_ops = b.nr_trace;
+	} else if (!b.nr_ops) {
+		b.nr_ops = 1000000;
+	}
+	if (b.workload == BENCH_ZIPF)
+		zipf_init(&b, TOTAL_SECTORS(dev) / b.io_sectors);
+
+	b.buf =
+	    aligned_alloc(PAGE_SIZE, CSL_MAX_RQ_SECTORS << CSL_SECTOR_SHIFT);
+	b.ch = calloc(1, sizeof(*b.ch) + dev->nr_domains * sizeof(atomic64_t));
+	b.cmds = calloc(b.batch, sizeof(struct csl_cmd));
+	if (!b.buf || !b.ch || !b.cmds || allocate_chunks(dev)
+	    || initialize_domains(dev) || initialize_map(dev)) {
+		fprintf(stderr, "Failed to allocate the device\n");
+		return 1;
+	}
+	gc_init(dev);
+
+	/* one hardware queue on node 0 */
+	b.ch->dev = dev;
+	b.ch->stats = &b.stats;
+	b.hctx.driver_data = b.ch;
+	b.queue.hctxs = &b.hctx;
+	b.queue.nr_hw_queues = 1;
+	dev->queue = &b.queue;
+	b.tail = &b.pending;
+
+	/* fault the data in, so the run does not pay for it */
+	memset(b.buf, 0xa5, CSL_MAX_RQ_SECTORS << CSL_SECTOR_SHIFT);
+	for (size_t i = 0; i < NR_CHUNKS(dev); i++)
+		memset(dev->chunks[i], 0, CSL_CHUNK_SIZE);
+
+	printf("device: %u MiB, %u domains, %u byte units, %u segments per "
+	       "domain, %u overprovisioned, %s, %s, batches of %u\n",
+	       (unsigned int)(TOTAL_SECTORS(dev) >> 11), dev->nr_domains,
+	       UNIT_SIZE(dev), dev->nr_segs,
+	       dev->nr_segs - (unsigned int)DOMAIN_LOGICAL_SEGS(dev),
+	       gc_policy_name(dev->gc_policy), LOCK_NAME, b.batch);
+	if (trace)
+		printf("workload: %s %s, %zu requests, %llu run\n",
+		       workload_names[b.workload], trace, b.nr_trace,
+		       (unsigned long long)b.nr_ops);
+	else
+		printf("workload: %s, %llu requests of %u bytes, %u%% reads\n",
+		       workload_names[b.workload], (unsigned long long)b.nr_ops,
+		       b.io_sectors << CSL_SECTOR_SHIFT, b.read_percent);
+
+	if (fill && fill_device(&b)) {
+		fprintf(stderr, "No space left to fill the device\n");
+		return 1;
+	}
+
+	start = now_ns();
+	for (ops = 0; ops < b.nr_ops; ops++) {
+		struct bench_op op;
+
+		if (b.workload == BENCH_TRACE)
+			op = b.trace[ops % b.nr_trace];
+		else
+			next_op(&b, &op);
+
+		if (bench_op(&b, &op)) {
+			fprintf(stderr, "No space left after %llu requests\n",
+				(unsigned long long)ops);
+			break;
+		}
+	}
+	bench_publish(&b);
+	print_results(&b, ops, now_ns() - start);
+
+	/* the blocks left in the frontiers are not mapped */
+	release_frontiers(dev);
+	ret = check_map(&b);
+	printf("map check: %s\n", ret ? "FAILED" : "ok");
+
+	free_metadata(dev);
+	free_chunks(dev->chunks, NR_CHUNKS(dev));
+	free(b.trace);
+	free(b.pauses);
+	free(b.cmds);
+	free(b.ch);
+	free(b.buf);
+
+	return ret || ops < b.nr_ops;
+}
@@ -0,0 +1,343 @@
+/*
+ * Userspace definitions of the kernel interfaces used by the FTL core,
+ * ftl.c, gc.c and rq.c, so they build unchanged into the benchmark. The
+ * compiler includes this file first, and the kernel headers are empty files
+ * generated by the Makefile.
+ *
+ * There is a single NUMA node and no RCU reader outside the benchmark thread,
+ * so every grace period has elapsed as soon as it starts. The domain locks
+ * are pthread locks, for every lock option of lock.h. The garbage collector
+ * thread is never started, the benchmark runs its passes itself.
+ */
+
+#include <errno.h>
+#include <limits.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#ifndef __CSL_KCOMPAT
+#define __CSL_KCOMPAT
+
+typedef uint8_t u8;
+typedef uint16_t u16;
+typedef uint32_t u32;
+typedef unsigned long long u64;
+typedef long long s64;
+typedef u64 sector_t;
+typedef unsigned int gfp_t;
+
+#define U32_MAX UINT32_MAX
+#define U64_MAX UINT64_MAX
+
+#define __percpu
+#define __user
+#define SMP_CACHE_BYTES 64
+#define ____cacheline_aligned_in_smp __attribute__((aligned(SMP_CACHE_BYTES)))
+
+/* Configuration options, IS_ENABLED(DEBUG) is set by -DDEBUG */
+#define __ARG_PLACEHOLDER_1 0,
+#define __take_second_arg(__ignored, val, ...) val
+#define ____is_defined(arg1_or_junk) __take_second_arg(arg1_or_junk 1, 0)
+#define ___is_defined(val) ____is_defined(__ARG_PLACEHOLDER_##val)
+#define __is_defined(x) ___is_defined(x)
+#define IS_ENABLED(option) __is_defined(option)
+
+/* Printing */
+#define KERN_INFO ""
+#define pr_fmt(fmt) fmt
+#define printk(fmt, ...) fprintf(stderr, fmt, ##__VA_ARGS__)
+#define pr_info(fmt, ...) fprintf(stderr, fmt, ##__VA_ARGS__)
+#define pr_err(fmt, ...) fprintf(stderr, fmt, ##__VA_ARGS__)
+
+/* Arithmetic */
+#define min(a, b)                          \
+	({                                 \
+		typeof(a) _a = (a);        \
+		typeof(b) _b = (b);        \
+		_a < _b ? _a : _b;         \
+	})
+#define max(a, b)                          \
+	({                                 \
+		typeof(a) _a = (a);        \
+		typeof(b) _b = (b);        \
+		_a > _b ? _a : _b;         \
+	})
+#define min_t(type, a, b) min((type)(a), (type)(b))
+#define max_t(type, a, b) max((type)(a), (type)(b))
+#define clamp_t(type, val, lo, hi) min_t(type, max_t(type, val, lo), hi)
+#define DIV_ROUND_UP(n, d) (((n) + (d) - 1) / (d))
+#define round_down(x, y) ((x) & ~((typeof(x))(y) - 1))
+
+static inline u64 div_u64(u64 dividend, u32 divisor) {
+	return dividend / divisor;
+}
+
+static inline u64 div64_u64(u64 dividend, u64 divisor) {
+	return dividend / divisor;
+}
+
+static inline unsigned int ilog2(unsigned long n) {
+	return 8 * sizeof(n) - 1 - __builtin_clzl(n);
+}
+
+static inline unsigned long rounddown_pow_of_two(unsigned long n) {
+	return 1UL << ilog2(n);
+}
+
+/* Memory ordering, the benchmark is built for cache-coherent machines */
+#define READ_ONCE(x) (*(const volatile typeof(x)*)&(x))
+#define WRITE_ONCE(x, val) (*(volatile typeof(x)*)&(x) = (val))
+#define smp_store_release(p, v) __atomic_store_n(p, v, __ATOMIC_RELEASE)
+
+typedef struct {
+	s64 counter;
+} atomic64_t;
+
+#define atomic64_read(v) __atomic_load_n(&(v)->counter, __ATOMIC_RELAXED)
+#define atomic64_xchg(v, new) \
+	__atomic_exchange_n(&(v)->counter, new, __ATOMIC_SEQ_CST)
+#define atomic64_try_cmpxchg(v, old, new)                              \
+	__atomic_compare_exchange_n(&(v)->counter, old, new, false,    \
+				    __ATOMIC_SEQ_CST, __ATOMIC_RELAXED)
+
+/* Per-CPU counters, the benchmark runs on one thread */
+#define this_cpu_inc(var) ((var)++)
+#define this_cpu_add(var, val) ((var) += (val))
+
+/* Errors in pointers */
+#define MAX_ERRNO 4095
+#define IS_ERR(ptr) ((unsigned long)(ptr) >= (unsigned long)-MAX_ERRNO)
+#define PTR_ERR(ptr) ((long)(ptr))
+#define ERR_PTR(err) ((void*)(long)(err))
+
+/* Allocation, every allocation is aligned to a cacheline like the slab */
+#define GFP_KERNEL 0
+#define PAGE_SHIFT 12
+#define PAGE_SIZE (1UL << PAGE_SHIFT)
+
+static inline void* kvmalloc_array(size_t n, size_t size, gfp_t flags) {
+	size_t len;
+
+	if (__builtin_mul_overflow(n, size, &len))
+		return NULL;
+
+	len = (len + SMP_CACHE_BYTES - 1) & ~(SMP_CACHE_BYTES - 1);
+	return aligned_alloc(SMP_CACHE_BYTES, len);
+}
+
+static inline void* kvcalloc(size_t n, size_t size, gfp_t flags) {
+	void* ptr = kvmalloc_array(n, size, flags);
+
+	if (ptr)
+		memset(ptr, 0, n * size);
+	return ptr;
+}
+
+#define kcalloc kvcalloc
+#define kfree free
+#define kvfree free
+
+/* Pages are the memory they point to, all on node 0 */
+struct page;
+
+#define MAX_NUMNODES 1
+#define nr_node_ids 1
+#define first_online_node 0
+#define next_online_node(node) MAX_NUMNODES
+#define for_each_online_node(node) \
+	for ((node) = 0; (node) < MAX_NUMNODES; (node)++)
+
+static inline unsigned int get_order(unsigned long size) {
+	return size > PAGE_SIZE ? ilog2(size - 1) + 1 - PAGE_SHIFT : 0;
+}
+
+static inline struct page* alloc_pages_node(int node, gfp_t flags,
+					    unsigned int order) {
+	return aligned_alloc(PAGE_SIZE, PAGE_SIZE << order);
+}
+
+#define page_address(page) ((void*)(page))
+#define virt_to_page(addr) ((struct page*)(addr))
+#define page_to_nid(page) 0
+#define free_pages(addr, order) free((void*)(addr))
+
+/* Locks of the domains */
+typedef pthread_rwlock_t rwlock_t;
+#define rwlock_init(lock) pthread_rwlock_init(lock, NULL)
+#define read_lock(lock) pthread_rwlock_rdlock(lock)
+#define read_unlock(lock) pthread_rwlock_unlock(lock)
+#define write_lock(lock) pthread_rwlock_wrlock(lock)
+#define write_unlock(lock) pthread_rwlock_unlock(lock)
+
+struct mutex {
+	pthread_mutex_t lock;
+};
+#define mutex_init(m) pthread_mutex_init(&(m)->lock, NULL)
+#define mutex_lock(m) pthread_mutex_lock(&(m)->lock)
+#define mutex_unlock(m) pthread_mutex_unlock(&(m)->lock)
+
+struct semaphore {
+	sem_t sem;
+};
+#define sema_init(s, val) sem_init(&(s)->sem, 0, val)
+#define down(s) sem_wait(&(s)->sem)
+#define up(s) sem_post(&(s)->sem)
+
+struct rw_semaphore {
+	pthread_rwlock_t lock;
+};
+#define init_rwsem(s) pthread_rwlock_init(&(s)->lock, NULL)
+#define down_read(s) pthread_rwlock_rdlock(&(s)->lock)
+#define up_read(s) pthread_rwlock_unlock(&(s)->lock)
+#define down_write(s) pthread_rwlock_wrlock(&(s)->lock)
+#define up_write(s) pthread_rwlock_unlock(&(s)->lock)
+
+typedef struct {
+	int locked;
+} spinlock_t;
+
+/* Lists of the segments */
+struct list_head {
+	struct list_head *next, *prev;
+};
+
+#define container_of(ptr, type, member) \
+	((type*)((char*)(ptr) - offsetof(type, member)))
+#define list_entry(ptr, type, member) container_of(ptr, type, member)
+#define list_first_entry(head, type, member) \
+	list_entry((head)->next, type, member)
+
+static inline void INIT_LIST_HEAD(struct list_head* list) {
+	list->next = list;
+	list->prev = list;
+}
+
+static inline bool list_empty(const struct list_head* head) {
+	return head->next == head;
+}
+
+static inline void list_add_tail(struct list_head* entry,
+				 struct list_head* head) {
+	entry->prev = head->prev;
+	entry->next = head;
+	head->prev->next = entry;
+	head->prev = entry;
+}
+
+static inline void list_del_init(struct list_head* entry) {
+	entry->prev->next = entry->next;
+	entry->next->prev = entry->prev;
+	INIT_LIST_HEAD(entry);
+}
+
+static inline void list_move_tail(struct list_head* entry,
+				  struct list_head* head) {
+	list_del_init(entry);
+	list_add_tail(entry, head);
+}
+
+/* RCU, a grace period has always elapsed */
+#define rcu_read_lock() do { } while (0)
+#define rcu_read_unlock() do { } while (0)
+#define synchronize_rcu() do { } while (0)
+#define start_poll_synchronize_rcu() 0UL
+#define poll_state_synchronize_rcu(gp) true
+
+/* Scheduling, the garbage collector thread is never started */
+struct task_struct;
+
+typedef struct {
+	int unused;
+} wait_queue_head_t;
+
+#define init_waitqueue_head(wq) do { } while (0)
+#define wake_up(wq) do { } while (0)
+#define wait_event_interruptible(wq, cond) do { } while (0)
+#define cond_resched() do { } while (0)
+#define kthread_should_stop() true
+#define kthread_run(fn, data, fmt, ...) ((void)(fn), ERR_PTR(-ENOSYS))
+#define kthread_stop(task) do { } while (0)
+
+static inline u64 ktime_get_ns(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (u64)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* Block layer, the request queue is an array of hardware queues, and a bio
+ * holds the data of a request in one buffer */
+struct request;
+
+struct gendisk {
+	char disk_name[32];
+};
+
+struct blk_mq_hw_ctx {
+	void* driver_data;
+};
+
+struct request_queue {
+	struct blk_mq_hw_ctx* hctxs;
+	unsigned long nr_hw_queues;
+};
+
+#define queue_for_each_hw_ctx(q, hctx, i)                              \
+	for ((i) = 0;                                                  \
+	     (i) < (q)->nr_hw_queues && ((hctx) = &(q)->hctxs[i]); (i)++)
+
+#define READ 0
+#define WRITE 1
+
+struct bvec_iter {
+	sector_t bi_sector;
+	unsigned int bi_size;
+	unsigned int bi_idx;
+	unsigned int bi_bvec_done;
+};
+
+struct bio_vec {
+	struct page* bv_page;
+	unsigned int bv_len;
+	unsigned int bv_offset;
+};
+
+struct bio {
+	struct bio* bi_next;
+	struct bvec_iter bi_iter;
+	void* bi_buf;
+};
+
+/* The rest of the buffer is one segment */
+static inline struct bio_vec bio_iter_iovec(struct bio* bio,
+					    struct bvec_iter iter) {
+	return (struct bio_vec){
+	    .bv_page = virt_to_page(bio->bi_buf),
+	    .bv_len = iter.bi_size,
+	    .bv_offset = iter.bi_bvec_done,
+	};
+}
+
+static inline void bio_advance_iter_single(struct bio* bio,
+					   struct bvec_iter* iter,
+					   unsigned int bytes) {
+	iter->bi_sector += bytes >> 9;
+	iter->bi_size -= bytes;
+	iter->bi_bvec_done += bytes;
+}
+
+#define blk_mq_run_hw_queues(q, async) do { } while (0)
+
+/* Tracepoints are empty functions */
+#define TP_PROTO(args...) args
+#define TRACE_EVENT(name, proto, ...) \
+	static inline void trace_##name(proto) {}
+
+#endif
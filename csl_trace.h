@@ -0,0 +1,250 @@
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM csl
+
+#if !defined(__CSL_TRACE) || defined(TRACE_HEADER_MULTI_READ)
+#define __CSL_TRACE
+
+#include <linux/blk-mq.h>
+#include <linux/blkdev.h>
+#include <linux/ktime.h>
+#include <linux/tracepoint.h>
+#include "type.h"
+
+/*
+ * Tracepoints of the request, mapping and garbage collection paths, in
+ * /sys/kernel/tracing/events/csl. They are static branches that cost nothing
+ * until perf or bpftrace attaches to them. dev.c defines them.
+ */
+
+#define show_csl_op(op)                                      \
+	__print_symbolic(op, { REQ_OP_READ, "READ" },        \
+			 { REQ_OP_WRITE, "WRITE" },          \
+			 { REQ_OP_FLUSH, "FLUSH" },          \
+			 { REQ_OP_DISCARD, "DISCARD" },      \
+			 { REQ_OP_WRITE_ZEROES, "WRITE_ZEROES" })
+
+/* A request is dispatched to the driver */
+TRACE_EVENT(csl_rq_start,
+
+	TP_PROTO(struct request *rq),
+
+	TP_ARGS(rq),
+
+	TP_STRUCT__entry(
+		__field(dev_t, dev)
+		__field(unsigned int, hctx)
+		__field(unsigned int, op)
+		__field(unsigned int, fua)
+		__field(sector_t, sector)
+		__field(unsigned int, nr_sectors)
+	),
+
+	TP_fast_assign(
+		__entry->dev = disk_devt(rq->q->disk);
+		__entry->hctx = rq->mq_hctx->queue_num;
+		__entry->op = req_op(rq);
+		__entry->fua = !!(rq->cmd_flags & REQ_FUA);
+		__entry->sector = blk_rq_pos(rq);
+		__entry->nr_sectors = blk_rq_sectors(rq);
+	),
+
+	TP_printk("%d,%d hctx %u %s%s %llu + %u",
+		  MAJOR(__entry->dev), MINOR(__entry->dev), __entry->hctx,
+		  show_csl_op(__entry->op), __entry->fua ? " FUA" : "",
+		  (unsigned long long)__entry->sector, __entry->nr_sectors)
+);
+
+/* A request is handled, and completed or handed over */
+TRACE_EVENT(csl_rq_done,
+
+	TP_PROTO(struct request *rq, int error, unsigned int nr_bytes,
+		 u64 start_ns),
+
+	TP_ARGS(rq, error, nr_bytes, start_ns),
+
+	TP_STRUCT__entry(
+		__field(dev_t, dev)
+		__field(unsigned int, hctx)
+		__field(unsigned int, op)
+		__field(sector_t, sector)
+		__field(unsigned int, nr_bytes)
+		__field(int, error)
+		__field(u64, lat_ns)
+	),
+
+	TP_fast_assign(
+		__entry->dev = disk_devt(rq->q->disk);
+		__entry->hctx = rq->mq_hctx->queue_num;
+		__entry->op = req_op(rq);
+		__entry->sector = blk_rq_pos(rq);
+		__entry->nr_bytes = nr_bytes;
+		__entry->error = error;
+		__entry->lat_ns = ktime_get_ns() - start_ns;
+	),
+
+	TP_printk("%d,%d hctx %u %s %llu bytes %u error %d latency %llu ns",
+		  MAJOR(__entry->dev), MINOR(__entry->dev), __entry->hctx,
+		  show_csl_op(__entry->op), (unsigned long long)__entry->sector,
+		  __entry->nr_bytes, __entry->error, __entry->lat_ns)
+);
+
+/* A read resolved an extent of units, CSL_UNMAPPED if never written */
+TRACE_EVENT(csl_map_lookup,
+
+	TP_PROTO(struct csl_device *dev, unsigned long unit, u32 p_idx,
+		 unsigned int nr_sectors),
+
+	TP_ARGS(dev, unit, p_idx, nr_sectors),
+
+	TP_STRUCT__entry(
+		__field(unsigned int, id)
+		__field(unsigned long, unit)
+		__field(u32, p_idx)
+		__field(unsigned int, nr_sectors)
+	),
+
+	TP_fast_assign(
+		__entry->id = dev->id;
+		__entry->unit = unit;
+		__entry->p_idx = p_idx;
+		__entry->nr_sectors = nr_sectors;
+	),
+
+	TP_printk("csl%u unit %lu -> %d sectors %u", __entry->id,
+		  __entry->unit, (int)__entry->p_idx, __entry->nr_sectors)
+);
+
+/* A unit is mapped to a new block, by a write, an unmap or the collector */
+TRACE_EVENT(csl_remap,
+
+	TP_PROTO(struct csl_device *dev, unsigned long unit, u32 old_idx,
+		 u32 new_idx, bool gc),
+
+	TP_ARGS(dev, unit, old_idx, new_idx, gc),
+
+	TP_STRUCT__entry(
+		__field(unsigned int, id)
+		__field(unsigned long, unit)
+		__field(u32, old_idx)
+		__field(u32, new_idx)
+		__field(bool, gc)
+	),
+
+	TP_fast_assign(
+		__entry->id = dev->id;
+		__entry->unit = unit;
+		__entry->old_idx = old_idx;
+		__entry->new_idx = new_idx;
+		__entry->gc = gc;
+	),
+
+	TP_printk("csl%u unit %lu %d -> %d%s", __entry->id, __entry->unit,
+		  (int)__entry->old_idx, (int)__entry->new_idx,
+		  __entry->gc ? " gc" : "")
+);
+
+/* A domain has no free segment to open, writes are requeued */
+TRACE_EVENT(csl_no_space,
+
+	TP_PROTO(struct csl_device *dev, unsigned int domain,
+		 unsigned int nr_free_segs, unsigned int nr_retiring),
+
+	TP_ARGS(dev, domain, nr_free_segs, nr_retiring),
+
+	TP_STRUCT__entry(
+		__field(unsigned int, id)
+		__field(unsigned int, domain)
+		__field(unsigned int, nr_free_segs)
+		__field(unsigned int, nr_retiring)
+	),
+
+	TP_fast_assign(
+		__entry->id = dev->id;
+		__entry->domain = domain;
+		__entry->nr_free_segs = nr_free_segs;
+		__entry->nr_retiring = nr_retiring;
+	),
+
+	TP_printk("csl%u domain %u free %u retiring %u", __entry->id,
+		  __entry->domain, __entry->nr_free_segs, __entry->nr_retiring)
+);
+
+/* The garbage collector starts a pass */
+TRACE_EVENT(csl_gc_begin,
+
+	TP_PROTO(struct csl_device *dev),
+
+	TP_ARGS(dev),
+
+	TP_STRUCT__entry(
+		__field(unsigned int, id)
+		__field(u64, run)
+	),
+
+	TP_fast_assign(
+		__entry->id = dev->id;
+		__entry->run = dev->nr_gc_runs;
+	),
+
+	TP_printk("csl%u run %llu", __entry->id, __entry->run)
+);
+
+/* The garbage collector migrated the valid blocks of a victim */
+TRACE_EVENT(csl_gc_segment,
+
+	TP_PROTO(struct csl_device *dev, unsigned int domain, unsigned int seg,
+		 unsigned int nr_migrated),
+
+	TP_ARGS(dev, domain, seg, nr_migrated),
+
+	TP_STRUCT__entry(
+		__field(unsigned int, id)
+		__field(unsigned int, domain)
+		__field(unsigned int, seg)
+		__field(unsigned int, nr_migrated)
+	),
+
+	TP_fast_assign(
+		__entry->id = dev->id;
+		__entry->domain = domain;
+		__entry->seg = seg;
+		__entry->nr_migrated = nr_migrated;
+	),
+
+	TP_printk("csl%u domain %u segment %u migrated %u", __entry->id,
+		  __entry->domain, __entry->seg, __entry->nr_migrated)
+);
+
+/* The garbage collector ends a pass */
+TRACE_EVENT(csl_gc_end,
+
+	TP_PROTO(struct csl_device *dev, unsigned int nr_freed, bool retiring),
+
+	TP_ARGS(dev, nr_freed, retiring),
+
+	TP_STRUCT__entry(
+		__field(unsigned int, id)
+		__field(u64, run)
+		__field(unsigned int, nr_freed)
+		__field(bool, retiring)
+	),
+
+	TP_fast_assign(
+		__entry->id = dev->id;
+		__entry->run = dev->nr_gc_runs;
+		__entry->nr_freed = nr_freed;
+		__entry->retiring = retiring;
+	),
+
+	TP_printk("csl%u run %llu freed %u%s", __entry->id, __entry->run,
+		  __entry->nr_freed, __entry->retiring ? " retiring" : "")
+);
+
+#endif
+
+/* This part must be outside protection */
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE csl_trace
+#include <trace/define_trace.h>
@@ -1,61 +1,30 @@
+#include <linux/bitmap.h>
 #include <linux/blk-mq.h>
 #include <linux/blkdev.h>
+#include <linux/debugfs.h>
 #include <linux/delay.h>
 #include <linux/hdreg.h>
 #include <linux/init.h>
+#include <linux/log2.h>
 #include <linux/module.h>
+#include <linux/sizes.h>
 #include <linux/slab.h>
 #include <linux/version.h>
 #include <linux/vmalloc.h>
-#include <linux/xarray.h>
 #include <linux/spinlock.h>
 
+#include "backing.h"
 #include "file.h"
+#include "gc.h"
+#include "journal.h"
+#include "lock.h"
 #include "metadata.h"
+#include "rq.h"
+#include "stats.h"
 #include "type.h"
 
-/* if DEBUG is enabled, print debug message */
-#ifdef _USE_MUTEX
-#define GET_READ_LOCK(dev)                  \
-	mutex_lock(&dev->reader_cnt_mutex); \
-	dev->reader_nr++;                   \
-	if (dev->reader_nr == 1)            \
-		mutex_lock(&dev->rw_mutex); \
-	mutex_unlock(&dev->reader_cnt_mutex);
-#define RELEASE_READ_LOCK(dev)                \
-	mutex_lock(&dev->reader_cnt_mutex);    \
-	dev->reader_nr--;                     \
-	if (dev->reader_nr == 0)              \
-		mutex_unlock(&dev->rw_mutex); \
-	mutex_unlock(&dev->reader_cnt_mutex);
-#define GET_WRITE_LOCK(dev) mutex_lock(&dev->rw_mutex);
-#define RELEASE_WRITE_LOCK(dev) mutex_unlock(&dev->rw_mutex);
-#elif _USE_SEMAPHORE
-#define GET_READ_LOCK(dev)                 \
-	down(&dev->reader_cnt_mutex);      \
-	dev->reader_nr++;                  \
-	if (dev->reader_nr == 1)           \
-		down(&dev->rw_mutex);      \
-	up(&dev->reader_cnt_mutex);
-#define RELEASE_READ_LOCK(dev)             \
-	down(&dev->reader_cnt_mutex);      \
-	dev->reader_nr--;                  \
-	if (dev->reader_nr == 0)           \
-		up(&dev->rw_mutex);        \
-	up(&dev->reader_cnt_mutex);
-#define GET_WRITE_LOCK(dev) down(&dev->rw_mutex);
-#define RELEASE_WRITE_LOCK(dev) up(&dev->rw_mutex);
-#elif _USE_RWSEMAPHORE
-#define GET_READ_LOCK(dev) down_read(&dev->rw_mutex);
-#define RELEASE_READ_LOCK(dev) up_read(&dev->rw_mutex);
-#define GET_WRITE_LOCK(dev) down_write(&dev->rw_mutex);
-#define RELEASE_WRITE_LOCK(dev) up_write(&dev->rw_mutex);
-#else
-#define GET_READ_LOCK(dev) read_lock(&dev->rwlock);
-#define RELEASE_READ_LOCK(dev) read_unlock(&dev->rwlock);
-#define GET_WRITE_LOCK(dev) write_lock(&dev->rwlock);
-#define RELEASE_WRITE_LOCK(dev) write_unlock(&dev->rwlock);
-#endif
+#define CREATE_TRACE_POINTS
+#include "csl_trace.h"
 
 /* Module information */
 MODULE_LICENSE("GPL");
@@ -67,11 +36,119 @@ static uint __reset_device = 0;
 module_param(__reset_device, uint, S_IRUGO);
 
 MODULE_PARM_DESC(__reset_device, "Reset device");
+
+static uint __nr_domains = 0;
+
+module_param(__nr_domains, uint, S_IRUGO);
+
+MODULE_PARM_DESC(__nr_domains,
+		 "Number of independently locked FTL domains "
+		 "(rounded down to a power of two, 0: one per CPU)");
+
+static uint __map_unit = 1;
+
+module_param(__map_unit, uint, S_IRUGO);
+
+MODULE_PARM_DESC(__map_unit,
+		 "Mapping unit in sectors (power of two, up to 128)");
+
+static uint __nr_devices = 1;
+
+module_param(__nr_devices, uint, S_IRUGO);
+
+MODULE_PARM_DESC(__nr_devices, "Number of devices to create at load");
+
+static uint __capacity_mb[CSL_MAX_DEVICES] = {
+    [0 ... CSL_MAX_DEVICES - 1] = CSL_DEFAULT_CAPACITY_MB};
+static int nr_capacity_mb = 0;
+
+module_param_array(__capacity_mb, uint, &nr_capacity_mb, S_IRUGO);
+
+MODULE_PARM_DESC(__capacity_mb,
+		 "Device capacity in MiB, one value per device "
+		 "(the last value is used for the remaining devices)");
+
+static uint __block_size = CSL_SECTOR_SIZE;
+
+module_param(__block_size, uint, S_IRUGO);
+
+MODULE_PARM_DESC(__block_size, "Logical block size in bytes (512 or 4096)");
+
+static uint __op_percent = 7;
+
+module_param(__op_percent, uint, S_IRUGO);
+
+MODULE_PARM_DESC(__op_percent,
+		 "Overprovisioned physical space in percent of the capacity "
+		 "(up to 100)");
+
+static uint __gc_policy = CSL_GC_GREEDY;
+
+module_param(__gc_policy, uint, S_IRUGO);
+
+MODULE_PARM_DESC(__gc_policy,
+		 "GC victim selection (0: greedy, 1: cost-benefit, 2: fifo)");
+
+static uint __journal_kb = CSL_DEFAULT_JOURNAL_KB;
+
+module_param(__journal_kb, uint, S_IRUGO);
+
+MODULE_PARM_DESC(__journal_kb,
+		 "Map update journal buffers in KiB per device "
+		 "(0: save the metadata on unload only)");
+
+static uint __checkpoint_sec = 30;
+
+module_param(__checkpoint_sec, uint, S_IRUGO);
+
+MODULE_PARM_DESC(__checkpoint_sec, "Seconds between two checkpoints");
+
+static uint __hw_queues = 0;
+
+module_param(__hw_queues, uint, S_IRUGO);
+
+MODULE_PARM_DESC(__hw_queues,
+		 "Hardware queues for regular I/O (0: one per possible CPU)");
+
+static uint __queue_depth = CSL_DEFAULT_QUEUE_DEPTH;
+
+module_param(__queue_depth, uint, S_IRUGO);
+
+MODULE_PARM_DESC(__queue_depth, "Tags of every hardware queue");
+
+static bool __blocking = LOCK_SLEEPS;
+
+module_param(__blocking, bool, S_IRUGO);
+
+MODULE_PARM_DESC(__blocking,
+		 "Dispatch requests in a context that may sleep "
+		 "(always on with the mutex and semaphore builds)");
+
+static uint __poll_queues = 0;
+
+module_param(__poll_queues, uint, S_IRUGO);
+
+MODULE_PARM_DESC(__poll_queues,
+		 "Hardware queues for polled I/O (io_uring IOPOLL), "
+		 "up to the number of CPUs");
+
+static char* __backing_file[CSL_MAX_DEVICES];
+static int nr_backing_file = 0;
+
+module_param_array(__backing_file, charp, &nr_backing_file, S_IRUGO);
+
+MODULE_PARM_DESC(__backing_file,
+		 "File that keeps the data of a device across reboots, "
+		 "one path per device created at load");
+
 /* Device major number */
 static int dev_major = 0;
 
-/* Pointer to the device structure */
-static struct csl_device* dev = NULL;
+/* List of the devices, devices are only added while the module is loaded */
+static LIST_HEAD(csl_devices);
+static DEFINE_MUTEX(csl_devices_mutex);
+static unsigned int nr_devices = 0;
+static bool csl_devices_ready = false;
 
 
 /* Function to open the block device */
@@ -96,282 +173,450 @@ static struct block_device_operations csl_dev_ops = {
     .owner = THIS_MODULE, .open = dev_open, .release = dev_release};
 
 /**
- * garbage_collecting - Garbage collecting
- *
- * @dev: Device pointer
+ * rq_iter_init - Start at the first data segment of a request
  *
- * Move all dirty blocks to the free list
+ * @it: Request iterator
+ * @rq: Request
  */
-static void garbage_collecting(struct csl_device* dev) {
-	DEBUG_MESSAGE("%sFree list is empty. Garbage collecting\n", PROMPT);
-
-	struct sector_list_entry *tmp, *n;
-
-	list_for_each_entry_safe(tmp, n, &dev->dirtylist, list) {
-		list_del(&tmp->list);
-		list_add_tail(&tmp->list, &dev->freelist);
-	}
+static void rq_iter_init(struct csl_rq_iter* it, struct request* rq) {
+	it->bio = rq->bio;
+	if (it->bio)
+		it->iter = it->bio->bi_iter;
 }
 
 /**
- * read_sector - Read sector from device
+ * dev_request_handle - Handle a block request
  *
- * @dev: Device pointer
- * @idx: Sector index
- * @buf: Buffer to store data
- * @len: Length of data
+ * @rq: Request
+ * @nr_bytes: Number of bytes handled
+ * @defer: Leave the map update of a write to the caller when possible
  *
- * Read data from the device and store it in the buffer
+ * Return: 0 on success, -EAGAIN if there is no free block, negative error
+ * code on failure. A deferred write keeps its extents in its request data.
  */
-static void read_sector(struct csl_device* dev, unsigned long idx, void* buf,
-			unsigned int len) {
-	void* ret;
-	struct sector_mapping_entry* entry;
+static int dev_request_handle(struct request* rq, unsigned int* nr_bytes,
+			      bool defer) {
+	struct csl_device* dev = rq->q->queuedata;
+	struct csl_cmd* cmd = blk_mq_rq_to_pdu(rq);
+	struct csl_rq_iter it;
+	sector_t sector = blk_rq_pos(rq);
+	unsigned int nr = blk_rq_sectors(rq);
+	int ret = 0;
+
+	cmd->start_ns = ktime_get_ns();
+	cmd->nr_extents = 0;
+	trace_csl_rq_start(rq);
+
+	/* A flush is completed once the journal thread made it durable */
+	if (req_op(rq) == REQ_OP_FLUSH)
+		return 0;
+
+	/* Ensure the request does not exceed the device size */
+	if (sector >= TOTAL_SECTORS(dev))
+		return -EIO;
+	nr = min_t(sector_t, nr, TOTAL_SECTORS(dev) - sector);
+
+	DEBUG_MESSAGE("%sBlock length: %u, Block "
+		      "index: %llu, Request "
+		      "operation: %s\n",
+		      PROMPT, nr << CSL_SECTOR_SHIFT,
+		      (unsigned long long)sector, blk_op_str(req_op(rq)));
+
+	rq_iter_init(&it, rq);
+
+	switch (req_op(rq)) {
+	case REQ_OP_READ:
+		stats_unmapped_read(rq->mq_hctx->driver_data,
+				    read_sectors(dev, &it, sector, nr)
+					<< CSL_SECTOR_SHIFT);
+		break;
+	case REQ_OP_WRITE:
+		/* a request cut at the end of the device is not deferred, it
+		 * completes fewer bytes than it holds */
+		defer &= nr == blk_rq_sectors(rq);
+		ret = write_sectors(dev, rq->mq_hctx->driver_data, cmd, &it,
+				    sector, nr, defer);
+		break;
+	case REQ_OP_DISCARD:
+		ret = unmap_sectors(dev, rq->mq_hctx->driver_data, sector, nr,
+				    false);
+		break;
+	case REQ_OP_WRITE_ZEROES:
+		ret = unmap_sectors(dev, rq->mq_hctx->driver_data, sector, nr,
+				    true);
+		break;
+	default:
+		return -EOPNOTSUPP;
+	}
 
-	GET_READ_LOCK(dev);
+	if (ret)
+		return ret;
 
-	entry = xa_load(&dev->map, idx);
+	*nr_bytes = nr << CSL_SECTOR_SHIFT;
 
-	if (!entry) {
-		DEBUG_MESSAGE("%sBlock not found in map\n", PROMPT);
-	} else {
-		ret = IDX_PTR(dev, entry->p_idx);
-		memcpy(buf, ret, len);
-	}
+	return 0;
+}
 
-	RELEASE_READ_LOCK(dev);
+/* Complete a batch of requests that were handled successfully */
+static void dev_complete_batch(struct io_comp_batch* iob) {
+	blk_mq_end_request_batch(iob);
 }
 
 /**
- * write_sector - Write sector to device
+ * dev_complete_request - Complete a handled request
  *
  * @dev: Device pointer
- * @idx: Sector index
- * @buf: Buffer to store data
- * @len: Length of data
+ * @rq: Request
+ * @ret: Result of the request
+ * @nr_bytes: Number of bytes handled
+ * @iob: Batch to complete the request with, or NULL
+ * @kick: Wake the journal thread up for a deferred request
  *
- * Write data to the device from the buffer
+ * A request of a poll queue that succeeded is left to the poll callback,
+ * so the submitter completes it without any interrupt-style completion.
+ *
+ * Return: true if the request is left to the journal thread
  */
-static void write_sector(struct csl_device* dev, unsigned long idx, void* buf,
-			 unsigned int len) {
-	void* ret;
-	struct sector_mapping_entry* entry;
-
-	GET_WRITE_LOCK(dev);
+static bool dev_complete_request(struct csl_device* dev, struct request* rq,
+				 int ret, unsigned int nr_bytes,
+				 struct io_comp_batch* iob, bool kick) {
+	struct csl_cmd* cmd = blk_mq_rq_to_pdu(rq);
+	blk_status_t status = errno_to_blk_status(ret);
+	bool durable = !ret && dev->backing
+		       && (req_op(rq) == REQ_OP_FLUSH
+			   || rq->cmd_flags & REQ_FUA);
+
+	stats_complete(rq->mq_hctx->driver_data, rq, ret, nr_bytes,
+		       cmd->start_ns);
+	trace_csl_rq_done(rq, ret, nr_bytes, cmd->start_ns);
+
+	if (!ret && !durable && nr_bytes == blk_rq_bytes(rq)) {
+		struct csl_hctx* ch = rq->mq_hctx->driver_data;
+
+		if (rq->mq_hctx->type == HCTX_TYPE_POLL) {
+			spin_lock(&ch->poll_lock);
+			list_add_tail(&rq->queuelist, &ch->poll_list);
+			spin_unlock(&ch->poll_lock);
+			return false;
+		}
 
-	entry = xa_load(&dev->map, idx);
+		if (blk_mq_add_to_batch(rq, iob, 0, dev_complete_batch))
+			return false;
+	}
 
 	/**
-	 * If the block is not found in the map, find a free block from free
-	 * list if the free list is empty, run garbage collecting. then, insert
-	 * the block into the map
-	 *
-	 * If the block is found in the map, insert it into the dirty list and
-	 * find a free block from free list and exchange it with the block.
-	 * if the free list is empty, run garbage collecting.
+	 * With a backing file, a flush or a FUA write completes once the
+	 * journal thread wrote the data and the map back. None of its bios
+	 * may end before, so the whole request is left untouched to the
+	 * journal thread. Requests that failed have nothing to wait for.
 	 */
-	if (!entry) {
-		DEBUG_MESSAGE("%sBlock not found in map\n", PROMPT);
-
-		if (list_empty(&dev->freelist))
-			garbage_collecting(dev);
-
-		/* find free block */
-		struct sector_list_entry* free_block = list_first_entry(
-		    &dev->freelist, struct sector_list_entry, list);
-		list_del(&free_block->list);
-		ret = IDX_PTR(dev, free_block->idx);
-
-		/* insert block into map */
-		entry = (struct sector_mapping_entry*)kmalloc(
-		    sizeof(struct sector_mapping_entry), GFP_KERNEL);
-		MAPPING_ENTRY_INIT(entry, idx, free_block->idx);
-
-		kfree(free_block);
-
-		void* store_ret = xa_store(&dev->map, idx, entry, GFP_KERNEL);
-		if (xa_is_err(store_ret)) {
-			pr_err("%sFailed to insert block "
-			       "into map. Errorcode:%d\n",
-			       PROMPT, xa_err(store_ret));
-			RELEASE_WRITE_LOCK(dev);
-			return;
-		}
-	} else {
-		DEBUG_MESSAGE("%sBlock found in map\n", PROMPT);
-
-		/* insert block into dirty list */
-		struct sector_list_entry* dirty_block =
-		    (struct sector_list_entry*)kmalloc(
-			sizeof(struct sector_list_entry), GFP_KERNEL);
-		LIST_ENTRY_INIT(dirty_block, entry->p_idx);
-		list_add_tail(&dirty_block->list, &dev->dirtylist);
-
-		if (list_empty(&dev->freelist))
-			garbage_collecting(dev);
-
-		/* find free block */
-		struct sector_list_entry* free_block = list_first_entry(
-		    &dev->freelist, struct sector_list_entry, list);
-		list_del(&free_block->list);
-		ret = IDX_PTR(dev, free_block->idx);
-
-		/* exchange block into map */
-		struct sector_mapping_entry* new_entry =
-		    (struct sector_mapping_entry*)kmalloc(
-			sizeof(struct sector_mapping_entry), GFP_KERNEL);
-		MAPPING_ENTRY_INIT(new_entry, idx, free_block->idx);
-
-		kfree(free_block);
-
-		void* cmpxchg_ret =
-		    xa_cmpxchg(&dev->map, idx, entry, new_entry, GFP_KERNEL);
-		if (xa_is_err(cmpxchg_ret)) {
-			pr_err("%sFailed to exchange "
-			       "block into map. "
-			       "Errorcode:%d\n",
-			       PROMPT, xa_err(cmpxchg_ret));
-			RELEASE_WRITE_LOCK(dev);
-			return;
-		}
+	if (durable) {
+		journal_defer_request(dev, rq, kick);
+		return true;
 	}
 
-	DEBUG_MESSAGE("%sBlock Index: %ld, Block Address: %p\n", PROMPT, idx,
-		      ret);
-
-	memcpy(ret, buf, len);
-	RELEASE_WRITE_LOCK(dev);
-}
-
-/* Function to handle block requests */
-static int dev_request_handle(struct request* rq, unsigned int* nr_bytes) {
-	struct bio_vec bvec;
-	struct req_iterator iter;
-	struct csl_device* dev = rq->q->queuedata;
-	loff_t pos = blk_rq_pos(rq) << CSL_SECTOR_SHIFT;
-	loff_t dev_size = (loff_t)(dev->size);
-
-	/* Iterate over each segment of the request */
-	rq_for_each_segment(bvec, rq, iter) {
-		unsigned long b_len = bvec.bv_len;
-		void* b_buf = page_address(bvec.bv_page) + bvec.bv_offset;
-
-		/* Ensure the request does not exceed the device
-		 * size */
-		if ((pos + b_len) > dev_size)
-			b_len = (unsigned long)(dev_size - pos);
-
-		unsigned long idx = pos >> CSL_SECTOR_SHIFT;
-
-		DEBUG_MESSAGE("%sBlock length: %ld, Block "
-			      "index: %ld, Request "
-			      "direction: %s\n",
-			      PROMPT, b_len, idx,
-			      rq_data_dir(rq) == WRITE ? "WRITE" : "READ");
-
-		/* Handle read or write request */
-		if (rq_data_dir(rq) == WRITE)
-			write_sector(dev, idx, b_buf, b_len);
-		else
-			read_sector(dev, idx, b_buf, b_len);
-
-		if (IS_ENABLED(DEBUG))
-			print_metadata(dev);
-
-		pos += b_len;
-		*nr_bytes += b_len;
+	if (blk_update_request(rq, status, nr_bytes)) {
+		pr_err("%sblk_update_request Failed", PROMPT);
+		BUG();
 	}
 
-	return 0;
+	blk_mq_end_request(rq, status);
+
+	return false;
 }
 
 /* Function to process block requests */
 static blk_status_t dev_request(struct blk_mq_hw_ctx* hctx,
 				const struct blk_mq_queue_data* bd) {
+	struct csl_device* dev = hctx->queue->queuedata;
 	unsigned int nr_bytes = 0;
-	blk_status_t status = BLK_STS_OK;
 	struct request* rq = bd->rq;
+	int ret;
 
 	blk_mq_start_request(rq);
 
-	if (dev_request_handle(rq, &nr_bytes) != 0)
-		status = BLK_STS_IOERR;
+	ret = dev_request_handle(rq, &nr_bytes, false);
 
-	if (blk_update_request(rq, status, nr_bytes)) {
-		pr_err("%sblk_update_request Failed", PROMPT);
-		BUG();
+	/**
+	 * The domain has no free segment for writes. Let the block layer
+	 * requeue the request until the garbage collector frees one, it runs
+	 * the queues again when it does. Writing the same data again on retry
+	 * is harmless.
+	 */
+	if (ret == -EAGAIN) {
+		wake_gc(dev);
+		return BLK_STS_RESOURCE;
 	}
 
-	blk_mq_end_request(rq, status);
+	/* the journal thread is woken up by the last request or commit_rqs */
+	dev_complete_request(dev, rq, ret, nr_bytes, NULL, bd->last);
 
-	return status;
+	return BLK_STS_OK;
+}
+
+/**
+ * dev_poll - Complete the handled requests of a poll queue
+ *
+ * @hctx: Poll queue
+ * @iob: Batch to complete the requests with
+ *
+ * Return: number of completed requests
+ */
+static int dev_poll(struct blk_mq_hw_ctx* hctx, struct io_comp_batch* iob) {
+	struct csl_hctx* ch = hctx->driver_data;
+	struct request *rq, *next;
+	LIST_HEAD(list);
+	int nr = 0;
+
+	spin_lock(&ch->poll_lock);
+	list_splice_init(&ch->poll_list, &list);
+	spin_unlock(&ch->poll_lock);
+
+	list_for_each_entry_safe(rq, next, &list, queuelist) {
+		list_del_init(&rq->queuelist);
+		if (!blk_mq_add_to_batch(rq, iob, 0, dev_complete_batch))
+			blk_mq_end_request(rq, BLK_STS_OK);
+		nr++;
+	}
+
+	return nr;
+}
+
+/**
+ * dev_map_queues - Map the CPUs to the hardware queues
+ *
+ * @set: Tag set
+ *
+ * The default queues come first, then the poll queues. Reads share the
+ * default queues.
+ */
+static void dev_map_queues(struct blk_mq_tag_set* set) {
+	struct csl_device* dev = set->driver_data;
+	unsigned int offset = 0;
+
+	for (unsigned int i = 0; i < set->nr_maps; i++) {
+		struct blk_mq_queue_map* map = &set->map[i];
+
+		switch (i) {
+		case HCTX_TYPE_DEFAULT:
+			map->nr_queues =
+			    set->nr_hw_queues - dev->nr_poll_queues;
+			break;
+		case HCTX_TYPE_POLL:
+			map->nr_queues = dev->nr_poll_queues;
+			break;
+		default:
+			map->nr_queues = 0;
+			continue;
+		}
+
+		map->queue_offset = offset;
+		offset += map->nr_queues;
+		blk_mq_map_queues(map);
+	}
+}
+
+/* Function to wake the journal thread up after requests without last */
+static void dev_commit_rqs(struct blk_mq_hw_ctx* hctx) {
+	struct csl_device* dev = hctx->queue->queuedata;
+
+	if (dev->backing)
+		wake_journal(dev);
+}
+
+/**
+ * dev_queue_rqs - Process a batch of block requests
+ *
+ * @rqlist: Requests of one queue, the requests left are dispatched one by
+ * one by the block layer
+ *
+ * Writes are reserved and filled one after the other, then the map is
+ * updated for the whole batch in one critical section per domain, see
+ * publish_batch(), and the requests are completed together. When a domain
+ * has no free segment, the request is requeued and the rest of the batch is
+ * left to queue_rq, which lets the block layer wait for the garbage
+ * collector.
+ */
+static void dev_queue_rqs(struct request** rqlist) {
+	DEFINE_IO_COMP_BATCH(iob);
+	struct csl_cmd *pending = NULL, **tail = &pending, *next;
+	struct csl_device* dev = NULL;
+	bool deferred = false;
+	struct request* rq;
+
+	while ((rq = rq_list_pop(rqlist))) {
+		struct csl_cmd* cmd = blk_mq_rq_to_pdu(rq);
+		unsigned int nr_bytes = 0;
+		int ret;
+
+		dev = rq->q->queuedata;
+		blk_mq_start_request(rq);
+
+		ret = dev_request_handle(rq, &nr_bytes, true);
+
+		if (ret == -EAGAIN) {
+			wake_gc(dev);
+			blk_mq_requeue_request(rq, false);
+			blk_mq_delay_kick_requeue_list(dev->queue,
+						       CSL_REQUEUE_DELAY_MS);
+			break;
+		}
+
+		if (cmd->nr_extents) {
+			cmd->next = NULL;
+			*tail = cmd;
+			tail = &cmd->next;
+			continue;
+		}
+
+		deferred |= dev_complete_request(dev, rq, ret, nr_bytes, &iob,
+						 false);
+	}
+
+	if (!dev)
+		return;
+
+	/* the lock times are accounted to the queue of the first request */
+	if (pending)
+		publish_batch(
+		    dev, blk_mq_rq_from_pdu(pending)->mq_hctx->driver_data,
+		    pending);
+
+	for (struct csl_cmd* cmd = pending; cmd; cmd = next) {
+		next = cmd->next;
+		rq = blk_mq_rq_from_pdu(cmd);
+		cmd->nr_extents = 0;
+		deferred |= dev_complete_request(dev, rq, 0, blk_rq_bytes(rq),
+						 &iob, false);
+	}
+
+	if (iob.req_list)
+		iob.complete(&iob);
+
+	if (deferred)
+		wake_journal(dev);
+}
+
+/* Function to set up the write frontiers of a hardware queue */
+static int dev_init_hctx(struct blk_mq_hw_ctx* hctx, void* driver_data,
+			 unsigned int hctx_idx) {
+	struct csl_device* dev = driver_data;
+	struct csl_hctx* ch;
+
+	ch = kzalloc_node(struct_size(ch, frontiers, dev->nr_domains),
+			  GFP_KERNEL, hctx->numa_node);
+	if (!ch)
+		return -ENOMEM;
+
+	ch->dev = dev;
+	if (stats_init_hctx(ch)) {
+		kfree(ch);
+		return -ENOMEM;
+	}
+
+	ch->node = hctx->numa_node;
+	spin_lock_init(&ch->poll_lock);
+	INIT_LIST_HEAD(&ch->poll_list);
+	if (ch->node == NUMA_NO_NODE)
+		ch->node = first_online_node;
+	hctx->driver_data = ch;
+
+	return 0;
+}
+
+/* Function to free the write frontiers of a hardware queue */
+static void dev_exit_hctx(struct blk_mq_hw_ctx* hctx, unsigned int hctx_idx) {
+	stats_exit_hctx(hctx->driver_data);
+	kfree(hctx->driver_data);
+	hctx->driver_data = NULL;
 }
 
 /* Block multiqueue operations structure */
 static struct blk_mq_ops csl_dev_mq_ops = {
     .queue_rq = dev_request,
+    .queue_rqs = dev_queue_rqs,
+    .commit_rqs = dev_commit_rqs,
+    .poll = dev_poll,
+    .map_queues = dev_map_queues,
+    .init_hctx = dev_init_hctx,
+    .exit_hctx = dev_exit_hctx,
 };
 
-/* Initialize the csl driver */
-static int __init csl_driver_init(void) {
-	if (LINUX_VERSION_CODE < KERNEL_VERSION(6, 9, 5))
-		pr_err("%sKernel version is too old\n", PROMPT);
-
+/**
+ * csl_create_device - Create a device and add its disk
+ *
+ * @id: Device index, used as minor number and in the metadata path
+ * @capacity_mb: Device capacity in MiB
+ * @backing: Path of the backing file, NULL to keep the data in memory only
+ *
+ * Must be called with csl_devices_mutex held.
+ *
+ * Return: 0 on success, negative error code on failure
+ */
+static int csl_create_device(unsigned int id, unsigned int capacity_mb,
+			     const char* backing) {
+	struct csl_device* dev;
 	int status = 0;
 
-	/* Register the block device */
-	dev_major = register_blkdev(dev_major, DEVICE_NAME);
-	if (dev_major < 0) {
-		pr_err("%sFailed to register device with major "
-		       "number %d\n",
-		       PROMPT, dev_major);
-		status = -EBUSY;
-		goto dev_register_fail;
-	}
-
-	DEBUG_MESSAGE("%sDevice registered with major number %d\n", PROMPT,
-		      dev_major);
-
 	/* Allocate memory for the device structure */
 	dev = kzalloc(sizeof(struct csl_device), GFP_KERNEL);
 	if (!dev) {
 		pr_err("%sFailed to allocate device structure\n", PROMPT);
-		status = -ENOMEM;
-		goto dev_allocation_fail;
+		return -ENOMEM;
 	}
 
-#ifdef _USE_MUTEX
-	mutex_init(&dev->reader_cnt_mutex);
-	mutex_init(&dev->rw_mutex);
-	dev->reader_nr = 0;
-	pr_info("%sUsing mutex\n", PROMPT);
-#elif _USE_SEMAPHORE
-	sema_init(&dev->reader_cnt_mutex, 1);
-	sema_init(&dev->rw_mutex, 1);
-	dev->reader_nr = 0;
-	pr_info("%sUsing semaphore\n", PROMPT);
-#elif _USE_RWSEMAPHORE
-	init_rwsem(&dev->rw_mutex);
-	pr_info("%sUsing rw_semaphore\n", PROMPT);
-#else
-	rwlock_init(&dev->rwlock);
-	pr_info("%sUsing rwlock\n", PROMPT);
-#endif
-	xa_init(&dev->map);
-	INIT_LIST_HEAD(&dev->freelist);
-	INIT_LIST_HEAD(&dev->dirtylist);
+	dev->id = id;
+	snprintf(dev->meta_path[0], CSL_PATH_LEN, PATH, id, 0);
+	snprintf(dev->meta_path[1], CSL_PATH_LEN, PATH, id, 1);
+	snprintf(dev->jnl_path, CSL_PATH_LEN, JOURNAL_PATH, id);
+	INIT_LIST_HEAD(&dev->flush_rqs);
+	spin_lock_init(&dev->flush_lock);
+
+	/* The metadata of a backing file is kept next to it */
+	if (backing && *backing) {
+		status = backing_open(dev, backing);
+		if (status) {
+			kfree(dev);
+			return status;
+		}
+	}
 
-	/* Set device capacity */
-	dev->size = TOTAL_SECTORS << CSL_SECTOR_SHIFT;
+	/* Choose the geometry, the saved metadata may override it */
+	initialize_geometry(dev, capacity_mb,
+			    __nr_domains ? __nr_domains : num_online_cpus(),
+			    __map_unit, __op_percent);
+	dev->gc_policy = __gc_policy < CSL_NR_GC_POLICIES ? __gc_policy
+							   : CSL_GC_GREEDY;
 
 	/* Allocate memory for the data buffer */
 	if (load_metadata(dev, __reset_device) != 0) {
 		pr_err("%sFailed to load metadata\n", PROMPT);
-		status = -ENOMEM;
-		goto dev_allocation_fail;
+		backing_close(dev);
+		kfree(dev);
+		return -ENOMEM;
 	}
 
-	DEBUG_MESSAGE("%sdata adress: %p", PROMPT, dev->data);
+	/* Chunks written since the last write-back */
+	if (dev->backing) {
+		dev->dirty = bitmap_zalloc(NR_CHUNKS(dev), GFP_KERNEL);
+		if (!dev->dirty) {
+			pr_err("%sFailed to allocate dirty bitmap\n", PROMPT);
+			status = -ENOMEM;
+			goto disk_allocation_fail;
+		}
+	}
+
+	/* Set device capacity */
+	dev->size = TOTAL_SECTORS(dev) << CSL_SECTOR_SHIFT;
+
+	DEBUG_MESSAGE("%schunk table adress: %p", PROMPT, dev->chunks);
+	pr_info("%s" DEVICE_NAME "%u: %llu MiB capacity, %u byte blocks\n",
+		PROMPT, id, (unsigned long long)dev->size >> 20, __block_size);
+	pr_info("%s" DEVICE_NAME "%u: %u domains, %u sectors mapping unit\n",
+		PROMPT, id, dev->nr_domains, UNIT_SECTORS(dev));
+	pr_info("%s" DEVICE_NAME "%u: %u segments per domain, "
+		"%s garbage collection\n",
+		PROMPT, id, dev->nr_segs, gc_policy_name(dev->gc_policy));
 
 	/* Allocate memory for the gendisk structure */
 	dev->disk = blk_alloc_disk(NULL, NUMA_NO_NODE);
@@ -386,16 +631,24 @@ static int __init csl_driver_init(void) {
 	if (dev->tag_set == NULL) {
 		pr_err("%sFailed to allocate tag set\n", PROMPT);
 		status = -ENOMEM;
-		goto disk_allocation_fail;
+		goto tag_set_allocation_fail;
 	}
 
 	/* Initialize the tag set */
 	dev->tag_set->ops = &csl_dev_mq_ops;
-	dev->tag_set->nr_hw_queues = num_possible_cpus();
-	dev->tag_set->queue_depth = 128;
+	/* Poll queues come after the default queues */
+	dev->nr_poll_queues = min(__poll_queues, num_online_cpus());
+	dev->tag_set->nr_hw_queues =
+	    (__hw_queues ? __hw_queues : num_possible_cpus())
+	    + dev->nr_poll_queues;
+	dev->tag_set->nr_maps = dev->nr_poll_queues ? HCTX_MAX_TYPES : 1;
+	dev->tag_set->queue_depth = __queue_depth;
+	/* Let blk-mq allocate the tags of every hardware queue on its node */
 	dev->tag_set->numa_node = NUMA_NO_NODE;
-	dev->tag_set->cmd_size = 0;
+	dev->tag_set->cmd_size = sizeof(struct csl_cmd);
 	dev->tag_set->flags = BLK_MQ_F_SHOULD_MERGE;
+	if (__blocking)
+		dev->tag_set->flags |= BLK_MQ_F_BLOCKING;
 	dev->tag_set->driver_data = dev;
 
 	/* Allocate the tag set */
@@ -415,7 +668,7 @@ static int __init csl_driver_init(void) {
 
 	/* Set gendisk properties */
 	dev->disk->major = dev_major;
-	dev->disk->first_minor = 0;
+	dev->disk->first_minor = id;
 	dev->disk->minors = 1;
 	dev->disk->fops = &csl_dev_ops;
 	dev->disk->flags = GENHD_FL_NO_PART;
@@ -423,25 +676,72 @@ static int __init csl_driver_init(void) {
 	dev->disk->queue->queuedata = dev;
 
 	/* Set the device name */
-	sprintf(dev->disk->disk_name, DEVICE_NAME);
+	snprintf(dev->disk->disk_name, DISK_NAME_LEN, DEVICE_NAME "%u", id);
 
 	/* Set the capacity of the device */
 	set_capacity(dev->disk, dev->size >> SECTOR_SHIFT);
 
 	/* Set the logical block size */
-	blk_queue_logical_block_size(dev->queue, CSL_SECTOR_SIZE);
+	blk_queue_logical_block_size(dev->queue, __block_size);
+	blk_queue_physical_block_size(dev->queue, __block_size);
+
+	/* Allow large requests, they are reserved in one critical section */
+	blk_queue_max_hw_sectors(dev->queue, CSL_MAX_RQ_SECTORS);
+
+	/* Discard and write zeroes only unmap, so any size is cheap */
+	dev->queue->limits.discard_granularity =
+	    max_t(unsigned int, UNIT_SIZE(dev), __block_size);
+	blk_queue_max_discard_sectors(dev->queue, TOTAL_SECTORS(dev));
+	blk_queue_max_write_zeroes_sectors(dev->queue, TOTAL_SECTORS(dev));
+
+	/* Writes are volatile until the journal thread writes them back */
+	if (dev->backing)
+		blk_queue_write_cache(dev->queue, true, true);
+
+	/* Journal the map updates from the first write on, a backing file
+	 * needs the journal to write back */
+	status = journal_start(dev,
+			       dev->backing && !__journal_kb
+				   ? CSL_DEFAULT_JOURNAL_KB
+				   : __journal_kb,
+			       __checkpoint_sec);
+	if (status) {
+		pr_err("%sFailed to start journal\n", PROMPT);
+		goto queue_allocated_failed;
+	}
+
+	/* Start the garbage collector before any write can need it */
+	status = gc_start(dev);
+	if (status) {
+		pr_err("%sFailed to start garbage collector\n", PROMPT);
+		goto gc_start_failed;
+	}
 
 	/* Add the disk to the system */
-	status = add_disk(dev->disk);
+	status = device_add_disk(NULL, dev->disk, csl_disk_groups);
 	if (status) {
 		pr_err("%sFailed to add disk\n", PROMPT);
-		goto queue_allocated_failed;
+		goto disk_add_failed;
 	}
 
-	DEBUG_MESSAGE("%scsl device driver init\n", PROMPT);
+	/* Debugfs failures are not fatal, the files are only for inspection */
+	dev->debugfs = debugfs_create_dir(dev->disk->disk_name, NULL);
+	stats_debugfs_init(dev);
+	metadata_debugfs_init(dev);
+
+	list_add_tail(&dev->list, &csl_devices);
+	nr_devices++;
+
+	DEBUG_MESSAGE("%s%s created\n", PROMPT, dev->disk->disk_name);
 
 	return 0;
 
+disk_add_failed:
+	gc_stop(dev);
+
+gc_start_failed:
+	journal_stop(dev, false);
+
 queue_allocated_failed:
 	blk_mq_free_tag_set(dev->tag_set);
 
@@ -449,13 +749,166 @@ tag_allocation_failed:
 	kfree(dev->tag_set);
 	dev->tag_set = NULL;
 
+tag_set_allocation_fail:
+	put_disk(dev->disk);
+
 disk_allocation_fail:
-	vfree(dev->data);
-	dev->data = NULL;
+	free_chunks(dev->chunks, NR_CHUNKS(dev));
+	dev->chunks = NULL;
+	free_metadata(dev);
+	backing_close(dev);
+	kfree(dev);
+
+	return status;
+}
+
+/**
+ * csl_destroy_device - Remove the disk of a device and save its metadata
+ *
+ * @dev: Device pointer
+ *
+ * Must be called with csl_devices_mutex held.
+ */
+static void csl_destroy_device(struct csl_device* dev) {
+	/* Remove the disk first, so no request is in flight while saving */
+	debugfs_remove_recursive(dev->debugfs);
+	dev->debugfs = NULL;
+	del_gendisk(dev->disk);
+	gc_stop(dev);
+	release_frontiers(dev);
+	print_write_amplification(dev);
+	print_node_stats(dev);
+	journal_stop(dev, true);
+	free_metadata(dev);
+	/* The data is in the backing file, not kept for the next load */
+	if (dev->backing) {
+		free_chunks(dev->chunks, NR_CHUNKS(dev));
+		dev->chunks = NULL;
+		backing_close(dev);
+	}
+	put_disk(dev->disk);
+	blk_mq_free_tag_set(dev->tag_set);
+	kfree(dev->tag_set);
+	list_del(&dev->list);
+	nr_devices--;
 	kfree(dev);
-	dev = NULL;
+}
+
+/* Function to add a device at runtime, with the written capacity in MiB */
+static int csl_add_device(const char* val, const struct kernel_param* kp) {
+	unsigned int capacity_mb;
+	int ret;
+
+	ret = kstrtouint(val, 0, &capacity_mb);
+	if (ret)
+		return ret;
+
+	mutex_lock(&csl_devices_mutex);
+	if (!csl_devices_ready)
+		ret = -ENODEV;
+	else if (nr_devices >= CSL_MAX_DEVICES)
+		ret = -ENOSPC;
+	else
+		ret = csl_create_device(nr_devices, capacity_mb, NULL);
+	mutex_unlock(&csl_devices_mutex);
+
+	return ret;
+}
+
+/* Function to show the number of devices */
+static int csl_get_devices(char* buf, const struct kernel_param* kp) {
+	return sysfs_emit(buf, "%u\n", READ_ONCE(nr_devices));
+}
+
+static const struct kernel_param_ops csl_add_device_ops = {
+    .set = csl_add_device,
+    .get = csl_get_devices,
+};
+
+module_param_cb(__add_device, &csl_add_device_ops, NULL, S_IWUSR | S_IRUGO);
+
+MODULE_PARM_DESC(__add_device,
+		 "Write a capacity in MiB to add a device after load, "
+		 "read the number of devices");
 
-dev_allocation_fail:
+/* Initialize the csl driver */
+static int __init csl_driver_init(void) {
+	if (LINUX_VERSION_CODE < KERNEL_VERSION(6, 9, 5))
+		pr_err("%sKernel version is too old\n", PROMPT);
+
+	int status = 0;
+
+	/* Register the block device */
+	dev_major = register_blkdev(dev_major, DEVICE_NAME);
+	if (dev_major < 0) {
+		pr_err("%sFailed to register device with major "
+		       "number %d\n",
+		       PROMPT, dev_major);
+		status = -EBUSY;
+		goto dev_register_fail;
+	}
+
+	DEBUG_MESSAGE("%sDevice registered with major number %d\n", PROMPT,
+		      dev_major);
+
+	pr_info("%sUsing %s\n", PROMPT, LOCK_NAME);
+
+	if (__block_size != CSL_SECTOR_SIZE && __block_size != SZ_4K) {
+		pr_err("%sInvalid block size %u, use %d\n", PROMPT,
+		       __block_size, CSL_SECTOR_SIZE);
+		__block_size = CSL_SECTOR_SIZE;
+	}
+
+	/* The sleeping locks are taken in queue_rq */
+	if (LOCK_SLEEPS && !__blocking) {
+		pr_err("%s%s may sleep, dispatch in blocking mode\n", PROMPT,
+		       LOCK_NAME);
+		__blocking = true;
+	}
+
+	if (__hw_queues > nr_cpu_ids) {
+		pr_err("%sToo many hardware queues %u, use %u\n", PROMPT,
+		       __hw_queues, nr_cpu_ids);
+		__hw_queues = nr_cpu_ids;
+	}
+
+	if (!__queue_depth || __queue_depth > BLK_MQ_MAX_DEPTH) {
+		pr_err("%sInvalid queue depth %u, use %d\n", PROMPT,
+		       __queue_depth, CSL_DEFAULT_QUEUE_DEPTH);
+		__queue_depth = CSL_DEFAULT_QUEUE_DEPTH;
+	}
+
+	pr_info("%s%u hardware queues of depth %u, %sblocking dispatch\n",
+		PROMPT, __hw_queues ? __hw_queues : num_possible_cpus(),
+		__queue_depth, __blocking ? "" : "non-");
+
+	if (__nr_devices > CSL_MAX_DEVICES) {
+		pr_err("%sToo many devices %u, use %d\n", PROMPT, __nr_devices,
+		       CSL_MAX_DEVICES);
+		__nr_devices = CSL_MAX_DEVICES;
+	}
+
+	/* Devices beyond the given capacities take the last one */
+	mutex_lock(&csl_devices_mutex);
+	for (unsigned int i = 0; i < __nr_devices; i++) {
+		status = csl_create_device(
+		    i, __capacity_mb[min_t(int, i, max(nr_capacity_mb - 1, 0))],
+		    i < nr_backing_file ? __backing_file[i] : NULL);
+		if (status)
+			goto dev_create_fail;
+	}
+	csl_devices_ready = true;
+	mutex_unlock(&csl_devices_mutex);
+
+	DEBUG_MESSAGE("%scsl device driver init\n", PROMPT);
+
+	return 0;
+
+dev_create_fail:
+	while (!list_empty(&csl_devices))
+		csl_destroy_device(
+		    list_last_entry(&csl_devices, struct csl_device, list));
+	mutex_unlock(&csl_devices_mutex);
 	unregister_blkdev(dev_major, DEVICE_NAME);
 
 dev_register_fail:
@@ -466,12 +919,13 @@ dev_register_fail:
 
 /* Exit the csl driver */
 static void __exit csl_driver_exit(void) {
-	save_metadata(dev);
-	del_gendisk(dev->disk);
-	put_disk(dev->disk);
-	blk_mq_free_tag_set(dev->tag_set);
-	kfree(dev->tag_set);
-	kfree(dev);
+	mutex_lock(&csl_devices_mutex);
+	csl_devices_ready = false;
+	while (!list_empty(&csl_devices))
+		csl_destroy_device(
+		    list_last_entry(&csl_devices, struct csl_device, list));
+	mutex_unlock(&csl_devices_mutex);
+
 	unregister_blkdev(dev_major, DEVICE_NAME);
 	pr_info("%scsl device driver exit\n", PROMPT);
 }
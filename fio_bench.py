@@ -0,0 +1,269 @@
+#!/usr/bin/env python3
+"""Benchmark matrix of the driver with fio.
+
+Build every lock variant of the module, load it, and run fio over every
+combination of rw pattern, block size, number of jobs and iodepth. The
+device is reloaded empty before every job, so the numbers do not depend on
+the order of the jobs. The results are stored as JSON, and compared against
+a saved baseline with the diff command.
+
+    python3 fio_bench.py run -o results/after.json
+    python3 fio_bench.py diff results/before.json results/after.json
+    python3 plot.py results/after.json --baseline results/before.json
+"""
+
+import argparse
+import datetime
+import json
+import os
+import platform
+import subprocess
+import sys
+
+# Make target that builds every lock variant
+VARIANTS = {
+    'rwlock': 'all',
+    'mutex': 'mutex',
+    'semaphore': 'semaphore',
+    'rwsem': 'rwsem',
+}
+
+RW_PATTERNS = ['write', 'randwrite', 'read', 'randread', 'rw', 'randrw']
+
+# Completion latency percentiles kept from the fio output
+PERCENTILES = ['50.000000', '99.000000', '99.900000']
+
+# Keys of a result, a result of the baseline is matched on all of them
+KEYS = ['variant', 'rw', 'bs', 'numjobs', 'iodepth']
+
+REPO = os.path.dirname(os.path.abspath(__file__))
+
+
+def csv(value):
+    return [v for v in value.split(',') if v]
+
+
+def make(target, *args, check=True, dry_run=False):
+    cmd = ['make', target] + list(args)
+    print('+', ' '.join(cmd), file=sys.stderr)
+    if dry_run:
+        return
+    # kbuild takes the module directory from $(PWD)
+    subprocess.run(cmd, check=check, cwd=REPO, stdout=subprocess.DEVNULL,
+                   env=dict(os.environ, PWD=REPO))
+
+
+def load(args):
+    make('unload', check=False, dry_run=args.dry_run)
+    make('load', 'RESET_DEVICE=1', 'NR_DEVICES=1',
+         'LOAD_ARGS=' + ' '.join(args.param), dry_run=args.dry_run)
+
+
+def fio(args, rw, bs, numjobs, iodepth):
+    cmd = ['fio', '--name=csl', '--filename=' + args.filename,
+           '--direct=1', '--ioengine=' + args.ioengine, '--rw=' + rw,
+           '--bs=' + bs, '--numjobs=' + str(numjobs),
+           '--iodepth=' + str(iodepth), '--size=' + args.size,
+           '--runtime=' + str(args.runtime), '--time_based=1',
+           '--group_reporting=1', '--output-format=json']
+    print('+', ' '.join(cmd), file=sys.stderr)
+    if args.dry_run:
+        return None
+    out = subprocess.run(cmd, check=True, stdout=subprocess.PIPE,
+                         universal_newlines=True).stdout
+    # fio may print warnings before the JSON document
+    return json.loads(out[out.index('{'):])
+
+
+def summarize(job, direction):
+    """Bandwidth, IOPS and completion latency of one direction of a job"""
+    stats = job[direction]
+    if not stats['io_bytes']:
+        return None
+
+    clat = stats.get('clat_ns', {})
+    percentiles = clat.get('percentile', {})
+    return {
+        'bw_kib': stats['bw'],
+        'iops': stats['iops'],
+        'clat_mean_ns': clat.get('mean', 0),
+        'clat_ns': {p.split('.')[0]: percentiles.get(p, 0)
+                    for p in PERCENTILES},
+    }
+
+
+def fio_version():
+    try:
+        return subprocess.run(['fio', '--version'], stdout=subprocess.PIPE,
+                              universal_newlines=True).stdout.strip()
+    except OSError:
+        return None
+
+
+def git_commit():
+    try:
+        return subprocess.run(['git', '-C', REPO, 'describe', '--always',
+                               '--dirty'], stdout=subprocess.PIPE,
+                              universal_newlines=True).stdout.strip()
+    except OSError:
+        return None
+
+
+def run(args):
+    results = []
+    meta = {
+        'date': datetime.datetime.now().isoformat(timespec='seconds'),
+        'host': platform.node(),
+        'kernel': platform.release(),
+        'commit': git_commit(),
+        'fio': fio_version(),
+        'ioengine': args.ioengine,
+        'runtime': args.runtime,
+        'size': args.size,
+        'params': args.param,
+    }
+
+    for variant in args.variants:
+        make(VARIANTS[variant], dry_run=args.dry_run)
+
+        for rw in args.rw:
+            for bs in args.bs:
+                for numjobs in args.numjobs:
+                    for iodepth in args.iodepth:
+                        load(args)
+                        out = fio(args, rw, bs, numjobs, iodepth)
+                        if out is None:
+                            continue
+
+                        result = {'variant': variant, 'rw': rw, 'bs': bs,
+                                  'numjobs': numjobs, 'iodepth': iodepth}
+                        for direction in ['read', 'write']:
+                            result[direction] = summarize(out['jobs'][0],
+                                                          direction)
+                        results.append(result)
+                        print(format_result(result), file=sys.stderr)
+
+    make('unload', check=False, dry_run=args.dry_run)
+
+    if args.dry_run:
+        return 0
+
+    os.makedirs(os.path.dirname(os.path.abspath(args.output)), exist_ok=True)
+    with open(args.output, 'w') as f:
+        json.dump({'meta': meta, 'results': results}, f, indent=1)
+    print('Results written to', args.output, file=sys.stderr)
+
+    return 0
+
+
+def key(result):
+    return tuple(result[k] for k in KEYS)
+
+
+def format_key(result):
+    return '%-9s %-9s %5s j%-3d d%-3d' % key(result)
+
+
+def format_result(result):
+    parts = [format_key(result)]
+    for direction in ['read', 'write']:
+        stats = result[direction]
+        if stats:
+            parts.append('%s %8.1f MiB/s %9.0f IOPS p99 %7.1f us' % (
+                direction, stats['bw_kib'] / 1024, stats['iops'],
+                stats['clat_ns']['99'] / 1000))
+    return '  '.join(parts)
+
+
+def change(old, new):
+    return (new - old) * 100.0 / old if old else 0.0
+
+
+def diff(args):
+    """Compare results against a baseline, a drop of bandwidth or IOPS or a
+    rise of the p99 latency beyond the threshold is a regression"""
+    with open(args.baseline) as f:
+        baseline = {key(r): r for r in json.load(f)['results']}
+    with open(args.results) as f:
+        results = json.load(f)['results']
+
+    regressions = 0
+    print('%-38s %5s %9s %9s %9s' % ('job', 'dir', 'bw %', 'iops %',
+                                      'p99 %'))
+    for result in results:
+        base = baseline.get(key(result))
+        if not base:
+            print('%-38s no baseline' % format_key(result))
+            continue
+
+        for direction in ['read', 'write']:
+            old, new = base[direction], result[direction]
+            if not old or not new:
+                continue
+
+            bw = change(old['bw_kib'], new['bw_kib'])
+            iops = change(old['iops'], new['iops'])
+            p99 = change(old['clat_ns']['99'], new['clat_ns']['99'])
+            bad = (bw < -args.threshold or iops < -args.threshold
+                   or p99 > args.threshold)
+            regressions += bad
+            print('%-38s %5s %+9.1f %+9.1f %+9.1f%s' % (
+                format_key(result), direction, bw, iops, p99,
+                '  REGRESSION' if bad else ''))
+
+    print('%d regressions beyond %.1f%%' % (regressions, args.threshold))
+    return 1 if regressions else 0
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    sub = parser.add_subparsers(dest='command')
+    sub.required = True
+
+    p = sub.add_parser('run', help='build, load and run the matrix')
+    p.add_argument('--variants', type=csv, default=list(VARIANTS),
+                   help='lock variants (default: %(default)s)')
+    p.add_argument('--rw', type=csv, default=RW_PATTERNS,
+                   help='rw patterns (default: %(default)s)')
+    p.add_argument('--bs', type=csv, default=['512', '4k', '64k'],
+                   help='block sizes (default: %(default)s)')
+    p.add_argument('--numjobs', type=lambda v: [int(x) for x in csv(v)],
+                   default=[1, 4, 8],
+                   help='numbers of jobs (default: %(default)s)')
+    p.add_argument('--iodepth', type=lambda v: [int(x) for x in csv(v)],
+                   default=[1, 16],
+                   help='iodepths (default: %(default)s)')
+    p.add_argument('--runtime', type=int, default=10,
+                   help='seconds per job (default: %(default)s)')
+    p.add_argument('--size', default='4M',
+                   help='region of every job (default: %(default)s)')
+    p.add_argument('--ioengine', default='libaio',
+                   help='fio ioengine (default: %(default)s)')
+    p.add_argument('--filename', default='/dev/csl0',
+                   help='device (default: %(default)s)')
+    p.add_argument('--param', action='append', default=[],
+                   help='module parameter NAME=VALUE, may be repeated')
+    p.add_argument('-o', '--output', default=os.path.join(
+        REPO, 'results', datetime.date.today().isoformat() + '.json'),
+                   help='results file (default: results/<date>.json)')
+    p.add_argument('-n', '--dry-run', action='store_true',
+                   help='print the commands without running them')
+    p.set_defaults(func=run)
+
+    p = sub.add_parser('diff', help='compare results against a baseline')
+    p.add_argument('baseline')
+    p.add_argument('results')
+    p.add_argument('-t', '--threshold', type=float, default=5.0,
+                   help='regression threshold in percent '
+                   '(default: %(default)s)')
+    p.set_defaults(func=diff)
+
+    args = parser.parse_args()
+    for variant in getattr(args, 'variants', []):
+        if variant not in VARIANTS:
+            parser.error('unknown variant %s' % variant)
+    return args.func(args)
+
+
+if __name__ == '__main__':
+    sys.exit(main())
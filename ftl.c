@@ -0,0 +1,243 @@
+#include "gc.h"
+#include "metadata.h"
+#include "lock.h"
+
+/*
+ * In-memory state of the FTL: the chunks that hold the data, the domains
+ * with their segments, and the mapping tables. It only needs the allocator,
+ * so bench/ builds it in userspace along with gc.c and rq.c.
+ */
+
+/**
+ * initialize_geometry - Choose the geometry of a device
+ *
+ * @dev: Device pointer
+ * @capacity_mb: Logical capacity in MB
+ * @nr_domains: Number of domains, rounded down to a power of two
+ * @map_unit: Mapping unit size in sectors, rounded down to a power of two
+ * @op_percent: Overprovisioned segments in percent of the logical ones, up
+ * to CSL_MAX_OP_PERCENT
+ *
+ * The capacity is rounded down to a whole stripe of every domain, and every
+ * domain gets at least CSL_MIN_OP_SEGS overprovisioned segments.
+ */
+void initialize_geometry(struct csl_device* dev, unsigned int capacity_mb,
+			 unsigned int nr_domains, unsigned int map_unit,
+			 unsigned int op_percent) {
+	dev->nr_sectors = MB_TO_SECTORS(
+	    clamp_t(unsigned int, capacity_mb, 1, CSL_MAX_CAPACITY_MB));
+	dev->nr_domains = rounddown_pow_of_two(clamp_t(
+	    unsigned int, nr_domains, 1,
+	    min_t(sector_t, CSL_MAX_DOMAINS,
+		  dev->nr_sectors >> CSL_STRIPE_SHIFT)));
+	dev->nr_sectors = round_down(
+	    dev->nr_sectors, (sector_t)dev->nr_domains << CSL_STRIPE_SHIFT);
+	dev->unit_shift = ilog2(clamp_t(unsigned int, map_unit, 1,
+					1U << CSL_MAX_UNIT_SHIFT));
+	dev->nr_segs = DOMAIN_LOGICAL_SEGS(dev)
+		       + OP_SEGS(DOMAIN_LOGICAL_SEGS(dev),
+				 min_t(unsigned int, op_percent,
+				       CSL_MAX_OP_PERCENT));
+}
+
+/**
+ * allocate_chunks - Allocate the chunk table and the chunks
+ *
+ * @dev: Device pointer
+ *
+ * The data is kept in one chunk of pages per segment, found through the chunk
+ * table, so a large device needs neither one huge vmalloc area nor
+ * contiguous memory. The chunks are spread over the online NUMA nodes in
+ * turn, so every domain has segments on every node.
+ *
+ * Return: 0 on success, -ENOMEM on failure
+ */
+int allocate_chunks(struct csl_device* dev) {
+	int node = first_online_node;
+
+	dev->chunks = kvcalloc(NR_CHUNKS(dev), sizeof(void*), GFP_KERNEL);
+	if (!dev->chunks) {
+		pr_err("%sFailed to allocate chunk table\n", PROMPT);
+		return -ENOMEM;
+	}
+
+	for (size_t i = 0; i < NR_CHUNKS(dev); i++) {
+		struct page* page =
+		    alloc_pages_node(node, GFP_KERNEL, CSL_CHUNK_ORDER);
+
+		dev->chunks[i] = page ? page_address(page) : NULL;
+		if (!dev->chunks[i]) {
+			pr_err("%sFailed to allocate data buffer\n", PROMPT);
+			free_chunks(dev->chunks, i);
+			dev->chunks = NULL;
+			return -ENOMEM;
+		}
+
+		node = next_online_node(node);
+		if (node >= MAX_NUMNODES)
+			node = first_online_node;
+
+		cond_resched();
+	}
+
+	return 0;
+}
+
+/**
+ * free_chunks - Free the chunks and the chunk table
+ *
+ * @chunks: Chunk table
+ * @nr: Number of chunks
+ */
+void free_chunks(void** chunks, size_t nr) {
+	if (!chunks)
+		return;
+
+	for (size_t i = 0; i < nr; i++)
+		free_pages((unsigned long)chunks[i], CSL_CHUNK_ORDER);
+
+	kvfree(chunks);
+}
+
+/**
+ * initialize_domains - Allocate and initialize the domains
+ *
+ * @dev: Device pointer
+ *
+ * Every domain owns DOMAIN_BLOCKS physical blocks starting at its base, split
+ * into nr_segs segments. All segments start free, in the free list of the
+ * node of their chunk, and every NUMA node has its own open segment.
+ *
+ * Return: 0 on success, -ENOMEM on failure
+ */
+int initialize_domains(struct csl_device* dev) {
+	dev->domains = kcalloc(dev->nr_domains, sizeof(struct csl_domain),
+			       GFP_KERNEL);
+	if (!dev->domains) {
+		pr_err("%sFailed to allocate domains\n", PROMPT);
+		return -ENOMEM;
+	}
+
+	for (unsigned int i = 0; i < dev->nr_domains; i++) {
+		struct csl_domain* dom = &dev->domains[i];
+
+		INIT_DOMAIN_LOCK(dom);
+		dom->segs = kvcalloc(dev->nr_segs, sizeof(struct csl_segment),
+				     GFP_KERNEL);
+		dom->opens =
+		    kcalloc(nr_node_ids, sizeof(struct csl_open), GFP_KERNEL);
+		dom->nr_node_blocks =
+		    kcalloc(nr_node_ids, sizeof(u64), GFP_KERNEL);
+		dom->free_segs = kcalloc(nr_node_ids, sizeof(struct list_head),
+					 GFP_KERNEL);
+		dom->victims = kcalloc(SEG_UNITS(dev) + 1, sizeof(unsigned int),
+				       GFP_KERNEL);
+		if (!dom->segs || !dom->opens || !dom->nr_node_blocks
+		    || !dom->free_segs || !dom->victims) {
+			pr_err("%sFailed to allocate segments\n", PROMPT);
+			return -ENOMEM;
+		}
+
+		/* the chunks may be kept from before, so ask where they are */
+		for (unsigned int j = 0; j < dev->nr_segs; j++)
+			dom->segs[j].node = page_to_nid(virt_to_page(
+			    dev->chunks[(size_t)i * dev->nr_segs + j]));
+
+		for (unsigned int node = 0; node < nr_node_ids; node++)
+			dom->opens[node].seg = CSL_NO_SEG;
+
+		dom->base = i * DOMAIN_BLOCKS(dev);
+		dom->nr_segs = dev->nr_segs;
+		dom->nr_free_segs = dev->nr_segs;
+		dom->gc_seg = CSL_NO_SEG;
+		index_segments(dev, dom);
+	}
+
+	return 0;
+}
+
+/**
+ * initialize_map - Allocate the mapping tables with every sector unmapped
+ *
+ * @dev: Device pointer
+ *
+ * Return: 0 on success, -ENOMEM on failure
+ */
+int initialize_map(struct csl_device* dev) {
+	dev->map = kvmalloc_array(NR_UNITS(dev), sizeof(u32), GFP_KERNEL);
+	dev->p2l = kvmalloc_array(NR_BLOCKS(dev), sizeof(u32), GFP_KERNEL);
+	if (!dev->map || !dev->p2l) {
+		pr_err("%sFailed to allocate map\n", PROMPT);
+		return -ENOMEM;
+	}
+
+	memset(dev->map, 0xff, NR_UNITS(dev) * sizeof(u32));
+	memset(dev->p2l, 0xff, NR_BLOCKS(dev) * sizeof(u32));
+
+	return 0;
+}
+
+/**
+ * rebuild_segments - Rebuild the reverse map and the segments from the map
+ *
+ * @dev: Device pointer
+ *
+ * Every segment that holds a mapped block is closed, and the others are
+ * free, then the free lists and victim heaps are built again. Blocks that
+ * were written but are not mapped anymore are reclaimed by the garbage
+ * collector like any other replaced block.
+ *
+ * Return: 0 on success, -EINVAL if the map is inconsistent
+ */
+int rebuild_segments(struct csl_device* dev) {
+	for (u32 unit = 0; unit < NR_UNITS(dev); unit++) {
+		struct csl_domain* dom = LBA_TO_DOMAIN(
+		    dev, (sector_t)unit << dev->unit_shift);
+		u32 p_idx = dev->map[unit];
+		struct csl_segment* seg;
+
+		if (p_idx == CSL_UNMAPPED)
+			continue;
+
+		if (p_idx < dom->base || p_idx >= dom->base + DOMAIN_BLOCKS(dev)
+		    || dev->p2l[p_idx] != CSL_UNMAPPED)
+			return -EINVAL;
+
+		dev->p2l[p_idx] = unit;
+		seg = &dom->segs[(p_idx - dom->base) >> SEG_SHIFT(dev)];
+		if (seg->state == CSL_SEG_FREE) {
+			seg->state = CSL_SEG_CLOSED;
+			dom->nr_free_segs--;
+		}
+		seg->nr_valid++;
+	}
+
+	for (unsigned int i = 0; i < dev->nr_domains; i++)
+		index_segments(dev, &dev->domains[i]);
+
+	return 0;
+}
+
+/**
+ * free_metadata - Free the domains and the mapping tables
+ *
+ * @dev: Device pointer
+ */
+void free_metadata(struct csl_device* dev) {
+	if (dev->domains) {
+		for (unsigned int i = 0; i < dev->nr_domains; i++) {
+			kvfree(dev->domains[i].segs);
+			kfree(dev->domains[i].opens);
+			kfree(dev->domains[i].nr_node_blocks);
+			kfree(dev->domains[i].free_segs);
+			kfree(dev->domains[i].victims);
+		}
+	}
+
+	kfree(dev->domains);
+	dev->domains = NULL;
+	kvfree(dev->map);
+	dev->map = NULL;
+	kvfree(dev->p2l);
+	dev->p2l = NULL;
+}
@@ -0,0 +1,912 @@
+#include <linux/blk-mq.h>
+#include <linux/kthread.h>
+#include <linux/math64.h>
+#include <linux/nodemask.h>
+#include <linux/rcupdate.h>
+#include <linux/sched.h>
+#include <linux/wait.h>
+#include "backing.h"
+#include "csl_trace.h"
+#include "gc.h"
+#include "journal.h"
+#include "lock.h"
+
+/**
+ * struct csl_gc_policy - Victim selection policy
+ * @name: 				Policy name
+ * @score: 				Score of a closed segment, the segment
+ * 					with the highest score is collected
+ */
+struct csl_gc_policy {
+	const char* name;
+	u64 (*score)(struct csl_device* dev, struct csl_domain* dom,
+		     struct csl_segment* seg);
+};
+
+/* Greedy: collect the segment with the fewest valid blocks */
+static u64 greedy_score(struct csl_device* dev, struct csl_domain* dom,
+			struct csl_segment* seg) {
+	return SEG_UNITS(dev) - seg->nr_valid;
+}
+
+/**
+ * cost_benefit_score - Cost-benefit score of a segment
+ *
+ * @dev: Device pointer
+ * @dom: Domain pointer
+ * @seg: Segment pointer
+ *
+ * Weigh the free space gained against the cost of reading and rewriting the
+ * valid blocks, (1 - u) * age / (1 + u) for utilization u. Old segments are
+ * preferred, since their remaining blocks are likely to stay valid.
+ */
+static u64 cost_benefit_score(struct csl_device* dev, struct csl_domain* dom,
+			      struct csl_segment* seg) {
+	u64 age = dom->seq - seg->seq + 1;
+
+	return div_u64(((u64)(SEG_UNITS(dev) - seg->nr_valid) * age) << 10,
+		       SEG_UNITS(dev) + seg->nr_valid);
+}
+
+/* FIFO: collect the segment that was closed first */
+static u64 fifo_score(struct csl_device* dev, struct csl_domain* dom,
+		      struct csl_segment* seg) {
+	return dom->seq - seg->seq + 1;
+}
+
+static const struct csl_gc_policy gc_policies[CSL_NR_GC_POLICIES] = {
+    [CSL_GC_GREEDY] = {.name = "greedy", .score = greedy_score},
+    [CSL_GC_COST_BENEFIT] = {.name = "cost-benefit",
+			     .score = cost_benefit_score},
+    [CSL_GC_FIFO] = {.name = "fifo", .score = fifo_score},
+};
+
+/**
+ * gc_policy_name - Name of a victim selection policy
+ *
+ * @policy: Policy index
+ */
+const char* gc_policy_name(unsigned int policy) {
+	return gc_policies[policy].name;
+}
+
+/* Segment of a physical block of the domain */
+static struct csl_segment* block_segment(struct csl_device* dev,
+					 struct csl_domain* dom, u32 p_idx) {
+	return &dom->segs[(p_idx - dom->base) >> SEG_SHIFT(dev)];
+}
+
+/* First physical block of a segment of the domain */
+static u32 segment_block(struct csl_device* dev, struct csl_domain* dom,
+			 unsigned int seg) {
+	return dom->base + (seg << SEG_SHIFT(dev));
+}
+
+/*
+ * Victim heaps
+ *
+ * The closed segments without pending blocks are kept in a pairing heap per
+ * valid count, ordered by age, and linked through the segments by index.
+ * Every policy scores a segment from its valid count and its age only, and
+ * prefers older segments for the same valid count, so the best victim is the
+ * root of one of the heaps. A replaced block moves its segment to the next
+ * heap in O(log n) amortized, and a victim is selected in O(SEG_UNITS).
+ */
+
+/* Link two heaps, the root of the older segment becomes the root */
+static unsigned int heap_link(struct csl_domain* dom, unsigned int a,
+			      unsigned int b) {
+	unsigned int tmp;
+
+	if (a == CSL_NO_SEG)
+		return b;
+	if (b == CSL_NO_SEG)
+		return a;
+
+	if (dom->segs[b].seq < dom->segs[a].seq) {
+		tmp = a;
+		a = b;
+		b = tmp;
+	}
+
+	dom->segs[b].heap_prev = a;
+	dom->segs[b].heap_next = dom->segs[a].heap_child;
+	if (dom->segs[a].heap_child != CSL_NO_SEG)
+		dom->segs[dom->segs[a].heap_child].heap_prev = b;
+	dom->segs[a].heap_child = b;
+
+	return a;
+}
+
+/* Merge a list of siblings into one heap, pairwise from left to right and
+ * the pairs from right to left */
+static unsigned int heap_merge_pairs(struct csl_domain* dom,
+				     unsigned int first) {
+	unsigned int pairs = CSL_NO_SEG, root = CSL_NO_SEG;
+
+	while (first != CSL_NO_SEG) {
+		unsigned int a = first, b = dom->segs[a].heap_next;
+
+		first = b != CSL_NO_SEG ? dom->segs[b].heap_next : CSL_NO_SEG;
+		dom->segs[a].heap_prev = dom->segs[a].heap_next = CSL_NO_SEG;
+		if (b != CSL_NO_SEG)
+			dom->segs[b].heap_prev = dom->segs[b].heap_next =
+			    CSL_NO_SEG;
+
+		a = heap_link(dom, a, b);
+		dom->segs[a].heap_next = pairs;
+		pairs = a;
+	}
+
+	while (pairs != CSL_NO_SEG) {
+		unsigned int a = pairs;
+
+		pairs = dom->segs[a].heap_next;
+		dom->segs[a].heap_next = CSL_NO_SEG;
+		root = heap_link(dom, root, a);
+	}
+
+	return root;
+}
+
+/* A segment is in a victim heap while it is closed and fully published */
+static bool is_victim(struct csl_segment* seg) {
+	return seg->state == CSL_SEG_CLOSED && !seg->nr_pending;
+}
+
+/* Add a segment to the victim heap of its valid count */
+static void victim_add(struct csl_domain* dom, unsigned int idx) {
+	unsigned int* root = &dom->victims[dom->segs[idx].nr_valid];
+
+	dom->segs[idx].heap_child = CSL_NO_SEG;
+	dom->segs[idx].heap_next = CSL_NO_SEG;
+	dom->segs[idx].heap_prev = CSL_NO_SEG;
+	*root = heap_link(dom, *root, idx);
+}
+
+/* Remove a segment from the victim heap of its valid count */
+static void victim_del(struct csl_domain* dom, unsigned int idx) {
+	struct csl_segment* seg = &dom->segs[idx];
+	unsigned int* root = &dom->victims[seg->nr_valid];
+	unsigned int sub = heap_merge_pairs(dom, seg->heap_child);
+
+	if (*root == idx) {
+		*root = sub;
+	} else {
+		struct csl_segment* prev = &dom->segs[seg->heap_prev];
+
+		if (prev->heap_child == idx)
+			prev->heap_child = seg->heap_next;
+		else
+			prev->heap_next = seg->heap_next;
+		if (seg->heap_next != CSL_NO_SEG)
+			dom->segs[seg->heap_next].heap_prev = seg->heap_prev;
+
+		*root = heap_link(dom, *root, sub);
+	}
+
+	seg->heap_child = seg->heap_next = seg->heap_prev = CSL_NO_SEG;
+}
+
+/**
+ * index_segments - Build the free lists and victim heaps of a domain
+ *
+ * @dev: Device pointer
+ * @dom: Domain pointer, with the state of every segment set
+ *
+ * Called once the segments are initialized or rebuilt, before any I/O.
+ */
+void index_segments(struct csl_device* dev, struct csl_domain* dom) {
+	for (unsigned int node = 0; node < nr_node_ids; node++)
+		INIT_LIST_HEAD(&dom->free_segs[node]);
+	INIT_LIST_HEAD(&dom->retiring);
+	for (unsigned int i = 0; i <= SEG_UNITS(dev); i++)
+		dom->victims[i] = CSL_NO_SEG;
+
+	for (unsigned int i = 0; i < dom->nr_segs; i++) {
+		struct csl_segment* seg = &dom->segs[i];
+
+		INIT_LIST_HEAD(&seg->list);
+		if (seg->state == CSL_SEG_FREE)
+			list_add_tail(&seg->list, &dom->free_segs[seg->node]);
+		else if (is_victim(seg))
+			victim_add(dom, i);
+	}
+}
+
+/**
+ * open_segment - Take a free segment to append to
+ *
+ * @dev: Device pointer
+ * @dom: Domain pointer
+ * @node: Preferred NUMA node of the segment
+ * @reserve: Number of free segments to leave for the garbage collector
+ *
+ * A segment of another node is only taken when @node has no free segment.
+ *
+ * Return: segment index, or CSL_NO_SEG if there is no free segment to take
+ */
+static unsigned int open_segment(struct csl_device* dev,
+				 struct csl_domain* dom, int node,
+				 unsigned int reserve) {
+	struct list_head* free = &dom->free_segs[node];
+	struct csl_segment* seg;
+
+	if (dom->nr_free_segs <= reserve) {
+		trace_csl_no_space(dev, dom - dev->domains, dom->nr_free_segs,
+				   dom->nr_retiring);
+		return CSL_NO_SEG;
+	}
+
+	if (list_empty(free)) {
+		for_each_online_node(node) {
+			free = &dom->free_segs[node];
+			if (!list_empty(free))
+				break;
+		}
+	}
+
+	seg = list_first_entry(free, struct csl_segment, list);
+	list_del_init(&seg->list);
+	seg->state = CSL_SEG_OPEN;
+	seg->nr_valid = 0;
+	seg->nr_pending = 0;
+	dom->nr_free_segs--;
+
+	return seg - dom->segs;
+}
+
+/* Close a full segment, so it can be selected as a victim once its pending
+ * blocks are published */
+static void close_segment(struct csl_domain* dom, unsigned int seg) {
+	if (seg == CSL_NO_SEG)
+		return;
+
+	dom->segs[seg].state = CSL_SEG_CLOSED;
+	dom->segs[seg].seq = dom->seq++;
+	if (is_victim(&dom->segs[seg]))
+		victim_add(dom, seg);
+}
+
+/**
+ * alloc_extent - Allocate physically contiguous blocks of the domain
+ *
+ * @dev: Device pointer
+ * @dom: Locked domain pointer
+ * @node: NUMA node of the writer
+ * @nr: Number of blocks wanted
+ * @len: Number of blocks allocated
+ *
+ * Append to the open segment of the node of the writer, and open a free one
+ * when it is full. An extent never crosses a segment, so fewer blocks may be
+ * allocated and the caller allocates again. The blocks stay pending until
+ * they are published or released, and a segment with pending blocks is
+ * never collected.
+ *
+ * Return: first physical block index, or CSL_UNMAPPED if there is no free
+ * segment left for writes
+ */
+u32 alloc_extent(struct csl_device* dev, struct csl_domain* dom, int node,
+		 unsigned int nr, unsigned int* len) {
+	struct csl_open* open = &dom->opens[node];
+	struct csl_segment* seg;
+	u32 p_idx;
+
+	if (open->seg == CSL_NO_SEG || open->cursor == SEG_UNITS(dev)) {
+		close_segment(dom, open->seg);
+		open->seg =
+		    open_segment(dev, dom, node, CSL_GC_RESERVED_SEGS);
+		open->cursor = 0;
+		if (open->seg == CSL_NO_SEG)
+			return CSL_UNMAPPED;
+	}
+
+	seg = &dom->segs[open->seg];
+	*len = min(nr, SEG_UNITS(dev) - open->cursor);
+	p_idx = segment_block(dev, dom, open->seg) + open->cursor;
+	open->cursor += *len;
+	seg->nr_pending += *len;
+
+	dom->nr_node_blocks[seg->node] += *len;
+	if (seg->node != node)
+		dom->nr_remote_blocks += *len;
+
+	return p_idx;
+}
+
+/**
+ * release_extent - Give reserved but unused blocks back to the domain
+ *
+ * @dev: Device pointer
+ * @dom: Locked domain pointer
+ * @p_idx: First physical block index
+ * @nr: Number of blocks
+ *
+ * The log only grows, so the blocks are lost until their segment is
+ * collected. They just stop holding the segment back from collection.
+ */
+void release_extent(struct csl_device* dev, struct csl_domain* dom, u32 p_idx,
+		    unsigned int nr) {
+	struct csl_segment* seg = block_segment(dev, dom, p_idx);
+
+	seg->nr_pending -= nr;
+	if (is_victim(seg))
+		victim_add(dom, seg - dom->segs);
+}
+
+/**
+ * invalidate_block - Drop a replaced block from its segment
+ *
+ * @dev: Device pointer
+ * @dom: Domain pointer
+ * @p_idx: Physical block index
+ */
+static void invalidate_block(struct csl_device* dev, struct csl_domain* dom,
+			     u32 p_idx) {
+	struct csl_segment* seg = block_segment(dev, dom, p_idx);
+	bool victim = is_victim(seg);
+
+	dev->p2l[p_idx] = CSL_UNMAPPED;
+	if (victim)
+		victim_del(dom, seg - dom->segs);
+	seg->nr_valid--;
+	if (victim)
+		victim_add(dom, seg - dom->segs);
+}
+
+/**
+ * publish_extent - Map consecutive logical units to an extent
+ *
+ * @dev: Device pointer
+ * @dom: Locked domain pointer
+ * @unit: First logical unit index
+ * @p_idx: First physical block index of the extent
+ * @nr: Number of units
+ *
+ * The extent must be filled before, so a lock-free reader sees either the
+ * old or the new block, but never a partially written one. Its chunk is
+ * marked dirty before the map points to it, so a checkpoint that copies the
+ * map writes it back afterwards. Replaced blocks are dropped from the valid
+ * count of their segment.
+ */
+void publish_extent(struct csl_device* dev, struct csl_domain* dom,
+		    unsigned long unit, u32 p_idx, unsigned int nr) {
+	struct csl_segment* seg = block_segment(dev, dom, p_idx);
+
+	seg->nr_pending -= nr;
+	seg->nr_valid += nr;
+	if (is_victim(seg))
+		victim_add(dom, seg - dom->segs);
+	dom->nr_host_writes += nr;
+	backing_mark_dirty(dev, p_idx);
+
+	for (unsigned int i = 0; i < nr; i++) {
+		u32 old_idx = dev->map[unit + i];
+
+		dev->p2l[p_idx + i] = unit + i;
+		smp_store_release(&dev->map[unit + i], p_idx + i);
+		trace_csl_remap(dev, unit + i, old_idx, p_idx + i, false);
+
+		if (old_idx != CSL_UNMAPPED)
+			invalidate_block(dev, dom, old_idx);
+	}
+	journal_append(dev, dom, unit, p_idx, nr);
+}
+
+/**
+ * unmap_extent - Unmap consecutive logical units
+ *
+ * @dev: Device pointer
+ * @dom: Locked domain pointer
+ * @unit: First logical unit index
+ * @nr: Number of units
+ *
+ * Lock-free readers that still see the old block keep reading the old data,
+ * and the block is only reused after its segment is collected.
+ */
+void unmap_extent(struct csl_device* dev, struct csl_domain* dom,
+		  unsigned long unit, unsigned int nr) {
+	for (unsigned int i = 0; i < nr; i++) {
+		u32 old_idx = dev->map[unit + i];
+
+		if (old_idx == CSL_UNMAPPED)
+			continue;
+
+		WRITE_ONCE(dev->map[unit + i], CSL_UNMAPPED);
+		trace_csl_remap(dev, unit + i, old_idx, CSL_UNMAPPED, false);
+		invalidate_block(dev, dom, old_idx);
+	}
+	journal_append(dev, dom, unit, CSL_UNMAPPED, nr);
+}
+
+/**
+ * select_victim - Select the segment to collect
+ *
+ * @dev: Device pointer
+ * @dom: Locked domain pointer
+ *
+ * Only the oldest segment of every valid count can score best, so only the
+ * roots of the victim heaps are scored. A segment that is entirely valid
+ * would not gain any space. The victim leaves its heap, and is not freed
+ * until it is collected.
+ *
+ * Return: segment index, or CSL_NO_SEG if no segment is worth collecting
+ */
+static unsigned int select_victim(struct csl_device* dev,
+				  struct csl_domain* dom) {
+	const struct csl_gc_policy* policy = &gc_policies[dev->gc_policy];
+	unsigned int victim = CSL_NO_SEG;
+	u64 best = 0;
+
+	for (unsigned int i = 0; i < SEG_UNITS(dev); i++) {
+		unsigned int root = dom->victims[i];
+		u64 score;
+
+		if (root == CSL_NO_SEG)
+			continue;
+
+		score = policy->score(dev, dom, &dom->segs[root]);
+		if (victim == CSL_NO_SEG || score > best) {
+			victim = root;
+			best = score;
+		}
+	}
+
+	if (victim != CSL_NO_SEG) {
+		victim_del(dom, victim);
+		dom->segs[victim].state = CSL_SEG_COLLECTING;
+	}
+
+	return victim;
+}
+
+/* Allocate a block for a migrated block from the segment of the collector,
+ * preferably on the node of the victim */
+static u32 alloc_gc_block(struct csl_device* dev, struct csl_domain* dom,
+			  int node) {
+	if (dom->gc_seg == CSL_NO_SEG || dom->gc_cursor == SEG_UNITS(dev)) {
+		close_segment(dom, dom->gc_seg);
+		dom->gc_seg = open_segment(dev, dom, node, 0);
+		dom->gc_cursor = 0;
+		if (dom->gc_seg == CSL_NO_SEG)
+			return CSL_UNMAPPED;
+	}
+
+	dom->segs[dom->gc_seg].nr_pending++;
+	return segment_block(dev, dom, dom->gc_seg) + dom->gc_cursor++;
+}
+
+/**
+ * struct csl_gc_copy - Valid block copied by the garbage collector
+ * @unit: 				Logical unit index
+ * @from: 				Block of the victim
+ * @to: 				Block of the collector segment
+ */
+struct csl_gc_copy {
+	u32 unit; /* Logical unit */
+	u32 from; /* Victim block */
+	u32 to;	  /* Collector block */
+};
+
+/* Reserve blocks of the collector segment for the next valid blocks of the
+ * victim, starting at *p_idx */
+static unsigned int reserve_copies(struct csl_device* dev,
+				   struct csl_domain* dom,
+				   struct csl_segment* seg, u32* p_idx, u32 end,
+				   struct csl_gc_copy* copies, bool* failed) {
+	unsigned int nr = 0;
+
+	for (; nr < CSL_GC_COPY_BLOCKS && seg->nr_valid > nr && *p_idx < end;
+	     (*p_idx)++) {
+		u32 unit = dev->p2l[*p_idx];
+		u32 to;
+
+		if (unit == CSL_UNMAPPED)
+			continue;
+
+		to = alloc_gc_block(dev, dom, seg->node);
+		if (to == CSL_UNMAPPED) {
+			pr_err("%sNo free segment to collect into\n", PROMPT);
+			*failed = true;
+			break;
+		}
+
+		copies[nr++] = (struct csl_gc_copy){unit, *p_idx, to};
+	}
+
+	return nr;
+}
+
+/**
+ * publish_copy - Map a unit to its copy, unless it changed meanwhile
+ *
+ * @dev: Device pointer
+ * @dom: Locked domain pointer
+ * @copy: Copied block
+ *
+ * A write or an unmap of the unit while it was copied wins over the copy,
+ * which is then left as an unmapped block of the collector segment.
+ *
+ * Return: 1 if the unit was moved, 0 otherwise
+ */
+static unsigned int publish_copy(struct csl_device* dev,
+				 struct csl_domain* dom,
+				 struct csl_gc_copy* copy) {
+	struct csl_segment* seg = block_segment(dev, dom, copy->to);
+	unsigned int moved = 0;
+
+	seg->nr_pending--;
+
+	if (dev->map[copy->unit] == copy->from) {
+		dev->p2l[copy->to] = copy->unit;
+		seg->nr_valid++;
+		backing_mark_dirty(dev, copy->to);
+		smp_store_release(&dev->map[copy->unit], copy->to);
+		trace_csl_remap(dev, copy->unit, copy->from, copy->to, true);
+		invalidate_block(dev, dom, copy->from);
+		dom->nr_gc_writes++;
+		journal_append(dev, dom, copy->unit, copy->to, 1);
+		moved = 1;
+	}
+
+	if (is_victim(seg))
+		victim_add(dom, seg - dom->segs);
+
+	return moved;
+}
+
+/**
+ * migrate_segment - Move the valid blocks out of a segment
+ *
+ * @dev: Device pointer
+ * @dom: Domain pointer, locked by the caller, which gets it back locked
+ * @victim: Segment index, selected by select_victim()
+ *
+ * Valid blocks are found with the reverse map and appended to the segment
+ * of the collector, which is kept apart from the open segment of the writes
+ * so cold data is not mixed with hot data again. Like the writes, the
+ * collector reserves its blocks under the lock, copies without it, and
+ * publishes the copies under it again, so the lock is never held for a
+ * copy. The victim is retired when it holds no valid block, and freed after
+ * a grace period. With a backing file, it is also kept until the journal
+ * records that moved its blocks are durable, or a crash would replay a map
+ * that points into reused blocks.
+ */
+static void migrate_segment(struct csl_device* dev, struct csl_domain* dom,
+			    unsigned int victim) {
+	struct csl_segment* seg = &dom->segs[victim];
+	u32 p_idx = segment_block(dev, dom, victim);
+	u32 end = p_idx + SEG_UNITS(dev);
+	struct csl_gc_copy copies[CSL_GC_COPY_BLOCKS];
+	unsigned int migrated = 0, nr;
+	bool failed = false;
+
+	do {
+		nr = reserve_copies(dev, dom, seg, &p_idx, end, copies,
+				    &failed);
+		if (!nr)
+			break;
+
+		/* the victim is not freed while it is collected */
+		RELEASE_WRITE_LOCK(dom);
+		for (unsigned int i = 0; i < nr; i++)
+			memcpy(IDX_PTR(dev, copies[i].to),
+			       IDX_PTR(dev, copies[i].from), UNIT_SIZE(dev));
+		GET_WRITE_LOCK(dom);
+
+		for (unsigned int i = 0; i < nr; i++)
+			migrated += publish_copy(dev, dom, &copies[i]);
+	} while (!failed && nr == CSL_GC_COPY_BLOCKS);
+
+	trace_csl_gc_segment(dev, dom - dev->domains, victim, migrated);
+
+	/* without space to collect into, the victim is collected later */
+	if (seg->nr_valid) {
+		seg->state = CSL_SEG_CLOSED;
+		victim_add(dom, victim);
+		return;
+	}
+
+	DEBUG_MESSAGE("%sSegment %u of domain %ld collected\n", PROMPT, victim,
+		      (long)(dom - dev->domains));
+
+	seg->state = CSL_SEG_RETIRING;
+	seg->gp = start_poll_synchronize_rcu();
+	seg->lsn = dom->jnl.lsn;
+	list_add_tail(&seg->list, &dom->retiring);
+	dom->nr_retiring++;
+	dom->nr_collected++;
+}
+
+/* Free the retired segments whose grace period has elapsed, and whose
+ * migration is durable in a backing file. They retire in order of their
+ * grace periods and journal records, so only the oldest ones are checked. */
+static unsigned int free_retired_segments(struct csl_device* dev,
+					  struct csl_domain* dom) {
+	unsigned int nr = 0;
+
+	while (!list_empty(&dom->retiring)) {
+		struct csl_segment* seg = list_first_entry(
+		    &dom->retiring, struct csl_segment, list);
+
+		if (!poll_state_synchronize_rcu(seg->gp))
+			break;
+		if (dev->backing
+		    && READ_ONCE(dom->jnl.durable_lsn) < seg->lsn)
+			break;
+
+		list_move_tail(&seg->list, &dom->free_segs[seg->node]);
+		seg->state = CSL_SEG_FREE;
+		dom->nr_free_segs++;
+		dom->nr_retiring--;
+		nr++;
+	}
+
+	return nr;
+}
+
+/**
+ * wake_gc - Wake the garbage collector up
+ *
+ * @dev: Device pointer
+ *
+ * Safe to call from the dispatch path, it never sleeps.
+ */
+void wake_gc(struct csl_device* dev) {
+	if (READ_ONCE(dev->gc_kick))
+		return;
+
+	WRITE_ONCE(dev->gc_kick, true);
+	wake_up(&dev->gc_wait);
+}
+
+/**
+ * garbage_collecting - Garbage collecting on the write path
+ *
+ * @dev: Device pointer
+ * @dom: Locked domain pointer
+ *
+ * Retired segments may still be read by lock-free readers that looked their
+ * blocks up before they were migrated, so they are only freed once their
+ * grace period has elapsed. Migration is left to the garbage collector
+ * thread, which is woken up at the low watermark, so a write never pays for
+ * it.
+ */
+void garbage_collecting(struct csl_device* dev, struct csl_domain* dom) {
+	free_retired_segments(dev, dom);
+
+	if (dom->nr_free_segs + dom->nr_retiring <= dev->gc_low_segs)
+		wake_gc(dev);
+}
+
+/**
+ * collect_domain - Collect the segments of a domain up to the high watermark
+ *
+ * @dev: Device pointer
+ * @dom: Domain pointer
+ * @freed: Number of segments freed, increased
+ *
+ * The lock is dropped after every victim, and while its blocks are copied,
+ * so writes to the domain only wait for the collector to reserve or publish
+ * CSL_GC_COPY_BLOCKS blocks. At most CSL_GC_BATCH_SEGS victims are collected
+ * before the other domains get their turn.
+ *
+ * Return: true if segments of the domain are still waiting for a grace
+ * period
+ */
+static bool collect_domain(struct csl_device* dev, struct csl_domain* dom,
+			   unsigned int* freed) {
+	unsigned int victim;
+	bool retiring;
+
+	for (unsigned int batch = 0;; batch++) {
+		GET_WRITE_LOCK(dom);
+
+		*freed += free_retired_segments(dev, dom);
+
+		victim = CSL_NO_SEG;
+		if (batch < CSL_GC_BATCH_SEGS
+		    && dom->nr_free_segs + dom->nr_retiring < dev->gc_high_segs)
+			victim = select_victim(dev, dom);
+		if (victim != CSL_NO_SEG)
+			migrate_segment(dev, dom, victim);
+
+		retiring = dom->nr_retiring;
+
+		RELEASE_WRITE_LOCK(dom);
+
+		if (victim == CSL_NO_SEG)
+			break;
+
+		cond_resched();
+	}
+
+	return retiring;
+}
+
+/**
+ * gc_run - Run one pass of the garbage collector
+ *
+ * @dev: Device pointer
+ * @retiring: Set if segments are still waiting for a grace period
+ *
+ * Collect every domain up to the high watermark. The caller waits for the
+ * grace period of the segments retired in this pass, which are freed on the
+ * next one.
+ *
+ * Return: number of segments freed
+ */
+unsigned int gc_run(struct csl_device* dev, bool* retiring) {
+	unsigned int freed = 0;
+
+	WRITE_ONCE(dev->nr_gc_runs, dev->nr_gc_runs + 1);
+	trace_csl_gc_begin(dev);
+
+	*retiring = false;
+	for (unsigned int i = 0; i < dev->nr_domains; i++)
+		*retiring |= collect_domain(dev, &dev->domains[i], &freed);
+
+	trace_csl_gc_end(dev, freed, *retiring);
+
+	return freed;
+}
+
+/**
+ * gc_thread - Garbage collector thread
+ *
+ * @data: Device pointer
+ *
+ * Sleep until a domain reaches the low watermark, then run a pass of the
+ * garbage collector. Retired segments are freed after a grace period, and
+ * the hardware queues are run again, since writes that found no free
+ * segment were requeued.
+ */
+static int gc_thread(void* data) {
+	struct csl_device* dev = data;
+
+	while (!kthread_should_stop()) {
+		unsigned int freed;
+		bool retiring;
+
+		wait_event_interruptible(dev->gc_wait,
+					 READ_ONCE(dev->gc_kick)
+					     || kthread_should_stop());
+		WRITE_ONCE(dev->gc_kick, false);
+
+		freed = gc_run(dev, &retiring);
+
+		/* free the segments retired in this pass on the next one, which
+		 * the journal starts once they are durable in a backing file */
+		if (retiring) {
+			synchronize_rcu();
+			if (dev->backing)
+				wake_journal(dev);
+			else
+				WRITE_ONCE(dev->gc_kick, true);
+		}
+
+		if (freed)
+			blk_mq_run_hw_queues(dev->queue, true);
+	}
+
+	return 0;
+}
+
+/**
+ * gc_init - Set the watermarks of the garbage collector
+ *
+ * @dev: Device pointer
+ *
+ * The watermarks are set from the overprovisioned segments of a domain. The
+ * collector starts once a domain has no more than gc_low_segs free segments,
+ * and stops at gc_high_segs, so it works in bursts instead of every write.
+ */
+void gc_init(struct csl_device* dev) {
+	unsigned int op_segs = dev->nr_segs - DOMAIN_LOGICAL_SEGS(dev);
+
+	dev->gc_low_segs = CSL_GC_RESERVED_SEGS + 1 + op_segs / 4;
+	dev->gc_high_segs =
+	    min(dev->gc_low_segs + max(1U, op_segs / 4), op_segs);
+	dev->gc_kick = false;
+	init_waitqueue_head(&dev->gc_wait);
+}
+
+/**
+ * gc_start - Start the garbage collector thread
+ *
+ * @dev: Device pointer
+ *
+ * Return: 0 on success, negative error code on failure
+ */
+int gc_start(struct csl_device* dev) {
+	gc_init(dev);
+
+	dev->gc_thread =
+	    kthread_run(gc_thread, dev, "%s_gc", dev->disk->disk_name);
+	if (IS_ERR(dev->gc_thread)) {
+		int ret = PTR_ERR(dev->gc_thread);
+
+		dev->gc_thread = NULL;
+		return ret;
+	}
+
+	return 0;
+}
+
+/**
+ * gc_stop - Stop the garbage collector thread
+ *
+ * @dev: Device pointer
+ */
+void gc_stop(struct csl_device* dev) {
+	if (!dev->gc_thread)
+		return;
+
+	kthread_stop(dev->gc_thread);
+	dev->gc_thread = NULL;
+}
+
+/**
+ * print_node_stats - Print the block placement of every NUMA node
+ *
+ * @dev: Device pointer
+ */
+void print_node_stats(struct csl_device* dev) {
+	u64 remote = 0;
+	int node;
+
+	for_each_online_node(node) {
+		u64 blocks = 0;
+
+		for (unsigned int i = 0; i < dev->nr_domains; i++)
+			blocks += dev->domains[i].nr_node_blocks[node];
+
+		pr_info("%sNode %d Allocated Block Count: %llu\n", PROMPT, node,
+			blocks);
+	}
+
+	for (unsigned int i = 0; i < dev->nr_domains; i++)
+		remote += dev->domains[i].nr_remote_blocks;
+
+	pr_info("%sRemote Allocated Block Count: %llu\n", PROMPT, remote);
+}
+
+/**
+ * write_amplification - Compute the write amplification of the device
+ *
+ * @dev: Device pointer
+ *
+ * Write amplification is the number of blocks written to the device,
+ * including the ones migrated by the garbage collector, per block written by
+ * the host.
+ *
+ * Return: write amplification factor times 100, 0 before the first write
+ */
+u64 write_amplification(struct csl_device* dev) {
+	u64 host = 0, gc = 0;
+
+	for (unsigned int i = 0; i < dev->nr_domains; i++) {
+		host += READ_ONCE(dev->domains[i].nr_host_writes);
+		gc += READ_ONCE(dev->domains[i].nr_gc_writes);
+	}
+
+	return host ? div64_u64((host + gc) * 100, host) : 0;
+}
+
+/**
+ * print_write_amplification - Print the write amplification of the device
+ *
+ * @dev: Device pointer
+ */
+void print_write_amplification(struct csl_device* dev) {
+	u64 host = 0, gc = 0, waf = write_amplification(dev);
+
+	for (unsigned int i = 0; i < dev->nr_domains; i++) {
+		host += dev->domains[i].nr_host_writes;
+		gc += dev->domains[i].nr_gc_writes;
+	}
+
+	pr_info("%sHost writes: %llu, GC writes: %llu, WAF: %llu.%02llu (%s)\n",
+		PROMPT, host, gc, waf / 100, waf % 100,
+		gc_policy_name(dev->gc_policy));
+}
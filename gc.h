@@ -0,0 +1,36 @@
+#include <linux/types.h>
+#include "metadata.h"
+#include "type.h"
+
+#ifndef __CSL_GC_OPS
+#define __CSL_GC_OPS
+
+/* Victim selection policies of the segment garbage collector */
+#define CSL_GC_GREEDY 0
+#define CSL_GC_COST_BENEFIT 1
+#define CSL_GC_FIFO 2
+#define CSL_NR_GC_POLICIES 3
+
+const char* gc_policy_name(unsigned int policy);
+
+void index_segments(struct csl_device* dev, struct csl_domain* dom);
+
+u32 alloc_extent(struct csl_device* dev, struct csl_domain* dom, int node,
+		 unsigned int nr, unsigned int* len);
+void release_extent(struct csl_device* dev, struct csl_domain* dom, u32 p_idx,
+		    unsigned int nr);
+void publish_extent(struct csl_device* dev, struct csl_domain* dom,
+		    unsigned long unit, u32 p_idx, unsigned int nr);
+void unmap_extent(struct csl_device* dev, struct csl_domain* dom,
+		  unsigned long unit, unsigned int nr);
+void wake_gc(struct csl_device* dev);
+void garbage_collecting(struct csl_device* dev, struct csl_domain* dom);
+void gc_init(struct csl_device* dev);
+unsigned int gc_run(struct csl_device* dev, bool* retiring);
+int gc_start(struct csl_device* dev);
+void gc_stop(struct csl_device* dev);
+void print_node_stats(struct csl_device* dev);
+u64 write_amplification(struct csl_device* dev);
+void print_write_amplification(struct csl_device* dev);
+
+#endif
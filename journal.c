@@ -0,0 +1,591 @@
+#include <linux/blk-mq.h>
+#include <linux/crc32.h>
+#include <linux/jiffies.h>
+#include <linux/kthread.h>
+#include <linux/sched.h>
+#include <linux/wait.h>
+#include "backing.h"
+#include "gc.h"
+#include "journal.h"
+#include "lock.h"
+
+/**
+ * wake_journal - Wake the journal thread up
+ *
+ * @dev: Device pointer
+ *
+ * Safe to call under a domain lock and from the dispatch path.
+ */
+void wake_journal(struct csl_device* dev) {
+	if (READ_ONCE(dev->jnl_kick))
+		return;
+
+	WRITE_ONCE(dev->jnl_kick, true);
+	wake_up(&dev->jnl_wait);
+}
+
+/**
+ * journal_append - Append a map update to the journal of a domain
+ *
+ * @dev: Device pointer
+ * @dom: Locked domain pointer
+ * @unit: First logical unit index
+ * @p_idx: First physical block index, or CSL_UNMAPPED for an unmap
+ * @nr: Number of units
+ *
+ * An update that continues the previous record is merged into it. When the
+ * active buffer is full, the record is dropped but still takes a sequence
+ * number, so replay stops at the gap, and the journal thread is woken up to
+ * take a checkpoint that covers it. Never sleeps.
+ */
+void journal_append(struct csl_device* dev, struct csl_domain* dom,
+		    unsigned long unit, u32 p_idx, unsigned int nr) {
+	struct csl_journal* jnl = &dom->jnl;
+	struct csl_jrec* rec;
+
+	if (!jnl->bufs[0])
+		return;
+
+	if (jnl->nr && !jnl->overflow) {
+		rec = &jnl->bufs[jnl->active][jnl->nr - 1];
+		if (rec->unit + rec->nr == unit
+		    && (p_idx == CSL_UNMAPPED
+			    ? rec->p_idx == CSL_UNMAPPED
+			    : rec->p_idx != CSL_UNMAPPED
+				  && rec->p_idx + rec->nr == p_idx)) {
+			rec->nr += nr;
+			return;
+		}
+	}
+
+	jnl->lsn++;
+
+	if (jnl->nr == dev->jnl_size) {
+		jnl->nr_dropped++;
+		if (!jnl->overflow) {
+			jnl->overflow = true;
+			wake_journal(dev);
+		}
+		return;
+	}
+
+	rec = &jnl->bufs[jnl->active][jnl->nr++];
+	rec->unit = unit;
+	rec->p_idx = p_idx;
+	rec->nr = nr;
+
+	if (jnl->nr == dev->jnl_size / 2)
+		wake_journal(dev);
+}
+
+/**
+ * swap_journal - Take the records of a domain to write them to the log
+ *
+ * @dev: Device pointer
+ * @dom: Domain pointer
+ * @checkpoint: Note the next sequence number for a checkpoint
+ *
+ * The buffers are swapped under the domain lock, so writes append to the
+ * other buffer while the records are written without the lock. Records
+ * become durable with the log, unless some were dropped, which only a
+ * checkpoint covers.
+ */
+static void swap_journal(struct csl_device* dev, struct csl_domain* dom,
+			 bool checkpoint) {
+	struct csl_journal* jnl = &dom->jnl;
+
+	GET_WRITE_LOCK(dom);
+	if (checkpoint) {
+		jnl->ckpt_lsn = jnl->lsn;
+		jnl->overflow = false;
+	}
+	if (!jnl->overflow)
+		jnl->flushed_lsn = jnl->lsn;
+	jnl->flush_nr = jnl->nr;
+	jnl->flush_lsn = jnl->first_lsn;
+	jnl->active ^= 1;
+	jnl->nr = 0;
+	jnl->first_lsn = jnl->lsn;
+	RELEASE_WRITE_LOCK(dom);
+}
+
+/**
+ * write_journal - Write the taken records of a domain to the log
+ *
+ * @dev: Device pointer
+ * @dom: Domain pointer
+ *
+ * Return: 0 on success, -EIO on failure
+ */
+static int write_journal(struct csl_device* dev, struct csl_domain* dom) {
+	struct csl_journal* jnl = &dom->jnl;
+	struct csl_jrec* recs = jnl->bufs[jnl->active ^ 1];
+	struct csl_jblock blk = {
+	    .magic = CSL_JOURNAL_MAGIC,
+	    .domain = dom - dev->domains,
+	    .nr = jnl->flush_nr,
+	    .lsn = jnl->flush_lsn,
+	};
+	size_t len = blk.nr * sizeof(struct csl_jrec);
+
+	if (!blk.nr || !dev->jnl_file)
+		return 0;
+
+	blk.crc = crc32_le(crc32_le(~0U, &blk, sizeof(blk)), recs, len);
+
+	if (kernel_write(dev->jnl_file, &blk, sizeof(blk), &dev->jnl_pos)
+		!= sizeof(blk)
+	    || kernel_write(dev->jnl_file, recs, len, &dev->jnl_pos) != len)
+		return -EIO;
+
+	return 0;
+}
+
+/**
+ * journal_flush - Write the data and the journal records so far
+ *
+ * @dev: Device pointer
+ * @checkpoint: Note the next sequence numbers for a checkpoint
+ *
+ * The records are taken before the data is written back, and a block is
+ * marked dirty in the same critical section that journals its mapping, so
+ * the log never points to data that is not in the backing file yet.
+ *
+ * Return: 0 on success, negative error code on failure
+ */
+static int journal_flush(struct csl_device* dev, bool checkpoint) {
+	int ret = 0;
+
+	if (READ_ONCE(dev->crashed))
+		return -EIO;
+
+	for (unsigned int i = 0; i < dev->nr_domains; i++)
+		swap_journal(dev, &dev->domains[i], checkpoint);
+
+	if (dev->backing)
+		ret = backing_writeback(dev);
+
+	for (unsigned int i = 0; i < dev->nr_domains; i++)
+		if (write_journal(dev, &dev->domains[i]))
+			ret = -EIO;
+
+	if (!ret && dev->jnl_file)
+		ret = vfs_fsync(dev->jnl_file, 0);
+
+	return ret;
+}
+
+/* Mark the flushed records durable, so their replaced segments are reused */
+static void journal_durable(struct csl_device* dev) {
+	bool retiring = false;
+
+	for (unsigned int i = 0; i < dev->nr_domains; i++) {
+		struct csl_domain* dom = &dev->domains[i];
+
+		WRITE_ONCE(dom->jnl.durable_lsn, dom->jnl.flushed_lsn);
+		retiring |= READ_ONCE(dom->nr_retiring);
+	}
+
+	if (retiring)
+		wake_gc(dev);
+}
+
+/* Empty the log, once a checkpoint covers all of its records */
+static int journal_reset(struct csl_device* dev) {
+	struct file* file;
+
+	if (!dev->jnl_file)
+		return 0;
+
+	file = file_create(dev->jnl_path);
+	if (IS_ERR(file))
+		return PTR_ERR(file);
+
+	file_close(dev->jnl_file);
+	dev->jnl_file = file;
+	dev->jnl_pos = 0;
+
+	return 0;
+}
+
+/**
+ * journal_checkpoint - Write a checkpoint and empty the log
+ *
+ * @dev: Device pointer
+ *
+ * Every domain notes its next sequence number and writes its records so far
+ * to the log, so the previous snapshot and the log cover every update until
+ * the new snapshot is complete. The snapshot is taken while writes go on; the
+ * records appended meanwhile stay in memory, and replaying them onto the
+ * snapshot gives the same map whether the snapshot saw them or not.
+ *
+ * Return: 0 on success, negative error code on failure
+ */
+static int journal_checkpoint(struct csl_device* dev) {
+	int ret;
+
+	if (READ_ONCE(dev->crashed))
+		return -EIO;
+
+	ret = journal_flush(dev, true);
+	if (ret && dev->backing)
+		return ret;
+
+	ret = save_metadata(dev);
+	if (ret)
+		return ret;
+
+	dev->nr_checkpoints++;
+	journal_durable(dev);
+
+	return journal_reset(dev);
+}
+
+/**
+ * journal_defer_request - Complete a request once it is durable
+ *
+ * @dev: Device pointer
+ * @rq: Flush request, or FUA write that is handled but not completed
+ * @kick: Wake the journal thread up, or leave it to the caller
+ *
+ * The journal thread completes the whole request after its next pass, which
+ * makes the data and the map of every write handled before durable. No bio
+ * of the request ends before.
+ */
+void journal_defer_request(struct csl_device* dev, struct request* rq,
+			   bool kick) {
+	unsigned long flags;
+
+	spin_lock_irqsave(&dev->flush_lock, flags);
+	list_add_tail(&rq->queuelist, &dev->flush_rqs);
+	spin_unlock_irqrestore(&dev->flush_lock, flags);
+
+	if (kick)
+		wake_journal(dev);
+}
+
+/* Complete the deferred requests with the result of a pass */
+static void complete_requests(struct list_head* rqs, int ret) {
+	struct request *rq, *next;
+
+	list_for_each_entry_safe(rq, next, rqs, queuelist) {
+		list_del_init(&rq->queuelist);
+		blk_mq_end_request(rq, errno_to_blk_status(ret));
+	}
+}
+
+/**
+ * journal_thread - Journal thread
+ *
+ * @data: Device pointer
+ *
+ * Flush the journal every CSL_JOURNAL_FLUSH_MS, when a buffer is half full,
+ * or when a request waits for it. A checkpoint is taken every checkpoint
+ * interval, when the log grows beyond the size of the map, so replay never
+ * reads more than a snapshot, or as soon as records were dropped or could
+ * not be written.
+ */
+static int journal_thread(void* data) {
+	struct csl_device* dev = data;
+	loff_t max_pos = max_t(loff_t, NR_UNITS(dev) * sizeof(u32),
+			       CSL_SNAPSHOT_IO_SIZE);
+	unsigned long last_ckpt = jiffies;
+	bool failed = false;
+
+	while (!kthread_should_stop()) {
+		bool overflow = failed;
+		LIST_HEAD(rqs);
+		int ret;
+
+		wait_event_interruptible_timeout(
+		    dev->jnl_wait,
+		    READ_ONCE(dev->jnl_kick) || kthread_should_stop(),
+		    msecs_to_jiffies(CSL_JOURNAL_FLUSH_MS));
+		WRITE_ONCE(dev->jnl_kick, false);
+
+		spin_lock_irq(&dev->flush_lock);
+		list_splice_init(&dev->flush_rqs, &rqs);
+		spin_unlock_irq(&dev->flush_lock);
+
+		for (unsigned int i = 0; i < dev->nr_domains; i++)
+			overflow |= READ_ONCE(dev->domains[i].jnl.overflow);
+
+		if (overflow || dev->jnl_pos > max_pos
+		    || time_after(jiffies,
+				  last_ckpt + dev->jnl_ckpt_interval)) {
+			ret = journal_checkpoint(dev);
+			last_ckpt = jiffies;
+		} else {
+			ret = journal_flush(dev, false);
+			if (!ret)
+				journal_durable(dev);
+		}
+
+		failed = ret;
+		complete_requests(&rqs, ret);
+	}
+
+	return 0;
+}
+
+/**
+ * replay_block - Replay a block of journal records onto the map
+ *
+ * @dev: Device pointer
+ * @dom: Domain of the block
+ * @blk: Block header
+ * @recs: Records of the block
+ *
+ * Records that the snapshot already covers are skipped. A domain stops at
+ * the first missing record, since the records after it may replace blocks
+ * that it mapped.
+ *
+ * Return: 0 on success, -EINVAL if a record does not fit the domain
+ */
+static int replay_block(struct csl_device* dev, struct csl_domain* dom,
+			struct csl_jblock* blk, struct csl_jrec* recs) {
+	struct csl_journal* jnl = &dom->jnl;
+
+	if (jnl->overflow || blk->lsn + blk->nr <= jnl->lsn)
+		return 0;
+
+	if (blk->lsn > jnl->lsn) {
+		pr_err("%sJournal of domain %ld misses records %llu to %llu\n",
+		       PROMPT, (long)(dom - dev->domains), jnl->lsn,
+		       blk->lsn - 1);
+		jnl->overflow = true;
+		return 0;
+	}
+
+	for (u32 i = jnl->lsn - blk->lsn; i < blk->nr; i++) {
+		struct csl_jrec* rec = &recs[i];
+		sector_t first = (sector_t)rec->unit << dev->unit_shift;
+		sector_t last = (sector_t)(rec->unit + rec->nr - 1)
+				<< dev->unit_shift;
+
+		if (!rec->nr || (u64)rec->unit + rec->nr > NR_UNITS(dev)
+		    || LBA_TO_DOMAIN(dev, first) != dom
+		    || LBA_TO_DOMAIN(dev, last) != dom
+		    || (rec->p_idx != CSL_UNMAPPED
+			&& (rec->p_idx < dom->base
+			    || (u64)rec->p_idx + rec->nr
+				   > dom->base + DOMAIN_BLOCKS(dev))))
+			return -EINVAL;
+
+		for (u32 j = 0; j < rec->nr; j++)
+			dev->map[rec->unit + j] = rec->p_idx == CSL_UNMAPPED
+						      ? CSL_UNMAPPED
+						      : rec->p_idx + j;
+
+		dev->jnl_replayed++;
+	}
+
+	jnl->lsn = blk->lsn + blk->nr;
+
+	return 0;
+}
+
+/**
+ * journal_replay - Replay the journal log onto the loaded snapshot
+ *
+ * @dev: Device pointer
+ *
+ * Blocks are read in order up to the end of the log, or up to the first
+ * torn or corrupted block, which ends the log of an unload that never
+ * finished.
+ *
+ * Return: 0 on success, -EINVAL if the log does not fit the map, -ENOMEM if
+ * a block can not be buffered
+ */
+int journal_replay(struct csl_device* dev) {
+	struct file* file = file_open_read(dev->jnl_path);
+	struct csl_jrec* recs = NULL;
+	size_t cap = 0;
+	loff_t pos = 0;
+	int ret = 0;
+
+	dev->jnl_replayed = 0;
+
+	if (IS_ERR(file))
+		return 0;
+
+	for (;;) {
+		struct csl_jblock blk;
+		size_t len;
+		u32 crc;
+
+		if (kernel_read(file, &blk, sizeof(blk), &pos) != sizeof(blk)
+		    || blk.magic != CSL_JOURNAL_MAGIC
+		    || blk.domain >= dev->nr_domains || !blk.nr
+		    || blk.nr > CSL_JOURNAL_MAX_RECS)
+			break;
+
+		len = blk.nr * sizeof(struct csl_jrec);
+		if (len > cap) {
+			kvfree(recs);
+			recs = kvmalloc(len, GFP_KERNEL);
+			cap = recs ? len : 0;
+			if (!recs) {
+				ret = -ENOMEM;
+				break;
+			}
+		}
+
+		if (kernel_read(file, recs, len, &pos) != len)
+			break;
+
+		crc = blk.crc;
+		blk.crc = 0;
+		if (crc32_le(crc32_le(~0U, &blk, sizeof(blk)), recs, len)
+		    != crc)
+			break;
+
+		ret = replay_block(dev, &dev->domains[blk.domain], &blk, recs);
+		if (ret)
+			break;
+	}
+
+	kvfree(recs);
+	file_close(file);
+
+	/* a domain that stopped at a gap starts over from its last record */
+	for (unsigned int i = 0; i < dev->nr_domains; i++)
+		dev->domains[i].jnl.overflow = false;
+
+	return ret;
+}
+
+/* Free the journal buffers of every domain */
+static void journal_free(struct csl_device* dev) {
+	for (unsigned int i = 0; i < dev->nr_domains; i++) {
+		struct csl_journal* jnl = &dev->domains[i].jnl;
+
+		kvfree(jnl->bufs[0]);
+		kvfree(jnl->bufs[1]);
+		jnl->bufs[0] = jnl->bufs[1] = NULL;
+	}
+}
+
+/**
+ * journal_start - Start journaling the map updates
+ *
+ * @dev: Device pointer
+ * @size_kb: Size of the journal buffers in KiB, 0 to save on unload only
+ * @ckpt_sec: Seconds between two checkpoints
+ *
+ * The records replayed on load are only in memory, so they are checkpointed
+ * before the log is emptied. The buffer space is split over the domains,
+ * with two buffers each.
+ *
+ * Return: 0 on success, negative error code on failure
+ */
+int journal_start(struct csl_device* dev, unsigned int size_kb,
+		  unsigned int ckpt_sec) {
+	struct file* file;
+	int ret;
+
+	/* everything loaded is covered by the snapshot and the log */
+	for (unsigned int i = 0; i < dev->nr_domains; i++) {
+		struct csl_journal* jnl = &dev->domains[i].jnl;
+
+		jnl->first_lsn = jnl->lsn;
+		jnl->flushed_lsn = jnl->lsn;
+		jnl->durable_lsn = jnl->lsn;
+	}
+
+	if (dev->jnl_replayed) {
+		ret = journal_checkpoint(dev);
+		if (ret)
+			return ret;
+	}
+
+	file = file_create(dev->jnl_path);
+	if (IS_ERR(file))
+		return PTR_ERR(file);
+
+	dev->jnl_pos = 0;
+	if (!size_kb) {
+		file_close(file);
+		return 0;
+	}
+
+	dev->jnl_size = max_t(unsigned int, CSL_JOURNAL_MIN_RECS,
+			      ((size_t)size_kb << 10) / dev->nr_domains / 2
+				  / sizeof(struct csl_jrec));
+	dev->jnl_ckpt_interval = max(1U, ckpt_sec) * HZ;
+	dev->jnl_kick = false;
+	init_waitqueue_head(&dev->jnl_wait);
+
+	for (unsigned int i = 0; i < dev->nr_domains; i++) {
+		struct csl_journal* jnl = &dev->domains[i].jnl;
+
+		jnl->bufs[0] = kvmalloc_array(
+		    dev->jnl_size, sizeof(struct csl_jrec), GFP_KERNEL);
+		jnl->bufs[1] = kvmalloc_array(
+		    dev->jnl_size, sizeof(struct csl_jrec), GFP_KERNEL);
+		if (!jnl->bufs[0] || !jnl->bufs[1]) {
+			ret = -ENOMEM;
+			goto free_buffers;
+		}
+	}
+
+	dev->jnl_file = file;
+	dev->jnl_thread =
+	    kthread_run(journal_thread, dev, "%s_jnl", dev->disk->disk_name);
+	if (IS_ERR(dev->jnl_thread)) {
+		ret = PTR_ERR(dev->jnl_thread);
+		dev->jnl_thread = NULL;
+		dev->jnl_file = NULL;
+		goto free_buffers;
+	}
+
+	return 0;
+
+free_buffers:
+	journal_free(dev);
+	file_close(file);
+	return ret;
+}
+
+/**
+ * journal_stop - Stop journaling the map updates
+ *
+ * @dev: Device pointer
+ * @checkpoint: Write a final checkpoint
+ *
+ * No map update may happen anymore. If the final checkpoint fails, the log
+ * still holds every record, so the next load replays them. Flushes that are
+ * still waiting complete with the result of the final checkpoint.
+ */
+void journal_stop(struct csl_device* dev, bool checkpoint) {
+	u64 nr_dropped = 0;
+	int ret = 0;
+
+	if (dev->jnl_thread) {
+		kthread_stop(dev->jnl_thread);
+		dev->jnl_thread = NULL;
+	}
+
+	if (checkpoint) {
+		ret = journal_checkpoint(dev);
+		if (ret)
+			pr_err("%sFailed to write the final checkpoint\n",
+			       PROMPT);
+	}
+
+	/* nothing is dispatched anymore, but a last pass may have missed */
+	complete_requests(&dev->flush_rqs, ret);
+
+	if (dev->jnl_file) {
+		file_close(dev->jnl_file);
+		dev->jnl_file = NULL;
+	}
+
+	for (unsigned int i = 0; i < dev->nr_domains; i++)
+		nr_dropped += dev->domains[i].jnl.nr_dropped;
+
+	pr_info("%s%llu checkpoints, %llu journal records dropped\n", PROMPT,
+		dev->nr_checkpoints, nr_dropped);
+
+	journal_free(dev);
+}
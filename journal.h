@@ -0,0 +1,43 @@
+#include <linux/types.h>
+#include "metadata.h"
+#include "type.h"
+
+#ifndef __CSL_JOURNAL_OPS
+#define __CSL_JOURNAL_OPS
+
+/* The journal thread writes the records of every domain as one block every
+ * CSL_JOURNAL_FLUSH_MS, or earlier when a buffer is half full */
+#define CSL_JOURNAL_MAGIC 0x4a4c5343 /* "CSLJ" */
+#define CSL_DEFAULT_JOURNAL_KB 1024
+#define CSL_JOURNAL_FLUSH_MS 100
+#define CSL_JOURNAL_MIN_RECS 64
+#define CSL_JOURNAL_MAX_RECS (1U << 24)
+
+/**
+ * struct csl_jblock - Header of a block of journal records in the log
+ * @magic: 				CSL_JOURNAL_MAGIC
+ * @domain: 				Domain of the records
+ * @nr: 				Number of records
+ * @crc: 				CRC32 of the header with this field zero,
+ * 					and of the records
+ * @lsn: 				Sequence number of the first record
+ */
+struct csl_jblock {
+	u32 magic;  /* Magic number */
+	u32 domain; /* Domain index */
+	u32 nr;	    /* Number of records */
+	u32 crc;    /* Block checksum */
+	u64 lsn;    /* First record sequence number */
+};
+
+void wake_journal(struct csl_device* dev);
+void journal_append(struct csl_device* dev, struct csl_domain* dom,
+		    unsigned long unit, u32 p_idx, unsigned int nr);
+void journal_defer_request(struct csl_device* dev, struct request* rq,
+			   bool kick);
+int journal_replay(struct csl_device* dev);
+int journal_start(struct csl_device* dev, unsigned int size_kb,
+		  unsigned int ckpt_sec);
+void journal_stop(struct csl_device* dev, bool checkpoint);
+
+#endif
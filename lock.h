@@ -0,0 +1,72 @@
+#include <linux/mutex.h>
+#include <linux/rwlock.h>
+#include <linux/rwsem.h>
+#include <linux/semaphore.h>
+#include "type.h"
+
+#ifndef __CSL_LOCK_OPS
+#define __CSL_LOCK_OPS
+
+/* Domain lock operations for each synchronization option, LOCK_SLEEPS tells
+ * whether the lock may sleep in queue_rq, which needs a blocking tag set */
+#ifdef _USE_MUTEX
+#define LOCK_NAME "mutex"
+#define LOCK_SLEEPS 1
+#define INIT_DOMAIN_LOCK(dom)               \
+	mutex_init(&dom->reader_cnt_mutex); \
+	mutex_init(&dom->rw_mutex);         \
+	dom->reader_nr = 0;
+#define GET_READ_LOCK(dom)                  \
+	mutex_lock(&dom->reader_cnt_mutex); \
+	dom->reader_nr++;                   \
+	if (dom->reader_nr == 1)            \
+		mutex_lock(&dom->rw_mutex); \
+	mutex_unlock(&dom->reader_cnt_mutex);
+#define RELEASE_READ_LOCK(dom)                \
+	mutex_lock(&dom->reader_cnt_mutex);   \
+	dom->reader_nr--;                     \
+	if (dom->reader_nr == 0)              \
+		mutex_unlock(&dom->rw_mutex); \
+	mutex_unlock(&dom->reader_cnt_mutex);
+#define GET_WRITE_LOCK(dom) mutex_lock(&dom->rw_mutex);
+#define RELEASE_WRITE_LOCK(dom) mutex_unlock(&dom->rw_mutex);
+#elif _USE_SEMAPHORE
+#define LOCK_NAME "semaphore"
+#define LOCK_SLEEPS 1
+#define INIT_DOMAIN_LOCK(dom)                \
+	sema_init(&dom->reader_cnt_mutex, 1); \
+	sema_init(&dom->rw_mutex, 1);         \
+	dom->reader_nr = 0;
+#define GET_READ_LOCK(dom)            \
+	down(&dom->reader_cnt_mutex); \
+	dom->reader_nr++;             \
+	if (dom->reader_nr == 1)      \
+		down(&dom->rw_mutex); \
+	up(&dom->reader_cnt_mutex);
+#define RELEASE_READ_LOCK(dom)        \
+	down(&dom->reader_cnt_mutex); \
+	dom->reader_nr--;             \
+	if (dom->reader_nr == 0)      \
+		up(&dom->rw_mutex);   \
+	up(&dom->reader_cnt_mutex);
+#define GET_WRITE_LOCK(dom) down(&dom->rw_mutex);
+#define RELEASE_WRITE_LOCK(dom) up(&dom->rw_mutex);
+#elif _USE_RWSEMAPHORE
+#define LOCK_NAME "rw_semaphore"
+#define LOCK_SLEEPS 1
+#define INIT_DOMAIN_LOCK(dom) init_rwsem(&dom->rw_mutex);
+#define GET_READ_LOCK(dom) down_read(&dom->rw_mutex);
+#define RELEASE_READ_LOCK(dom) up_read(&dom->rw_mutex);
+#define GET_WRITE_LOCK(dom) down_write(&dom->rw_mutex);
+#define RELEASE_WRITE_LOCK(dom) up_write(&dom->rw_mutex);
+#else
+#define LOCK_NAME "rwlock"
+#define LOCK_SLEEPS 0
+#define INIT_DOMAIN_LOCK(dom) rwlock_init(&dom->rwlock);
+#define GET_READ_LOCK(dom) read_lock(&dom->rwlock);
+#define RELEASE_READ_LOCK(dom) read_unlock(&dom->rwlock);
+#define GET_WRITE_LOCK(dom) write_lock(&dom->rwlock);
+#define RELEASE_WRITE_LOCK(dom) write_unlock(&dom->rwlock);
+#endif
+
+#endif
@@ -1,151 +1,567 @@
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
 #include "metadata.h"
+#include "backing.h"
+#include "journal.h"
+#include "lock.h"
+
+/* Seq_file position of the next chunk, or NULL past @nr chunks */
+static void* chunk_start(loff_t* pos, size_t nr) {
+	return *pos < nr ? pos : NULL;
+}
+
+static void* map_start(struct seq_file* m, loff_t* pos) {
+	struct csl_device* dev = m->private;
+
+	return chunk_start(pos, DIV_ROUND_UP(NR_UNITS(dev), CSL_DEBUGFS_UNITS));
+}
+
+static void* map_next(struct seq_file* m, void* v, loff_t* pos) {
+	++*pos;
+	return map_start(m, pos);
+}
+
+static void map_stop(struct seq_file* m, void* v) {}
 
 /**
- * print_metadata - Print metadata
+ * map_show - Print the mapped extents of a chunk of the map
  *
- * @dev: Device pointer
+ * @m: Seq_file of the device
+ * @v: Chunk position
+ *
+ * Units mapped to consecutive blocks are printed as one extent, "unit
+ * length block", and unmapped units are left out. The map is read like
+ * readers do, without any lock, one chunk of CSL_DEBUGFS_UNITS units per
+ * call, so a dump never holds up the I/O.
+ *
+ * Return: 0
  */
-void print_metadata(struct csl_device* dev) {
-	unsigned long idx;
-	struct sector_mapping_entry* ptr;
-	pr_info("%sBlock Map\n", PROMPT);
-
-	pr_info("|--------------------------------------------|\n");
-	pr_info("| Logical Block Index | Phyiscal Block Index |\n");
-	pr_info("|---------------------|----------------------|\n");
-	xa_for_each(&dev->map, idx, ptr)
-	    pr_info("| %-19d | %20d |\n", ptr->l_idx, ptr->p_idx);
-	pr_info("|--------------------------------------------|\n");
-
-	pr_info("%sFree Block Count: %ld\n", PROMPT,
-		list_count_nodes(&dev->freelist));
-	pr_info("%sDirty Block Count: %ld\n", PROMPT,
-		list_count_nodes(&dev->dirtylist));
+static int map_show(struct seq_file* m, void* v) {
+	struct csl_device* dev = m->private;
+	size_t first = *(loff_t*)v * CSL_DEBUGFS_UNITS;
+	size_t last = min_t(size_t, first + CSL_DEBUGFS_UNITS, NR_UNITS(dev));
+
+	for (size_t unit = first; unit < last;) {
+		u32 p_idx = READ_ONCE(dev->map[unit]);
+		unsigned int nr = 1;
+
+		if (p_idx == CSL_UNMAPPED) {
+			unit++;
+			continue;
+		}
+
+		while (unit + nr < last
+		       && READ_ONCE(dev->map[unit + nr]) == p_idx + nr)
+			nr++;
+
+		seq_printf(m, "%zu %u %u\n", unit, nr, p_idx);
+		unit += nr;
+	}
+
+	return 0;
+}
+
+static const struct seq_operations map_sops = {
+    .start = map_start,
+    .next = map_next,
+    .stop = map_stop,
+    .show = map_show,
+};
+DEFINE_SEQ_ATTRIBUTE(map);
+
+static void* segments_start(struct seq_file* m, loff_t* pos) {
+	struct csl_device* dev = m->private;
+
+	return chunk_start(pos, DIV_ROUND_UP(NR_CHUNKS(dev), CSL_DEBUGFS_SEGS));
 }
 
+static void* segments_next(struct seq_file* m, void* v, loff_t* pos) {
+	++*pos;
+	return segments_start(m, pos);
+}
+
+static const char* const seg_states[] = {
+    [CSL_SEG_FREE] = "free",
+    [CSL_SEG_OPEN] = "open",
+    [CSL_SEG_CLOSED] = "closed",
+    [CSL_SEG_RETIRING] = "retiring",
+    [CSL_SEG_COLLECTING] = "collecting",
+};
+
 /**
- * load_ptr - Load a data buffer address from a file
+ * segments_show - Print a chunk of the segments
  *
- * @file: File pointer that contains the data buffer address
- * @ptr: Pointer to the data buffer address
+ * @m: Seq_file of the device
+ * @v: Chunk position
  *
- * Return: 0 on success, -ENOMEM on failure
+ * Every line is "domain segment node state valid pending seq". The counters
+ * are read without the lock, so a line may be a moment old, but the dump
+ * never holds up the I/O.
+ *
+ * Return: 0
  */
-int load_ptr(struct file* file, void** ptr) {
-	size_t ret = 0;
-	uintptr_t tmp = 0;
+static int segments_show(struct seq_file* m, void* v) {
+	struct csl_device* dev = m->private;
+	size_t first = *(loff_t*)v * CSL_DEBUGFS_SEGS;
+	size_t last = min_t(size_t, first + CSL_DEBUGFS_SEGS, NR_CHUNKS(dev));
+
+	for (size_t i = first; i < last; i++) {
+		struct csl_domain* dom = &dev->domains[i / dev->nr_segs];
+		struct csl_segment* seg = &dom->segs[i % dev->nr_segs];
+		unsigned int state = READ_ONCE(seg->state);
+
+		seq_printf(m, "%zu %zu %d %s %u %u %lu\n", i / dev->nr_segs,
+			   i % dev->nr_segs, seg->node,
+			   state < ARRAY_SIZE(seg_states) ? seg_states[state]
+							  : "?",
+			   READ_ONCE(seg->nr_valid), READ_ONCE(seg->nr_pending),
+			   READ_ONCE(seg->seq));
+	}
 
-	ret = kernel_read(file, &tmp, sizeof(uintptr_t), &file->f_pos);
-	if (ret <= 0) {
-		return -ENOMEM;
+	return 0;
+}
+
+static const struct seq_operations segments_sops = {
+    .start = segments_start,
+    .next = segments_next,
+    .stop = map_stop,
+    .show = segments_show,
+};
+DEFINE_SEQ_ATTRIBUTE(segments);
+
+/**
+ * allocator_show - Print the allocator state of every domain
+ *
+ * @m: Seq_file of the device
+ * @v: Unused
+ *
+ * The state of a domain is taken under its lock, which is held for a few
+ * fields only, and printed after the lock is released.
+ *
+ * Return: 0
+ */
+static int allocator_show(struct seq_file* m, void* v) {
+	struct csl_device* dev = m->private;
+	int node;
+
+	for (unsigned int i = 0; i < dev->nr_domains; i++) {
+		struct csl_domain* dom = &dev->domains[i];
+		unsigned int free, retiring, gc_seg, gc_cursor;
+		unsigned long seq;
+
+		GET_WRITE_LOCK(dom);
+		free = dom->nr_free_segs;
+		retiring = dom->nr_retiring;
+		gc_seg = dom->gc_seg;
+		gc_cursor = dom->gc_cursor;
+		seq = dom->seq;
+		RELEASE_WRITE_LOCK(dom);
+
+		seq_printf(m,
+			   "domain %u base %u free %u retiring %u seq %lu "
+			   "gc %d:%u",
+			   i, dom->base, free, retiring, seq, (int)gc_seg,
+			   gc_cursor);
+		for_each_online_node(node) {
+			struct csl_open open = {
+			    .seg = READ_ONCE(dom->opens[node].seg),
+			    .cursor = READ_ONCE(dom->opens[node].cursor),
+			};
+
+			seq_printf(m, " node%d %d:%u", node, (int)open.seg,
+				   open.cursor);
+		}
+		seq_putc(m, '\n');
 	}
-	*ptr = UINT64_TO_PTR(tmp);
 
 	return 0;
 }
+DEFINE_SHOW_ATTRIBUTE(allocator);
 
 /**
- * save_ptr - Save a data buffer address to a file
+ * map_bin_read - Read the map as a binary dump
  *
- * @file: File pointer to save the data buffer address
- * @ptr: Pointer to the data buffer address
+ * @file: Debugfs file
+ * @buf: User buffer
+ * @count: Bytes to read
+ * @ppos: File position
+ *
+ * The dump is the map as it is in memory, one u32 block index per unit in
+ * host byte order, CSL_UNMAPPED for an unmapped unit. A read copies at most
+ * CSL_DEBUGFS_BIN_SIZE bytes, so it never runs for long.
+ *
+ * Return: number of bytes read, or negative error code
  */
-int save_ptr(struct file* file, void* ptr) {
-	uintptr_t tmp = PTR_TO_UINT64(ptr);
-	kernel_write(file, &tmp, sizeof(uintptr_t), &file->f_pos);
+static ssize_t map_bin_read(struct file* file, char __user* buf, size_t count,
+			    loff_t* ppos) {
+	struct csl_device* dev = file->private_data;
+
+	return simple_read_from_buffer(buf, min_t(size_t, count,
+						  CSL_DEBUGFS_BIN_SIZE),
+				       ppos, dev->map,
+				       NR_UNITS(dev) * sizeof(u32));
+}
+
+static const struct file_operations map_bin_fops = {
+    .owner = THIS_MODULE,
+    .open = simple_open,
+    .read = map_bin_read,
+    .llseek = default_llseek,
+};
+
+/**
+ * metadata_debugfs_init - Create the metadata files of a device in debugfs
+ *
+ * @dev: Device pointer, with its debugfs directory
+ *
+ * map lists the mapped extents, map.bin dumps the map in binary, segments
+ * lists the state of every segment and allocator the open segments and free
+ * space of every domain. Every file is streamed in bounded chunks.
+ *
+ * Debug builds add crash: writing 1 freezes the backing file, the journal
+ * and the snapshots as if the machine lost power, while requests go on in
+ * memory. Reloading the device then loads the state of the crash.
+ */
+void metadata_debugfs_init(struct csl_device* dev) {
+	debugfs_create_file("map", 0400, dev->debugfs, dev, &map_fops);
+	debugfs_create_file("map.bin", 0400, dev->debugfs, dev, &map_bin_fops);
+	debugfs_create_file("segments", 0400, dev->debugfs, dev,
+			    &segments_fops);
+	debugfs_create_file("allocator", 0400, dev->debugfs, dev,
+			    &allocator_fops);
+
+	if (IS_ENABLED(DEBUG))
+		debugfs_create_bool("crash", 0600, dev->debugfs,
+				    &dev->crashed);
+}
+
+/**
+ * struct csl_snapshot - Buffered sequential access to a snapshot file
+ * @file: 				Snapshot file
+ * @pos: 				File position after the buffer
+ * @buf: 				Buffer of CSL_SNAPSHOT_IO_SIZE bytes
+ * @len: 				Bytes in the buffer
+ * @off: 				Bytes of the buffer consumed by reads
+ * @nr: 				Bytes of the current section
+ * @crc: 				CRC32 of the current section
+ */
+struct csl_snapshot {
+	struct file* file;
+	loff_t pos;
+	u8* buf;
+	size_t len;
+	size_t off;
+	u64 nr;
+	u32 crc;
+};
+
+/* Function to start a section at the current position */
+static void snapshot_begin(struct csl_snapshot* snap) {
+	snap->nr = 0;
+	snap->crc = ~0U;
+}
+
+/**
+ * snapshot_flush - Write the buffered bytes to the snapshot file
+ *
+ * @snap: Snapshot
+ *
+ * Return: 0 on success, -EIO on failure
+ */
+static int snapshot_flush(struct csl_snapshot* snap) {
+	ssize_t ret;
+
+	if (!snap->len)
+		return 0;
+
+	ret = kernel_write(snap->file, snap->buf, snap->len, &snap->pos);
+	if (ret != snap->len)
+		return -EIO;
+
+	snap->len = 0;
 
 	return 0;
 }
 
 /**
- * load_list - Load a list from a file
+ * snapshot_write - Append bytes to the current section
+ *
+ * @snap: Snapshot
+ * @data: Bytes to append
+ * @len: Number of bytes
  *
- * @file: File pointer that contains the list
- * @list: List to load
+ * The bytes are copied to the buffer and checksummed there, since a
+ * checkpoint saves the map while it is still updated.
+ *
+ * Return: 0 on success, -EIO on failure
  */
-int load_list(struct file* file, struct list_head* list) {
-	size_t ret = 0;
-
-	while (1) {
-		int tmp;
-		ret = kernel_read(file, &tmp, sizeof(tmp), &file->f_pos);
-		if (ret <= 0) {
-			break;
-		}
-		struct sector_list_entry* entry =
-		    (struct sector_list_entry*)kmalloc(
-			sizeof(struct sector_list_entry), GFP_KERNEL);
-		LIST_ENTRY_INIT(entry, tmp);
-		list_add_tail(&entry->list, list);
+static int snapshot_write(struct csl_snapshot* snap, const void* data,
+			  size_t len) {
+	snap->nr += len;
+
+	while (len) {
+		size_t n = min_t(size_t, len, CSL_SNAPSHOT_IO_SIZE - snap->len);
+
+		memcpy(snap->buf + snap->len, data, n);
+		snap->crc = crc32_le(snap->crc, snap->buf + snap->len, n);
+		snap->len += n;
+		if (snap->len == CSL_SNAPSHOT_IO_SIZE && snapshot_flush(snap))
+			return -EIO;
+
+		data += n;
+		len -= n;
 	}
 
 	return 0;
 }
 
 /**
- * save_list - Save a list to a file
+ * snapshot_read - Read bytes of the current section
  *
- * @file: File pointer to save the list
- * @list: List to save
+ * @snap: Snapshot
+ * @data: Buffer to read into
+ * @len: Number of bytes
+ *
+ * Return: 0 on success, -EINVAL if the file ends early, or the error of the
+ * read
  */
-int save_list(struct file* file, struct list_head* list) {
-	struct list_head *pos, *q;
-
-	list_for_each_safe(pos, q, list) {
-		struct sector_list_entry* item =
-		    list_entry(pos, struct sector_list_entry, list);
-		kernel_write(file, &item->idx, sizeof(int), &file->f_pos);
-		list_del(pos);
-		kfree(item);
+static int snapshot_read(struct csl_snapshot* snap, void* data, size_t len) {
+	while (len) {
+		ssize_t n;
+
+		if (snap->off == snap->len && len >= CSL_SNAPSHOT_IO_SIZE) {
+			n = kernel_read(snap->file, data, CSL_SNAPSHOT_IO_SIZE,
+					&snap->pos);
+			if (n <= 0)
+				return n ? n : -EINVAL;
+		} else {
+			if (snap->off == snap->len) {
+				n = kernel_read(snap->file, snap->buf,
+						CSL_SNAPSHOT_IO_SIZE,
+						&snap->pos);
+				if (n <= 0)
+					return n ? n : -EINVAL;
+				snap->len = n;
+				snap->off = 0;
+			}
+
+			n = min_t(size_t, len, snap->len - snap->off);
+			memcpy(data, snap->buf + snap->off, n);
+			snap->off += n;
+		}
+
+		snap->crc = crc32_le(snap->crc, data, n);
+		snap->nr += n;
+		data += n;
+		len -= n;
 	}
 
 	return 0;
 }
 
+/* Function to check a section that was read against its descriptor */
+static int snapshot_check(struct csl_snapshot* snap,
+			  const struct csl_section* sect) {
+	return snap->nr == sect->len && snap->crc == sect->crc ? 0 : -EINVAL;
+}
+
+/* Function to checksum a snapshot header */
+static u32 snapshot_header_crc(struct csl_snapshot_header* hdr) {
+	u32 crc = hdr->crc;
+	u32 ret;
+
+	hdr->crc = 0;
+	ret = crc32_le(~0U, hdr, sizeof(*hdr));
+	hdr->crc = crc;
+
+	return ret;
+}
+
 /**
- * load_xa - Load an xarray from a file
+ * load_header - Load and check the header of a snapshot
+ *
+ * @file: Snapshot file
+ * @hdr: Header to load
+ *
+ * The geometry is checked as well, since the chunks can not be found
+ * without a valid one, and the segment count may not exceed what
+ * initialize_geometry() gives with the largest overprovisioning.
  *
- * @file: File pointer that contains the xarray
- * @xa: xarray to load
+ * Return: 0 on success, -ENODATA if the file is empty, -EINVAL if the header
+ * is corrupted
  */
-int load_xa(struct file* file, struct xarray* xa) {
-	size_t ret = 0;
-
-	while (1) {
-		int l_idx = 0;
-		int p_idx = 0;
-		ret = kernel_read(file, &l_idx, sizeof(int), &file->f_pos);
-		ret = kernel_read(file, &p_idx, sizeof(int), &file->f_pos);
-		if (ret <= 0) {
-			break;
+static int load_header(struct file* file, struct csl_snapshot_header* hdr) {
+	loff_t pos = 0;
+	u64 logical;
+	ssize_t ret;
+
+	ret = kernel_read(file, hdr, sizeof(*hdr), &pos);
+	if (ret == 0)
+		return -ENODATA;
+	if (ret != sizeof(*hdr))
+		return -EINVAL;
+
+	if (hdr->magic != CSL_SNAPSHOT_MAGIC
+	    || hdr->version != CSL_SNAPSHOT_VERSION
+	    || hdr->crc != snapshot_header_crc(hdr))
+		return -EINVAL;
+
+	if (!hdr->nr_domains || hdr->nr_domains > CSL_MAX_DOMAINS
+	    || !is_power_of_2(hdr->nr_domains)
+	    || hdr->unit_shift > CSL_MAX_UNIT_SHIFT || !hdr->nr_sectors
+	    || hdr->nr_sectors > MB_TO_SECTORS(CSL_MAX_CAPACITY_MB)
+	    || hdr->nr_sectors
+		   % ((sector_t)hdr->nr_domains << CSL_STRIPE_SHIFT))
+		return -EINVAL;
+
+	logical = (hdr->nr_sectors / hdr->nr_domains) >> CSL_STRIPE_SHIFT;
+	if (hdr->nr_segs <= logical
+	    || hdr->nr_segs > logical + OP_SEGS(logical, CSL_MAX_OP_PERCENT))
+		return -EINVAL;
+
+	return 0;
+}
+
+/**
+ * load_sections - Load the map, segment and domain sections of a snapshot
+ *
+ * @dev: Device pointer
+ * @snap: Snapshot positioned after the header
+ * @hdr: Header of the snapshot
+ *
+ * A checkpoint is taken while the map is updated, so the sections are only
+ * consistent once the journal is replayed onto them. The segments are then
+ * rebuilt from the map, and only their ages are taken from the snapshot.
+ *
+ * Return: 0 on success, negative error code if a section is corrupted
+ */
+static int load_sections(struct csl_device* dev, struct csl_snapshot* snap,
+			 struct csl_snapshot_header* hdr) {
+	struct csl_section* sect = hdr->sections;
+	int ret;
+
+	if (sect[CSL_SECTION_MAP].len != NR_UNITS(dev) * sizeof(u32)
+	    || sect[CSL_SECTION_SEGS].len
+		   != NR_CHUNKS(dev) * sizeof(struct csl_seg_record)
+	    || sect[CSL_SECTION_DOMAINS].len
+		   != dev->nr_domains * sizeof(struct csl_domain_record))
+		return -EINVAL;
+
+	snapshot_begin(snap);
+	ret = snapshot_read(snap, dev->map, NR_UNITS(dev) * sizeof(u32));
+	if (!ret)
+		ret = snapshot_check(snap, &sect[CSL_SECTION_MAP]);
+	if (ret)
+		return ret;
+
+	snapshot_begin(snap);
+	for (unsigned int i = 0; i < dev->nr_domains; i++) {
+		struct csl_domain* dom = &dev->domains[i];
+
+		for (unsigned int j = 0; j < dev->nr_segs; j++) {
+			struct csl_seg_record rec;
+
+			ret = snapshot_read(snap, &rec, sizeof(rec));
+			if (ret)
+				return ret;
+			dom->segs[j].seq = rec.seq;
 		}
-		struct sector_mapping_entry* entry =
-		    (struct sector_mapping_entry*)kmalloc(
-			sizeof(struct sector_mapping_entry), GFP_KERNEL);
-		MAPPING_ENTRY_INIT(entry, l_idx, p_idx);
-		xa_store(xa, l_idx, entry, GFP_KERNEL);
+	}
+	ret = snapshot_check(snap, &sect[CSL_SECTION_SEGS]);
+	if (ret)
+		return ret;
+
+	snapshot_begin(snap);
+	for (unsigned int i = 0; i < dev->nr_domains; i++) {
+		struct csl_domain* dom = &dev->domains[i];
+		struct csl_domain_record rec;
+
+		ret = snapshot_read(snap, &rec, sizeof(rec));
+		if (ret)
+			return ret;
+		dom->seq = rec.seq;
+		dom->nr_host_writes = rec.nr_host_writes;
+		dom->nr_gc_writes = rec.nr_gc_writes;
+		dom->jnl.lsn = rec.lsn;
 	}
 
-	return 0;
+	return snapshot_check(snap, &sect[CSL_SECTION_DOMAINS]);
 }
 
 /**
- * save_xa - Save an xarray to a file
+ * save_sections - Save the map, segment and domain sections of a snapshot
+ *
+ * @dev: Device pointer
+ * @snap: Snapshot positioned after the header
+ * @hdr: Header to fill in the section descriptors of
  *
- * @file: File pointer to save the xarray
- * @xa: xarray to save
+ * Return: 0 on success, -EIO on failure
  */
-int save_xa(struct file* file, struct xarray* xa) {
-	unsigned long idx;
-	struct sector_mapping_entry* data;
-
-	xa_for_each(xa, idx, data) {
-		kernel_write(file, &(data->l_idx), sizeof(int), &file->f_pos);
-		kernel_write(file, &(data->p_idx), sizeof(int), &file->f_pos);
-		kfree(data);
+static int save_sections(struct csl_device* dev, struct csl_snapshot* snap,
+			 struct csl_snapshot_header* hdr) {
+	struct csl_section* sect = hdr->sections;
+	int ret;
+
+	snapshot_begin(snap);
+	ret = snapshot_write(snap, dev->map, NR_UNITS(dev) * sizeof(u32));
+	if (ret)
+		return ret;
+	sect[CSL_SECTION_MAP].len = snap->nr;
+	sect[CSL_SECTION_MAP].crc = snap->crc;
+
+	snapshot_begin(snap);
+	for (unsigned int i = 0; i < dev->nr_domains; i++) {
+		struct csl_domain* dom = &dev->domains[i];
+
+		for (unsigned int j = 0; j < dev->nr_segs; j++) {
+			struct csl_seg_record rec = {
+			    .seq = dom->segs[j].seq,
+			    .nr_valid = dom->segs[j].nr_valid,
+			    .state = dom->segs[j].state,
+			};
+
+			ret = snapshot_write(snap, &rec, sizeof(rec));
+			if (ret)
+				return ret;
+		}
+	}
+	sect[CSL_SECTION_SEGS].len = snap->nr;
+	sect[CSL_SECTION_SEGS].crc = snap->crc;
+
+	snapshot_begin(snap);
+	for (unsigned int i = 0; i < dev->nr_domains; i++) {
+		struct csl_domain* dom = &dev->domains[i];
+		struct csl_domain_record rec = {
+		    .seq = dom->seq,
+		    .nr_host_writes = dom->nr_host_writes,
+		    .nr_gc_writes = dom->nr_gc_writes,
+		    .lsn = dom->jnl.ckpt_lsn,
+		};
+
+		ret = snapshot_write(snap, &rec, sizeof(rec));
+		if (ret)
+			return ret;
 	}
+	sect[CSL_SECTION_DOMAINS].len = snap->nr;
+	sect[CSL_SECTION_DOMAINS].crc = snap->crc;
 
-	xa_destroy(xa);
+	return snapshot_flush(snap);
+}
+
+/* Empty both snapshot slots, so none points to chunks that are freed */
+static int empty_snapshots(struct csl_device* dev) {
+	for (unsigned int slot = 0; slot < 2; slot++) {
+		struct file* file = file_create(dev->meta_path[slot]);
+
+		if (IS_ERR(file)) {
+			pr_err("%sFailed to create metadata file. "
+			       "Errorcode: %ld\n",
+			       PROMPT, PTR_ERR(file));
+			return PTR_ERR(file);
+		}
+
+		file_close(file);
+	}
 
 	return 0;
 }
@@ -155,28 +571,19 @@ int save_xa(struct file* file, struct xarray* xa) {
  *
  * @dev: Device pointer
  *
- * Create a metadata file to store the memory buffer and allocate the memory
- * buffer
+ * Empty the snapshot files that store the chunk table and allocate the chunks
  *
- * Return: 0 on success, -ENOMEM on failure
+ * Return: 0 on success, negative error code on failure
  */
 int initialize_memory(struct csl_device* dev) {
-	struct file* file = file_create(PATH);
+	/* the snapshots point to the old chunks, so they must go first */
+	int ret = empty_snapshots(dev);
 
-	if (IS_ERR(file)) {
-		pr_err("%sFailed to create metadata file. Errorcode: %ld\n",
-		       PROMPT, PTR_ERR(file));
-		return PTR_ERR(file);
-	}
+	if (ret)
+		return ret;
 
-	file_close(file);
-
-	dev->data = vmalloc(dev->size);
-
-	if (!dev->data) {
-		pr_err("%sFailed to allocate data buffer\n", PROMPT);
+	if (allocate_chunks(dev))
 		return -ENOMEM;
-	}
 
 	DEBUG_MESSAGE("%sMemory initialized\n", PROMPT);
 
@@ -188,115 +595,211 @@ int initialize_memory(struct csl_device* dev) {
  *
  * @dev: Device pointer
  *
- * Create metadata files to store the freelist, dirtylist, and mapping table
- * If data buffer is not allocated, initialize the memory buffer
+ * Allocate the domains and an empty mapping table
+ * If the chunks are not allocated, initialize the memory buffer
  *
  * Return: 0 on success, -1 on failure
  */
 int initialize_metadata(struct csl_device* dev) {
-	if (!dev->data)
-		initialize_memory(dev);
-
-	struct file* freefile = file_create(FREELIST_PATH);
-	struct file* dirtyfile = file_create(DIRTYLIST_PATH);
-	struct file* mapfile = file_create(MAP_PATH);
-
-	if (!freefile || !dirtyfile || !mapfile) {
-		pr_err("%sFailed to create metadata files\n", PROMPT);
+	if (!dev->chunks && initialize_memory(dev))
 		return -1;
-	}
-
-	file_close(freefile);
-	file_close(dirtyfile);
-	file_close(mapfile);
 
-	for (int i = 0; i < TOTAL_SECTORS; i++) {
-		struct sector_list_entry* item =
-		    (struct sector_list_entry*)kmalloc(
-			sizeof(struct sector_list_entry), GFP_KERNEL);
-		item->idx = i;
-		list_add_tail(&item->list, &dev->freelist);
-	}
+	if (initialize_domains(dev) || initialize_map(dev))
+		return -1;
 
 	DEBUG_MESSAGE("%sMetadata initialized\n", PROMPT);
 
 	return 0;
 }
 
+/**
+ * load_latest_header - Find the latest valid snapshot
+ *
+ * @dev: Device pointer
+ * @hdr: Header of the latest snapshot
+ *
+ * Return: opened snapshot file, or an error pointer if there is none
+ */
+static struct file* load_latest_header(struct csl_device* dev,
+				       struct csl_snapshot_header* hdr) {
+	struct file* latest = ERR_PTR(-ENOENT);
+	int ret;
+
+	for (unsigned int slot = 0; slot < 2; slot++) {
+		struct csl_snapshot_header tmp;
+		struct file* file = file_open_read(dev->meta_path[slot]);
+
+		if (IS_ERR(file))
+			continue;
+
+		ret = load_header(file, &tmp);
+		if (ret == -EINVAL)
+			pr_err("%sSnapshot %s corrupted\n", PROMPT,
+			       dev->meta_path[slot]);
+		if (ret || (!IS_ERR(latest) && tmp.gen <= hdr->gen)) {
+			file_close(file);
+			continue;
+		}
+
+		if (!IS_ERR(latest))
+			file_close(latest);
+		latest = file;
+		*hdr = tmp;
+		dev->snap_slot = slot;
+		dev->snap_gen = tmp.gen;
+	}
+
+	return latest;
+}
+
 /**
  * load_metadata - Load metadata
  *
  * @dev: Device pointer
  * @reset_device: Flag to reset the device
  *
- * Load the metadata from the metadata files
- * If the metadata files do not exist, initialize the metadata
+ * Load the latest valid snapshot and replay the journal onto it
+ * If there is no valid snapshot, initialize the memory, and if only a
+ * section is corrupted, keep the chunks and initialize the metadata.
+ * With a backing file, the chunks are allocated again and read back from it.
+ * The saved metadata keeps the capacity, domain count, mapping unit and
+ * segment count it was created with, since the physical blocks of a domain
+ * can not be handed over to another domain and the map can not be converted
+ * to another unit. The segments are rebuilt from the map.
+ *
+ * Only a corrupted snapshot or log reinitializes the metadata. When the
+ * load fails otherwise, for lack of memory or on a read error, the snapshots
+ * and the chunks they point to are kept for a later load, and everything
+ * else allocated is freed. When reinitializing fails, the chunks are freed
+ * and the snapshots that point to them are emptied.
  *
  * Return: 0 on success, -1 on failure
  */
 int load_metadata(struct csl_device* dev, int reset_device) {
-	struct file* file = file_open_read(PATH);
+	struct csl_snapshot_header hdr;
+	struct csl_snapshot snap = {};
+	ktime_t start = ktime_get();
+	int ret;
+
+	struct file* file = load_latest_header(dev, &hdr);
 	if (IS_ERR(file)) {
-		if (PTR_ERR(file) == -ENOENT) {
-			pr_info("%sMemory file not exist\n", PROMPT);
-			goto initialize_memory;
-		} else {
-			pr_err("%sMemory file crushed. Initialize Memory.\n",
-			       PROMPT);
-			goto initialize_memory;
-		}
+		pr_info("%sNo valid snapshot. Initialize Memory.\n", PROMPT);
+		goto initialize_memory;
 	}
 
-	load_ptr(file, (void**)&dev->data);
-	file_close(file);
-
 	if (reset_device) {
 		pr_info("%sReset device\n", PROMPT);
-		vfree(dev->data);
+		free_chunks(UINT64_TO_PTR(hdr.chunks),
+			    (size_t)hdr.nr_segs * hdr.nr_domains);
+		file_close(file);
 		goto initialize_memory;
 	}
 
-	struct file* freefile = NULL;
-	struct file* dirtyfile = NULL;
-	struct file* mapfile = NULL;
+	/* the chunk table is only saved without a backing file */
+	if (!hdr.chunks != !!dev->backing) {
+		pr_err("%sSnapshot does not match the backing file. "
+		       "Initialize Memory.\n",
+		       PROMPT);
+		free_chunks(UINT64_TO_PTR(hdr.chunks),
+			    (size_t)hdr.nr_segs * hdr.nr_domains);
+		file_close(file);
+		goto initialize_memory;
+	}
 
-	freefile = file_open_read(FREELIST_PATH);
-	dirtyfile = file_open_read(DIRTYLIST_PATH);
-	mapfile = file_open_read(MAP_PATH);
+	if (hdr.nr_sectors != dev->nr_sectors) {
+		pr_info("%sKeep %llu MiB capacity of the saved metadata\n",
+			PROMPT, hdr.nr_sectors >> (20 - CSL_SECTOR_SHIFT));
+		dev->nr_sectors = hdr.nr_sectors;
+	}
 
-	if (IS_ERR(freefile) || IS_ERR(dirtyfile) || IS_ERR(mapfile)) {
-		if ((PTR_ERR(freefile) == -ENOENT)
-		    && (PTR_ERR(dirtyfile) == -ENOENT)
-		    && (PTR_ERR(mapfile) == -ENOENT)) {
-			pr_info("%sMetadata file not exist\n", PROMPT);
-			goto initialize_metadata;
-		} else {
-			pr_err(
-			    "%sMetadata file crushed. Initialize Metadata.\n",
-			    PROMPT);
-			goto initialize_metadata;
-		}
+	if (hdr.nr_domains != dev->nr_domains) {
+		pr_info("%sKeep %u domains of the saved metadata\n", PROMPT,
+			hdr.nr_domains);
+		dev->nr_domains = hdr.nr_domains;
+	}
+
+	if (hdr.unit_shift != dev->unit_shift) {
+		pr_info("%sKeep %u sectors mapping unit of the saved metadata\n",
+			PROMPT, 1U << hdr.unit_shift);
+		dev->unit_shift = hdr.unit_shift;
+	}
+
+	if (hdr.nr_segs != dev->nr_segs) {
+		pr_info("%sKeep %u segments per domain of the saved metadata\n",
+			PROMPT, hdr.nr_segs);
+		dev->nr_segs = hdr.nr_segs;
 	}
 
-	load_list(freefile, &dev->freelist);
-	load_list(dirtyfile, &dev->dirtylist);
-	load_xa(mapfile, &dev->map);
+	if (!dev->backing) {
+		dev->chunks = UINT64_TO_PTR(hdr.chunks);
+	} else if (allocate_chunks(dev) || backing_load(dev)) {
+		pr_err("%sFailed to load the backing file\n", PROMPT);
+		file_close(file);
+		goto fail;
+	}
 
-	file_close(freefile);
-	file_close(dirtyfile);
-	file_close(mapfile);
+	snap.file = file;
+	snap.pos = sizeof(hdr);
+	snap.buf = kvmalloc(CSL_SNAPSHOT_IO_SIZE, GFP_KERNEL);
+	if (!snap.buf || initialize_domains(dev) || initialize_map(dev)) {
+		kvfree(snap.buf);
+		file_close(file);
+		goto fail;
+	}
 
-	DEBUG_MESSAGE("%sMetadata loaded\n", PROMPT);
-	if(IS_ENABLED(DEBUG))
-		print_metadata(dev);
+	ret = load_sections(dev, &snap, &hdr);
+
+	kvfree(snap.buf);
+	file_close(file);
+
+	if (!ret)
+		ret = journal_replay(dev);
+	if (!ret)
+		ret = rebuild_segments(dev);
+
+	/* only a corrupted snapshot or log is given up, an allocation or a
+	 * read that failed is not a reason to lose the data */
+	if (ret == -EINVAL || ret == -EBADMSG) {
+		pr_err("%sSnapshot section corrupted. Initialize Metadata.\n",
+		       PROMPT);
+		free_metadata(dev);
+		goto initialize_metadata;
+	}
+	if (ret) {
+		pr_err("%sFailed to load the snapshot. Errorcode: %d\n", PROMPT,
+		       ret);
+		goto fail;
+	}
+
+	pr_info("%sSnapshot loaded in %lld us, %llu journal records "
+		"replayed\n",
+		PROMPT, ktime_us_delta(ktime_get(), start),
+		dev->jnl_replayed);
 
 	return 0;
 
 initialize_memory:
-	initialize_memory(dev);
+	/* initialize_metadata() allocates the chunks when there are none */
+	dev->chunks = NULL;
 
 initialize_metadata:
-	return initialize_metadata(dev);
+	if (!initialize_metadata(dev))
+		return 0;
+
+	free_metadata(dev);
+	free_chunks(dev->chunks, NR_CHUNKS(dev));
+	dev->chunks = NULL;
+	if (!dev->backing)
+		empty_snapshots(dev);
+	return -1;
+
+fail:
+	/* the snapshot and the chunks it points to are left to a later load */
+	free_metadata(dev);
+	if (dev->backing)
+		free_chunks(dev->chunks, NR_CHUNKS(dev));
+	dev->chunks = NULL;
+	return -1;
 }
 
 /**
@@ -304,23 +807,79 @@ initialize_metadata:
  *
  * @dev: Device pointer
  *
- * Save the metadata to the metadata files
+ * Save the geometry and the sections to the older snapshot slot
+ * The header is written last and synced, so a snapshot that is cut short has
+ * no valid header and the previous one is loaded instead. Every domain
+ * records the first journal record that the snapshot may miss.
+ *
+ * The map is copied while writes go on, so with a backing file the chunks
+ * are written back once more before the header. Every block the copy points
+ * to was marked dirty before it was mapped, so it is in the backing file
+ * before the snapshot is valid.
+ *
+ * Return: 0 on success, negative error code on failure
  */
-void save_metadata(struct csl_device* dev) {
-	struct file* file = file_open(PATH);
-	struct file* freefile = file_open(FREELIST_PATH);
-	struct file* dirtyfile = file_open(DIRTYLIST_PATH);
-	struct file* mapfile = file_open(MAP_PATH);
+int save_metadata(struct csl_device* dev) {
+	unsigned int slot = dev->snap_slot ^ 1;
+	struct csl_snapshot_header hdr = {
+	    .magic = CSL_SNAPSHOT_MAGIC,
+	    .version = CSL_SNAPSHOT_VERSION,
+	    .nr_domains = dev->nr_domains,
+	    .unit_shift = dev->unit_shift,
+	    .nr_segs = dev->nr_segs,
+	    .gen = dev->snap_gen + 1,
+	    .nr_sectors = dev->nr_sectors,
+	    .chunks = dev->backing ? 0 : PTR_TO_UINT64(dev->chunks),
+	};
+	struct csl_snapshot snap = {};
+	ktime_t start = ktime_get();
+	loff_t pos = 0;
+	int ret;
+
+	struct file* file = file_create(dev->meta_path[slot]);
+	if (IS_ERR(file)) {
+		pr_err("%sFailed to create snapshot. Errorcode: %ld\n", PROMPT,
+		       PTR_ERR(file));
+		return PTR_ERR(file);
+	}
+
+	snap.file = file;
+	snap.pos = sizeof(hdr);
+	snap.buf = kvmalloc(CSL_SNAPSHOT_IO_SIZE, GFP_KERNEL);
+	ret = snap.buf ? save_sections(dev, &snap, &hdr) : -ENOMEM;
+	kvfree(snap.buf);
+
+	if (!ret)
+		ret = vfs_fsync(file, 0);
 
-	save_ptr(file, (void*)dev->data);
-	save_list(freefile, &dev->freelist);
-	save_list(dirtyfile, &dev->dirtylist);
-	save_xa(mapfile, &dev->map);
+	if (!ret && dev->backing) {
+		/* the dirty bits are read after the mappings they cover */
+		smp_mb();
+		ret = backing_writeback(dev);
+	}
+
+	if (!ret) {
+		hdr.crc = snapshot_header_crc(&hdr);
+		if (kernel_write(file, &hdr, sizeof(hdr), &pos) != sizeof(hdr))
+			ret = -EIO;
+	}
+
+	if (!ret)
+		ret = vfs_fsync(file, 0);
 
 	file_close(file);
-	file_close(freefile);
-	file_close(dirtyfile);
-	file_close(mapfile);
 
-	DEBUG_MESSAGE("%sMetadata saved\n", PROMPT);
-}
\ No newline at end of file
+	if (ret) {
+		pr_err("%sFailed to save snapshot. Errorcode: %d\n", PROMPT,
+		       ret);
+		return ret;
+	}
+
+	dev->snap_slot = slot;
+	dev->snap_gen = hdr.gen;
+
+	DEBUG_MESSAGE("%sSnapshot %llu saved in %lld us\n", PROMPT, hdr.gen,
+		      ktime_us_delta(ktime_get(), start));
+
+	return 0;
+}
@@ -1,20 +1,31 @@
-#include <linux/list.h>
+#include <linux/crc32.h>
 #include <linux/fs.h>
+#include <linux/gfp.h>
+#include <linux/ktime.h>
+#include <linux/log2.h>
+#include <linux/nodemask.h>
+#include <linux/sched.h>
+#include <linux/slab.h>
 #include <linux/types.h>
-#include <linux/xarray.h>
 #include "type.h"
 #include "file.h"
 
 #ifndef __CSL_METADATA_OPS
 #define __CSL_METADATA_OPS
 
-/* Define the total number of sectors and device name */
+/* Define the device name, every device adds its index to the paths */
 #define DEVICE_NAME "csl"
 #define PROMPT "csl_dev: "
-#define PATH "/tmp/csl_dev_meta"
-#define MAP_PATH "/tmp/csl_dev_map"
-#define FREELIST_PATH "/tmp/csl_dev_freelist"
-#define DIRTYLIST_PATH "/tmp/csl_dev_dirtylist"
+#define PATH "/tmp/csl_dev_meta%u.%u"
+#define JOURNAL_PATH "/tmp/csl_dev_journal%u"
+
+/* Devices share one major number and use their index as minor */
+#define CSL_MAX_DEVICES 16
+
+/* Debugfs files are streamed by chunks of units, segments and bytes */
+#define CSL_DEBUGFS_UNITS 1024
+#define CSL_DEBUGFS_SEGS 64
+#define CSL_DEBUGFS_BIN_SIZE (1U << 20)
 
 #define DEBUG_MESSAGE(fmt, ...) \
 	if (IS_ENABLED(DEBUG))  \
@@ -25,29 +36,150 @@
 
 #define CSL_SECTOR_SHIFT 9
 #define CSL_SECTOR_SIZE (1 << CSL_SECTOR_SHIFT)
-#define TOTAL_SECTORS 32768
+#define CSL_MAX_RQ_SECTORS 1024
+
+/* Capacity is limited so that every physical block index fits in a u32 */
+#define CSL_DEFAULT_CAPACITY_MB 16
+#define CSL_MAX_CAPACITY_MB (512 << 10)
+#define MB_TO_SECTORS(mb) ((sector_t)(mb) << (20 - CSL_SECTOR_SHIFT))
+#define TOTAL_SECTORS(dev) ((dev)->nr_sectors)
+
+/* The logical space is striped over the domains in CSL_STRIPE_SECTORS units */
+#define CSL_STRIPE_SHIFT 7
+#define CSL_STRIPE_SECTORS (1 << CSL_STRIPE_SHIFT)
+#define CSL_MAX_DOMAINS 256
+
+#define DOMAIN_SECTORS(dev) (TOTAL_SECTORS(dev) / (dev)->nr_domains)
+#define LBA_TO_DOMAIN(dev, lba) \
+    (&(dev)->domains[((lba) >> CSL_STRIPE_SHIFT) & ((dev)->nr_domains - 1)])
+
+/* Sectors are mapped in units of 1 << unit_shift sectors, up to a stripe */
+#define CSL_MAX_UNIT_SHIFT CSL_STRIPE_SHIFT
+#define UNIT_SECTORS(dev) (1U << (dev)->unit_shift)
+#define UNIT_SIZE(dev) (CSL_SECTOR_SIZE << (dev)->unit_shift)
+#define NR_UNITS(dev) ((size_t)(TOTAL_SECTORS(dev) >> (dev)->unit_shift))
+#define DOMAIN_UNITS(dev) (DOMAIN_SECTORS(dev) >> (dev)->unit_shift)
+
+/* The physical space of a domain is split into segments of a stripe */
+#define SEG_SHIFT(dev) (CSL_STRIPE_SHIFT - (dev)->unit_shift)
+#define SEG_UNITS(dev) (1U << SEG_SHIFT(dev))
+#define DOMAIN_LOGICAL_SEGS(dev) (DOMAIN_SECTORS(dev) >> CSL_STRIPE_SHIFT)
+#define DOMAIN_BLOCKS(dev) ((dev)->nr_segs << SEG_SHIFT(dev))
+#define NR_BLOCKS(dev) ((size_t)DOMAIN_BLOCKS(dev) * (dev)->nr_domains)
+
+/* The data is stored in chunks of pages, one chunk per segment */
+#define CSL_CHUNK_SHIFT (CSL_STRIPE_SHIFT + CSL_SECTOR_SHIFT)
+#define CSL_CHUNK_SIZE (1UL << CSL_CHUNK_SHIFT)
+#define CSL_CHUNK_ORDER get_order(CSL_CHUNK_SIZE)
+#define NR_CHUNKS(dev) ((size_t)(dev)->nr_segs * (dev)->nr_domains)
+
+/* Every domain has at least CSL_MIN_OP_SEGS segments more than its logical
+ * space. Writes leave CSL_GC_RESERVED_SEGS free segments to the garbage
+ * collector, which migrates CSL_GC_BATCH_SEGS victims of a domain at most
+ * before it moves on to the next domain, copying CSL_GC_COPY_BLOCKS blocks
+ * at a time without the domain lock. */
+#define CSL_MIN_OP_SEGS 3
+#define CSL_GC_RESERVED_SEGS 1
+#define CSL_GC_BATCH_SEGS 4
+#define CSL_GC_COPY_BLOCKS 32
+
+/* Overprovisioning is capped, so a saved segment count can be checked */
+#define CSL_MAX_OP_PERCENT 100
+#define OP_SEGS(logical, percent) \
+    max_t(u64, CSL_MIN_OP_SEGS, (u64)(logical) * (percent) / 100)
+
+#define IDX_PTR(dev, x)                                            \
+    ((void *)((u8 *)(dev)->chunks[(x) >> SEG_SHIFT(dev)]           \
+	      + (((x) & (SEG_UNITS(dev) - 1))                        \
+		 << ((dev)->unit_shift + CSL_SECTOR_SHIFT))))
+
+/* Map value of a logical sector that has never been written */
+#define CSL_UNMAPPED U32_MAX
+
+/* The metadata is saved as a snapshot file, its header is written last.
+ * Snapshots alternate between two slots, so the latest complete one survives
+ * a snapshot that is cut short. */
+#define CSL_SNAPSHOT_MAGIC 0x534c5343 /* "CSLS" */
+#define CSL_SNAPSHOT_VERSION 2
+#define CSL_SNAPSHOT_IO_SIZE (1U << 20)
+
+/* Sections of a snapshot, stored in this order after the header */
+#define CSL_SECTION_MAP 0
+#define CSL_SECTION_SEGS 1
+#define CSL_SECTION_DOMAINS 2
+#define CSL_NR_SECTIONS 3
+
+/**
+ * struct csl_section - Snapshot section descriptor
+ * @len: 				Length of the section in bytes
+ * @crc: 				CRC32 of the section
+ */
+struct csl_section {
+	u64 len;	/* Section length */
+	u32 crc;	/* Section checksum */
+	u32 reserved;	/* Padding */
+};
 
-#define IDX_PTR(dev, x) (void *)(dev->data + (x << CSL_SECTOR_SHIFT))
+/**
+ * struct csl_snapshot_header - Header at the start of a snapshot file
+ * @magic: 				CSL_SNAPSHOT_MAGIC
+ * @version: 				CSL_SNAPSHOT_VERSION
+ * @crc: 				CRC32 of the header with this field zero
+ * @nr_domains: 			Number of domains
+ * @unit_shift: 			Mapping unit size in sectors as power of two
+ * @nr_segs: 				Number of segments of every domain
+ * @gen: 				Generation, the valid snapshot with the
+ * 					highest one is loaded
+ * @nr_sectors: 			Number of logical sectors
+ * @chunks: 				Chunk table address, the chunks are kept in
+ * 					memory over a module reload, or 0 if the
+ * 					data is in a backing file
+ * @sections: 				Section descriptors
+ */
+struct csl_snapshot_header {
+	u32 magic;				   /* Magic number */
+	u32 version;				   /* Format version */
+	u32 crc;				   /* Header checksum */
+	u32 nr_domains;				   /* Number of domains */
+	u32 unit_shift;				   /* Mapping unit size */
+	u32 nr_segs;				   /* Segments per domain */
+	u64 gen;				   /* Generation */
+	u64 nr_sectors;				   /* Logical sectors */
+	u64 chunks;				   /* Chunk table */
+	struct csl_section sections[CSL_NR_SECTIONS]; /* Sections */
+};
 
-#define LIST_ENTRY_INIT(entry, __idx) \
-    entry->idx = __idx;
+/* Record of a segment in the CSL_SECTION_SEGS section */
+struct csl_seg_record {
+	u64 seq;	/* Close sequence number */
+	u32 nr_valid;	/* Number of valid blocks */
+	u32 state;	/* Segment state */
+};
 
-#define MAPPING_ENTRY_INIT(entry, __l_idx, __p_idx) \
-    entry->l_idx = __l_idx; \
-    entry->p_idx = __p_idx;
+/* Record of a domain in the CSL_SECTION_DOMAINS section */
+struct csl_domain_record {
+	u64 seq;		/* Close sequence number */
+	u64 nr_host_writes;	/* Blocks written by requests */
+	u64 nr_gc_writes;	/* Blocks written by the collector */
+	u64 lsn;		/* First journal record not in the snapshot */
+};
 
-void print_metadata(struct csl_device* dev); 
+void metadata_debugfs_init(struct csl_device* dev);
 
-int load_ptr(struct file *file, void **ptr);
-int save_ptr(struct file *file, void *ptr);
-int load_list(struct file *file, struct list_head *list);
-int save_list(struct file *file, struct list_head *list);
-int load_xa(struct file *file, struct xarray *xa);
-int save_xa(struct file *file, struct xarray *xa);
+/* ftl.c */
+void initialize_geometry(struct csl_device *dev, unsigned int capacity_mb,
+			 unsigned int nr_domains, unsigned int map_unit,
+			 unsigned int op_percent);
+int allocate_chunks(struct csl_device *dev);
+void free_chunks(void **chunks, size_t nr);
+int initialize_domains(struct csl_device *dev);
+int initialize_map(struct csl_device *dev);
+int rebuild_segments(struct csl_device *dev);
+void free_metadata(struct csl_device *dev);
 
 int initialize_memory(struct csl_device *dev);
 int initialize_metadata(struct csl_device *dev);
 int load_metadata(struct csl_device *dev, int reset_device);
-void save_metadata(struct csl_device *dev);
+int save_metadata(struct csl_device *dev);
 
 #endif
\ No newline at end of file
@@ -1,36 +1,129 @@
+"""Plot the results of fio_bench.py.
+
+For every rw pattern, compare the lock variants over the block sizes, with
+one panel per number of jobs. With a baseline, plot the change of every
+result against the baseline instead.
+
+    python3 plot.py results/after.json
+    python3 plot.py results/after.json --baseline results/before.json
+"""
+
+import argparse
+import json
+import os
+
+import matplotlib
+matplotlib.use('Agg')
 import matplotlib.pyplot as plt
-import numpy as np
 
-# Data
-categories = ['Semaphore', 'Mutex', 'RW Lock', 'RW Semaphore']
-data1 = [194, 1224, 1826, 1176]
-data2 = [190, 1160, 1739, 1143]
+METRICS = {
+    'bw': ('MiB/s', lambda s: s['bw_kib'] / 1024),
+    'iops': ('IOPS', lambda s: s['iops']),
+    'p99': ('p99 completion latency (us)',
+            lambda s: s['clat_ns']['99'] / 1000),
+}
+
+COLORS = ['lightgrey', 'white', 'dimgrey', 'whitesmoke']
+HATCHES = ['', '//', '', '..']
+
+
+def load(path):
+    with open(path) as f:
+        return json.load(f)['results']
+
+
+def key(result):
+    return (result['variant'], result['rw'], result['bs'], result['numjobs'],
+            result['iodepth'])
+
+
+def value(result, metric):
+    """Metric of a result, summed over reads and writes, or the worse
+    latency of the two"""
+    values = [METRICS[metric][1](result[d]) for d in ['read', 'write']
+              if result[d]]
+    if not values:
+        return 0
+    return max(values) if metric == 'p99' else sum(values)
+
+
+def ordered(values):
+    return list(dict.fromkeys(values))
+
+
+def plot_pattern(results, rw, iodepth, metric, baseline, path):
+    results = [r for r in results
+               if r['rw'] == rw and r['iodepth'] == iodepth]
+    variants = ordered(r['variant'] for r in results)
+    sizes = ordered(r['bs'] for r in results)
+    jobs = ordered(r['numjobs'] for r in results)
+    by_key = {key(r): r for r in results}
+
+    fig, axes = plt.subplots(1, len(jobs), figsize=(5 * len(jobs), 4),
+                             squeeze=False)
+    x = range(len(sizes))
+    width = 0.8 / len(variants)
+
+    for ax, numjobs in zip(axes[0], jobs):
+        for i, variant in enumerate(variants):
+            data = []
+            for bs in sizes:
+                k = (variant, rw, bs, numjobs, iodepth)
+                new = value(by_key[k], metric) if k in by_key else 0
+                if baseline is None:
+                    data.append(new)
+                    continue
+                old = value(baseline[k], metric) if k in baseline else 0
+                data.append((new - old) * 100.0 / old if old else 0)
+
+            offset = (i - (len(variants) - 1) / 2) * width
+            ax.bar([p + offset for p in x], data, width,
+                   label=variant, color=COLORS[i % len(COLORS)],
+                   hatch=HATCHES[i % len(HATCHES)], edgecolor='black')
+
+        ax.set_title('%s, numjobs %d, iodepth %d' % (rw, numjobs, iodepth))
+        ax.set_xlabel('bs')
+        ax.set_xticks(x)
+        ax.set_xticklabels(sizes)
+        ax.set_ylabel(('change of %s (%%)' if baseline is not None else '%s')
+                      % METRICS[metric][0])
+        if baseline is not None:
+            ax.axhline(0, color='black', linewidth=0.8)
+        ax.yaxis.grid(True, linestyle='--', which='both', color='grey',
+                      alpha=0.7)
+        ax.legend()
 
-#288, 289, 167, 166, 194, 190
-#1183, 1181, 1889, 1885, 1224, 1160
-#1423, 1385, 3038, 2856, 1826, 1739
-#1385, 1292, 2901, 2821, 1176, 1143
+    fig.tight_layout()
+    fig.savefig(path)
+    plt.close(fig)
+    print('Plot written to', path)
 
-x = np.arange(len(categories))  # label locations
-width = 0.25  # bar width
 
-fig, ax = plt.subplots()
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument('results')
+    parser.add_argument('--baseline', help='results to compare against')
+    parser.add_argument('--metric', choices=list(METRICS), default='bw',
+                        help='metric to plot (default: %(default)s)')
+    parser.add_argument('--iodepth', type=int,
+                        help='iodepth to plot (default: the highest)')
+    parser.add_argument('-o', '--output', default='results',
+                        help='directory of the plots (default: %(default)s)')
+    args = parser.parse_args()
 
-# Bars
-rects1 = ax.bar(x - width/2, data1, width, label='Sequential', color='lightgrey', edgecolor='black')
-rects2 = ax.bar(x + width/2, data2, width, label='Random', color='white', hatch='//', edgecolor='black')
+    results = load(args.results)
+    baseline = None
+    if args.baseline:
+        baseline = {key(r): r for r in load(args.baseline)}
+    iodepth = args.iodepth or max(r['iodepth'] for r in results)
 
-# Labels, titles, and legend
-ax.set_ylabel('MiB/s')
-ax.set_ylim(0, max(data1 + data2) * 1.1)
-ax.set_title('Synchronization Type I/O Performance Comparison')
-# ax.set_xlabel('numjobs')
-ax.set_xticks(x)
-ax.set_xticklabels(categories)
-ax.legend()
+    os.makedirs(args.output, exist_ok=True)
+    for rw in ordered(r['rw'] for r in results):
+        name = 'fio_%s_%s_d%d%s.png' % (rw, args.metric, iodepth,
+                                        '_diff' if baseline else '')
+        plot_pattern(results, rw, iodepth, args.metric, baseline,
+                     os.path.join(args.output, name))
 
-# Grid
-ax.yaxis.grid(True, linestyle='--', which='both', color='grey', alpha=0.7)
 
-# Display the plot
-plt.show()
\ No newline at end of file
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,640 @@
+#include <linux/blk-mq.h>
+#include <linux/blkdev.h>
+#include <linux/ktime.h>
+#include <linux/rcupdate.h>
+#include "csl_trace.h"
+#include "gc.h"
+#include "lock.h"
+#include "metadata.h"
+#include "rq.h"
+#include "stats.h"
+
+/*
+ * Request path of the driver: the write frontiers, and the reads, writes and
+ * unmaps of the sectors of a request. The data of a request is only reached
+ * through struct csl_rq_iter, so bench/ builds this file in userspace along
+ * with ftl.c and gc.c, with bios that hold one buffer.
+ */
+
+/* A write frontier packs its next physical block and its length in 64 bits */
+#define FRONTIER(p_idx, nr) (((s64)(p_idx) << 32) | (nr))
+#define FRONTIER_IDX(fr) ((u32)((u64)(fr) >> 32))
+#define FRONTIER_NR(fr) ((u32)(fr))
+
+/**
+ * frontier_take - Take blocks from a write frontier without any lock
+ *
+ * @fr: Write frontier of a hardware queue for one domain
+ * @nr: Number of blocks wanted
+ * @len: Number of blocks taken
+ *
+ * The frontier is only shared with the domain when it is refilled or
+ * drained, so this usually touches no cacheline of another hardware queue.
+ *
+ * Return: first physical block index, or CSL_UNMAPPED if the frontier is
+ * empty
+ */
+static u32 frontier_take(atomic64_t* fr, unsigned int nr, unsigned int* len) {
+	s64 old = atomic64_read(fr);
+	s64 new;
+
+	do {
+		if (!FRONTIER_NR(old))
+			return CSL_UNMAPPED;
+
+		*len = min(nr, FRONTIER_NR(old));
+		new = FRONTIER(FRONTIER_IDX(old) + *len,
+			       FRONTIER_NR(old) - *len);
+	} while (!atomic64_try_cmpxchg(fr, &old, new));
+
+	return FRONTIER_IDX(old);
+}
+
+/**
+ * drain_frontiers - Give the blocks of all write frontiers back to a domain
+ *
+ * @dev: Device pointer
+ * @dom: Locked domain pointer
+ */
+static void drain_frontiers(struct csl_device* dev, struct csl_domain* dom) {
+	struct blk_mq_hw_ctx* hctx;
+	unsigned long i;
+
+	queue_for_each_hw_ctx(dev->queue, hctx, i) {
+		struct csl_hctx* ch = hctx->driver_data;
+		s64 old;
+
+		if (!ch)
+			continue;
+
+		old = atomic64_xchg(&ch->frontiers[dom - dev->domains], 0);
+		if (FRONTIER_NR(old))
+			release_extent(dev, dom, FRONTIER_IDX(old),
+				       FRONTIER_NR(old));
+	}
+}
+
+/**
+ * frontier_alloc - Allocate blocks through a write frontier
+ *
+ * @dev: Device pointer
+ * @dom: Locked domain pointer
+ * @ch: Hardware queue data that keeps the write frontiers
+ * @nr: Number of blocks wanted
+ * @len: Number of blocks allocated
+ *
+ * Refill the frontier with a batch of contiguous blocks of the node of the
+ * hardware queue and take from it.
+ * Large extents are allocated from the domain directly. When the domain has
+ * no free segment left, the blocks that other hardware queues keep in their
+ * frontiers are given up, so no segment is held back from the garbage
+ * collector by an idle queue.
+ *
+ * Return: first physical block index, or CSL_UNMAPPED if there is no free
+ * block
+ */
+static u32 frontier_alloc(struct csl_device* dev, struct csl_domain* dom,
+			  struct csl_hctx* ch, unsigned int nr,
+			  unsigned int* len) {
+	atomic64_t* fr = &ch->frontiers[dom - dev->domains];
+	unsigned int cnt;
+	u32 p_idx;
+	s64 old;
+
+	p_idx = frontier_take(fr, nr, len);
+	if (p_idx != CSL_UNMAPPED)
+		return p_idx;
+
+	if (nr >= CSL_FRONTIER_BLOCKS)
+		p_idx = alloc_extent(dev, dom, ch->node, nr, len);
+	else
+		p_idx = alloc_extent(dev, dom, ch->node, CSL_FRONTIER_BLOCKS,
+				     &cnt);
+
+	if (p_idx == CSL_UNMAPPED) {
+		drain_frontiers(dev, dom);
+		return CSL_UNMAPPED;
+	}
+
+	if (nr >= CSL_FRONTIER_BLOCKS)
+		return p_idx;
+
+	*len = min(nr, cnt);
+	if (cnt > *len) {
+		/* another request may have refilled it in the meantime */
+		old = atomic64_read(fr);
+		if (FRONTIER_NR(old)
+		    || !atomic64_try_cmpxchg(
+			fr, &old, FRONTIER(p_idx + *len, cnt - *len)))
+			release_extent(dev, dom, p_idx + *len, cnt - *len);
+	}
+
+	return p_idx;
+}
+
+/**
+ * rq_iter_copy - Copy data between the data segments of a request and a buffer
+ *
+ * @it: Request iterator, advanced by @len
+ * @buf: Buffer, or NULL to zero the segments of a read request and to skip
+ * the segments of a write request
+ * @len: Length of data
+ * @dir: WRITE to copy from the request, READ to copy into the request
+ *
+ * The buffer may span several segments, so an extent is copied with one
+ * memcpy per segment.
+ */
+void rq_iter_copy(struct csl_rq_iter* it, void* buf, unsigned int len,
+		  int dir) {
+	while (len && it->bio) {
+		if (!it->iter.bi_size) {
+			it->bio = it->bio->bi_next;
+			if (it->bio)
+				it->iter = it->bio->bi_iter;
+			continue;
+		}
+
+		struct bio_vec bvec = bio_iter_iovec(it->bio, it->iter);
+		unsigned int b_len = min(len, bvec.bv_len);
+		void* b_buf = page_address(bvec.bv_page) + bvec.bv_offset;
+
+		if (!buf) {
+			if (dir == READ)
+				memset(b_buf, 0, b_len);
+		} else if (dir == WRITE) {
+			memcpy(buf, b_buf, b_len);
+		} else {
+			memcpy(b_buf, buf, b_len);
+		}
+
+		bio_advance_iter_single(it->bio, &it->iter, b_len);
+		if (buf)
+			buf += b_len;
+		len -= b_len;
+	}
+}
+
+/**
+ * read_sectors - Read sectors from device
+ *
+ * @dev: Device pointer
+ * @it: Request iterator to store data
+ * @sector: First sector index
+ * @nr: Number of sectors
+ *
+ * Read data from the device and store it in the request
+ * The map is resolved under RCU without taking any domain lock, so the whole
+ * request is read in one read-side critical section. The physical block
+ * stays intact until the reader leaves it, because writers only reuse dirty
+ * blocks after a grace period. Units that are physically contiguous are
+ * copied as one extent, and units that were never written read as zeroes.
+ *
+ * Return: number of sectors read from units that were never written
+ */
+unsigned int read_sectors(struct csl_device* dev, struct csl_rq_iter* it,
+			  sector_t sector, unsigned int nr) {
+	unsigned int unit_sectors = UNIT_SECTORS(dev);
+	unsigned int unmapped = 0;
+
+	rcu_read_lock();
+
+	while (nr) {
+		unsigned long unit = sector >> dev->unit_shift;
+		unsigned int off = sector & (unit_sectors - 1);
+		unsigned int len = min(nr, unit_sectors - off);
+		u32 p_idx = READ_ONCE(dev->map[unit]);
+
+		if (p_idx == CSL_UNMAPPED) {
+			DEBUG_MESSAGE("%sBlock not found in map\n", PROMPT);
+			trace_csl_map_lookup(dev, unit, p_idx, len);
+			rq_iter_copy(it, NULL, len << CSL_SECTOR_SHIFT, READ);
+			unmapped += len;
+		} else {
+			/* extend the extent over contiguous units of the
+			 * segment, the next segment is in another chunk */
+			for (unsigned int i = 1;
+			     len < nr && (p_idx + i) & (SEG_UNITS(dev) - 1)
+			     && READ_ONCE(dev->map[unit + i]) == p_idx + i;
+			     i++)
+				len += min(nr - len, unit_sectors);
+
+			trace_csl_map_lookup(dev, unit, p_idx, len);
+			rq_iter_copy(it,
+				     IDX_PTR(dev, p_idx)
+					 + (off << CSL_SECTOR_SHIFT),
+				     len << CSL_SECTOR_SHIFT, READ);
+		}
+
+		sector += len;
+		nr -= len;
+	}
+
+	rcu_read_unlock();
+
+	return unmapped;
+}
+
+/**
+ * write_unit - Write part of a unit to device
+ *
+ * @dev: Device pointer
+ * @dom: Locked domain that owns the unit
+ * @p_idx: New physical block of the unit
+ * @it: Request iterator that holds data, or NULL to write zeroes
+ * @sector: First sector index
+ * @nr: Number of sectors, within the unit
+ *
+ * The rest of the unit is copied from its old block, so the copy and the
+ * publication both happen under the domain lock. Otherwise a concurrent
+ * write to other sectors of the same unit could be lost.
+ */
+static void write_unit(struct csl_device* dev, struct csl_domain* dom,
+		       u32 p_idx, struct csl_rq_iter* it, sector_t sector,
+		       unsigned int nr) {
+	unsigned long unit = sector >> dev->unit_shift;
+	unsigned int off = sector & (UNIT_SECTORS(dev) - 1);
+	u32 old_idx = dev->map[unit];
+	void* ptr = IDX_PTR(dev, p_idx);
+
+	if (old_idx == CSL_UNMAPPED)
+		memset(ptr, 0, UNIT_SIZE(dev));
+	else
+		memcpy(ptr, IDX_PTR(dev, old_idx), UNIT_SIZE(dev));
+
+	if (it)
+		rq_iter_copy(it, ptr + (off << CSL_SECTOR_SHIFT),
+			     nr << CSL_SECTOR_SHIFT, WRITE);
+	else
+		memset(ptr + (off << CSL_SECTOR_SHIFT), 0,
+		       nr << CSL_SECTOR_SHIFT);
+
+	DEBUG_MESSAGE("%sBlock Index: %ld, Block Address: %p\n", PROMPT, unit,
+		      ptr);
+
+	publish_extent(dev, dom, unit, p_idx, 1);
+}
+
+/**
+ * dispatch_lock - Take the lock of a domain on the dispatch path
+ *
+ * @ch: Hardware queue data, accounted the time waited for the lock
+ * @dom: Domain pointer
+ *
+ * Return: time the lock was taken at, to account the time it is held
+ */
+static u64 dispatch_lock(struct csl_hctx* ch, struct csl_domain* dom) {
+	u64 start = ktime_get_ns(), locked;
+
+	GET_WRITE_LOCK(dom);
+	locked = ktime_get_ns();
+	stats_lock(ch, locked - start);
+
+	return locked;
+}
+
+/* Release a domain lock taken by dispatch_lock() at @locked */
+static void dispatch_unlock(struct csl_hctx* ch, struct csl_domain* dom,
+			    u64 locked) {
+	RELEASE_WRITE_LOCK(dom);
+	stats_unlock(ch, ktime_get_ns() - locked);
+}
+
+/* Take the domain lock once, and collect garbage when it is taken */
+static void lock_domain(struct csl_device* dev, struct csl_hctx* ch,
+			struct csl_domain* dom, u64* locked) {
+	if (*locked)
+		return;
+
+	*locked = dispatch_lock(ch, dom);
+	garbage_collecting(dev, dom);
+}
+
+/* Release the domain lock if lock_domain() took it */
+static void unlock_domain(struct csl_hctx* ch, struct csl_domain* dom,
+			  u64* locked) {
+	if (!*locked)
+		return;
+
+	dispatch_unlock(ch, dom, *locked);
+	*locked = 0;
+}
+
+/**
+ * reserve_sectors - Reserve physical blocks for the sectors of a request
+ *
+ * @dev: Device pointer
+ * @ch: Hardware queue data that keeps the write frontiers
+ * @cmd: Request data that keeps the reserved extents
+ * @it: Request iterator that holds data, advanced past the reserved sectors
+ * @sector: First sector index, advanced past the reserved sectors
+ * @nr: Number of sectors, decreased by the reserved sectors
+ *
+ * Resolve and reserve the physical blocks of as many sectors as @cmd can
+ * keep. Whole units are taken from the write frontier of the hardware queue
+ * without any lock, and the lock of a domain is only taken to refill the
+ * frontier or to write a partial unit. Whole units are filled later without
+ * the lock, but partially written units are written and published right
+ * away, see write_unit().
+ *
+ * Return: 0 on success, -EAGAIN if there is no free block
+ */
+static int reserve_sectors(struct csl_device* dev, struct csl_hctx* ch,
+			   struct csl_cmd* cmd, struct csl_rq_iter* it,
+			   sector_t* sector, unsigned int* nr) {
+	unsigned int unit_sectors = UNIT_SECTORS(dev);
+	struct csl_domain* dom = NULL;
+	u64 locked = 0;
+	int ret = 0;
+
+	while (*nr && cmd->nr_extents < CSL_CMD_EXTENTS) {
+		struct csl_domain* next = LBA_TO_DOMAIN(dev, *sector);
+		unsigned int off = *sector & (unit_sectors - 1);
+		unsigned int len = min_t(
+		    unsigned int, *nr,
+		    CSL_STRIPE_SECTORS - (*sector & (CSL_STRIPE_SECTORS - 1)));
+		atomic64_t* fr;
+		unsigned int cnt;
+		u32 p_idx;
+
+		if (next != dom) {
+			unlock_domain(ch, dom, &locked);
+			dom = next;
+		}
+		fr = &ch->frontiers[dom - dev->domains];
+
+		if (off || len < unit_sectors) {
+			len = min(len, unit_sectors - off);
+			lock_domain(dev, ch, dom, &locked);
+			p_idx = frontier_alloc(dev, dom, ch, 1, &cnt);
+			if (p_idx != CSL_UNMAPPED)
+				write_unit(dev, dom, p_idx, it, *sector, len);
+		} else {
+			unsigned int units = len >> dev->unit_shift;
+
+			p_idx = frontier_take(fr, units, &cnt);
+			if (p_idx == CSL_UNMAPPED) {
+				lock_domain(dev, ch, dom, &locked);
+				p_idx = frontier_alloc(dev, dom, ch, units,
+						       &cnt);
+			}
+
+			if (p_idx != CSL_UNMAPPED) {
+				struct csl_extent* ext =
+				    &cmd->extents[cmd->nr_extents++];
+
+				ext->it = *it;
+				ext->unit = *sector >> dev->unit_shift;
+				ext->p_idx = p_idx;
+				ext->nr = cnt;
+
+				len = cnt << dev->unit_shift;
+				rq_iter_copy(it, NULL, len << CSL_SECTOR_SHIFT,
+					     WRITE);
+			}
+		}
+
+		if (p_idx == CSL_UNMAPPED) {
+			DEBUG_MESSAGE("%sNo free block\n", PROMPT);
+			ret = -EAGAIN;
+			break;
+		}
+
+		*sector += len;
+		*nr -= len;
+	}
+
+	unlock_domain(ch, dom, &locked);
+
+	return ret;
+}
+
+/* Copy the data of the reserved extents of a request, without any lock since
+ * nobody else can see the reserved blocks yet */
+static void fill_sectors(struct csl_device* dev, struct csl_cmd* cmd) {
+	for (unsigned int i = 0; i < cmd->nr_extents; i++) {
+		struct csl_extent* ext = &cmd->extents[i];
+
+		rq_iter_copy(&ext->it, IDX_PTR(dev, ext->p_idx),
+			     ext->nr << (dev->unit_shift + CSL_SECTOR_SHIFT),
+			     WRITE);
+
+		DEBUG_MESSAGE("%sBlock Index: %ld, Block Address: %p, "
+			      "Units: %u\n",
+			      PROMPT, ext->unit, IDX_PTR(dev, ext->p_idx),
+			      ext->nr);
+	}
+}
+
+/**
+ * publish_sectors - Fill and publish the reserved extents of a request
+ *
+ * @dev: Device pointer
+ * @ch: Hardware queue data
+ * @cmd: Request data that keeps the reserved extents
+ *
+ * The lock is taken again only to update the map.
+ */
+static void publish_sectors(struct csl_device* dev, struct csl_hctx* ch,
+			    struct csl_cmd* cmd) {
+	struct csl_domain* dom = NULL;
+	u64 locked = 0;
+
+	fill_sectors(dev, cmd);
+
+	for (unsigned int i = 0; i < cmd->nr_extents; i++) {
+		struct csl_extent* ext = &cmd->extents[i];
+		struct csl_domain* next =
+		    LBA_TO_DOMAIN(dev, ext->unit << dev->unit_shift);
+
+		if (next != dom) {
+			if (dom)
+				dispatch_unlock(ch, dom, locked);
+			dom = next;
+			locked = dispatch_lock(ch, dom);
+		}
+
+		publish_extent(dev, dom, ext->unit, ext->p_idx, ext->nr);
+	}
+
+	if (dom)
+		dispatch_unlock(ch, dom, locked);
+
+	cmd->nr_extents = 0;
+}
+
+/**
+ * write_sectors - Write sectors to device
+ *
+ * @dev: Device pointer
+ * @ch: Hardware queue data that keeps the write frontiers
+ * @cmd: Request data that keeps the reserved extents
+ * @it: Request iterator that holds data
+ * @sector: First sector index
+ * @nr: Number of sectors
+ * @defer: Leave the map update to the caller when possible
+ *
+ * Write data to the device from the request
+ * The request is written in three steps: the physical blocks are reserved
+ * from the write frontiers of the hardware queue, the data is copied without
+ * the lock, and the map is updated in one critical section per domain. Only
+ * a request with more extents than @cmd can keep goes through the steps
+ * again. With @defer, a request reserved in one pass is filled, but its
+ * extents are kept in @cmd for the caller to publish.
+ *
+ * Return: 0 on success, -EAGAIN if no free block has passed its grace period
+ * yet
+ */
+int write_sectors(struct csl_device* dev, struct csl_hctx* ch,
+		  struct csl_cmd* cmd, struct csl_rq_iter* it, sector_t sector,
+		  unsigned int nr, bool defer) {
+	int ret;
+
+	cmd->nr_extents = 0;
+
+	do {
+		ret = reserve_sectors(dev, ch, cmd, it, &sector, &nr);
+
+		if (defer && !ret && !nr) {
+			fill_sectors(dev, cmd);
+			break;
+		}
+
+		/* publish what was reserved even on failure, the rest is
+		 * written again after the requeue */
+		publish_sectors(dev, ch, cmd);
+	} while (!ret && nr);
+
+	return ret;
+}
+
+/**
+ * unmap_sectors - Unmap sectors of device
+ *
+ * @dev: Device pointer
+ * @ch: Hardware queue data that keeps the write frontiers
+ * @sector: First sector index
+ * @nr: Number of sectors
+ * @zero: Whether the sectors must read as zeroes afterwards
+ *
+ * Discard and write zeroes only update the map, since unmapped sectors read
+ * as zeroes. Their old blocks stop being valid, so the garbage collector does
+ * not migrate them anymore. Partial units are left alone by a discard, and
+ * zeroed by a write of zeroes when they hold data.
+ *
+ * Return: 0 on success, -EAGAIN if there is no free block to zero a partial
+ * unit
+ */
+int unmap_sectors(struct csl_device* dev, struct csl_hctx* ch,
+		  sector_t sector, unsigned int nr, bool zero) {
+	unsigned int unit_sectors = UNIT_SECTORS(dev);
+	struct csl_domain* dom = NULL;
+	u64 locked = 0;
+	int ret = 0;
+
+	while (nr) {
+		struct csl_domain* next = LBA_TO_DOMAIN(dev, sector);
+		unsigned long unit = sector >> dev->unit_shift;
+		unsigned int off = sector & (unit_sectors - 1);
+		unsigned int len = min_t(
+		    unsigned int, nr,
+		    CSL_STRIPE_SECTORS - (sector & (CSL_STRIPE_SECTORS - 1)));
+
+		if (next != dom) {
+			unlock_domain(ch, dom, &locked);
+			dom = next;
+		}
+		lock_domain(dev, ch, dom, &locked);
+
+		if (off || len < unit_sectors) {
+			len = min(len, unit_sectors - off);
+
+			if (zero && dev->map[unit] != CSL_UNMAPPED) {
+				unsigned int cnt;
+				u32 p_idx =
+				    frontier_alloc(dev, dom, ch, 1, &cnt);
+
+				if (p_idx == CSL_UNMAPPED) {
+					ret = -EAGAIN;
+					break;
+				}
+
+				write_unit(dev, dom, p_idx, NULL, sector, len);
+			}
+		} else {
+			len &= ~(unit_sectors - 1);
+			unmap_extent(dev, dom, unit, len >> dev->unit_shift);
+		}
+
+		sector += len;
+		nr -= len;
+	}
+
+	unlock_domain(ch, dom, &locked);
+
+	return ret;
+}
+
+/**
+ * publish_batch - Publish the deferred writes of a batch
+ *
+ * @dev: Device pointer
+ * @ch: Hardware queue data, accounted the lock times
+ * @list: Request data of the deferred writes, linked in dispatch order
+ *
+ * Every domain is locked once for the whole batch. The extents of a domain
+ * are published in dispatch order, so when two writes of the batch hit the
+ * same unit, the later one wins, as if they were published one by one. A
+ * published extent is cleared.
+ */
+void publish_batch(struct csl_device* dev, struct csl_hctx* ch,
+		   struct csl_cmd* list) {
+	for (;;) {
+		struct csl_domain* dom = NULL;
+		u64 locked = 0;
+
+		for (struct csl_cmd* cmd = list; cmd; cmd = cmd->next) {
+			for (unsigned int i = 0; i < cmd->nr_extents; i++) {
+				struct csl_extent* ext = &cmd->extents[i];
+				struct csl_domain* next = LBA_TO_DOMAIN(
+				    dev, ext->unit << dev->unit_shift);
+
+				if (!ext->nr)
+					continue;
+
+				if (!dom) {
+					dom = next;
+					locked = dispatch_lock(ch, dom);
+				} else if (next != dom) {
+					continue;
+				}
+
+				publish_extent(dev, dom, ext->unit,
+					       ext->p_idx, ext->nr);
+				ext->nr = 0;
+			}
+		}
+
+		if (!dom)
+			break;
+
+		dispatch_unlock(ch, dom, locked);
+	}
+}
+
+/**
+ * release_frontiers - Give the blocks of all write frontiers back
+ *
+ * @dev: Device pointer
+ *
+ * Blocks kept in a frontier are marked as used but not mapped, so they must
+ * be given back before the metadata is saved.
+ */
+void release_frontiers(struct csl_device* dev) {
+	for (unsigned int i = 0; i < dev->nr_domains; i++) {
+		struct csl_domain* dom = &dev->domains[i];
+
+		GET_WRITE_LOCK(dom);
+		drain_frontiers(dev, dom);
+		RELEASE_WRITE_LOCK(dom);
+	}
+}
@@ -0,0 +1,20 @@
+#include <linux/types.h>
+#include "type.h"
+
+#ifndef __CSL_RQ_OPS
+#define __CSL_RQ_OPS
+
+void rq_iter_copy(struct csl_rq_iter* it, void* buf, unsigned int len,
+		  int dir);
+unsigned int read_sectors(struct csl_device* dev, struct csl_rq_iter* it,
+			  sector_t sector, unsigned int nr);
+int write_sectors(struct csl_device* dev, struct csl_hctx* ch,
+		  struct csl_cmd* cmd, struct csl_rq_iter* it, sector_t sector,
+		  unsigned int nr, bool defer);
+int unmap_sectors(struct csl_device* dev, struct csl_hctx* ch,
+		  sector_t sector, unsigned int nr, bool zero);
+void publish_batch(struct csl_device* dev, struct csl_hctx* ch,
+		   struct csl_cmd* list);
+void release_frontiers(struct csl_device* dev);
+
+#endif
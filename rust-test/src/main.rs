@@ -10,7 +10,7 @@ use libc::{open, O_DIRECT, O_RDWR, close};
 use libc::posix_memalign;
 use libc::c_void;
 
-const DEVICE_PATH: &str = "/dev/csl";
+const DEVICE_PATH: &str = "/dev/csl0";
 const SECTOR_SIZE: usize = 512;
 
 fn open_direct(path: &str) -> i32 {
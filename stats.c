@@ -0,0 +1,344 @@
+#include <linux/bitmap.h>
+#include <linux/debugfs.h>
+#include <linux/device.h>
+#include <linux/seq_file.h>
+#include "gc.h"
+#include "metadata.h"
+#include "stats.h"
+
+/**
+ * stats_init_hctx - Allocate the counters of a hardware queue
+ *
+ * @ch: Hardware queue data
+ *
+ * Return: 0 on success, -ENOMEM on failure
+ */
+int stats_init_hctx(struct csl_hctx* ch) {
+	ch->stats = alloc_percpu(struct csl_stats);
+
+	return ch->stats ? 0 : -ENOMEM;
+}
+
+/**
+ * stats_exit_hctx - Free the counters of a hardware queue
+ *
+ * @ch: Hardware queue data
+ */
+void stats_exit_hctx(struct csl_hctx* ch) {
+	free_percpu(ch->stats);
+	ch->stats = NULL;
+}
+
+/**
+ * stats_complete - Account a handled request
+ *
+ * @ch: Hardware queue data
+ * @rq: Request
+ * @ret: Result of the request
+ * @nr_bytes: Number of bytes handled
+ * @start_ns: Time the request was dispatched at
+ *
+ * The latency is the time the driver took to handle the request, a request
+ * left to the journal thread or to polling is accounted when it is handed
+ * over.
+ */
+void stats_complete(struct csl_hctx* ch, struct request* rq, int ret,
+		    unsigned int nr_bytes, u64 start_ns) {
+	struct csl_stats __percpu* stats = ch->stats;
+
+	switch (req_op(rq)) {
+	case REQ_OP_READ:
+		this_cpu_inc(stats->nr_reads);
+		this_cpu_add(stats->read_bytes, nr_bytes);
+		break;
+	case REQ_OP_WRITE:
+		this_cpu_inc(stats->nr_writes);
+		this_cpu_add(stats->write_bytes, nr_bytes);
+		break;
+	case REQ_OP_DISCARD:
+	case REQ_OP_WRITE_ZEROES:
+		this_cpu_inc(stats->nr_discards);
+		break;
+	case REQ_OP_FLUSH:
+		this_cpu_inc(stats->nr_flushes);
+		break;
+	default:
+		break;
+	}
+
+	if (ret)
+		this_cpu_inc(stats->nr_errors);
+
+	this_cpu_inc(stats->lat[min_t(unsigned int,
+				     fls64(ktime_get_ns() - start_ns),
+				     CSL_LAT_BUCKETS - 1)]);
+}
+
+/* Sum the counters of a hardware queue over the CPUs */
+static void sum_hctx(struct csl_hctx* ch, struct csl_stats* sum) {
+	int cpu;
+
+	for_each_possible_cpu(cpu) {
+		struct csl_stats* stats = per_cpu_ptr(ch->stats, cpu);
+
+		sum->nr_reads += stats->nr_reads;
+		sum->nr_writes += stats->nr_writes;
+		sum->nr_discards += stats->nr_discards;
+		sum->nr_flushes += stats->nr_flushes;
+		sum->nr_errors += stats->nr_errors;
+		sum->read_bytes += stats->read_bytes;
+		sum->write_bytes += stats->write_bytes;
+		sum->unmapped_read_bytes += stats->unmapped_read_bytes;
+		sum->nr_locks += stats->nr_locks;
+		sum->lock_wait_ns += stats->lock_wait_ns;
+		sum->lock_hold_ns += stats->lock_hold_ns;
+		for (unsigned int i = 0; i < CSL_LAT_BUCKETS; i++)
+			sum->lat[i] += stats->lat[i];
+	}
+}
+
+/* Sum the counters of every hardware queue of a device */
+static void sum_device(struct csl_device* dev, struct csl_stats* sum) {
+	struct blk_mq_hw_ctx* hctx;
+	unsigned long i;
+
+	memset(sum, 0, sizeof(*sum));
+	queue_for_each_hw_ctx(dev->queue, hctx, i) {
+		if (hctx->driver_data)
+			sum_hctx(hctx->driver_data, sum);
+	}
+}
+
+/**
+ * struct csl_ftl_stats - Space counters of a domain
+ * @free_segs: 				Free segments
+ * @retiring_segs: 			Collected segments not reused yet
+ * @valid_blocks: 			Blocks that hold mapped data
+ * @dirty_blocks: 			Replaced blocks of the closed and retiring
+ * 					segments, reclaimed by collection
+ */
+struct csl_ftl_stats {
+	u64 free_segs;	   /* Free segments */
+	u64 retiring_segs; /* Retiring segments */
+	u64 valid_blocks;  /* Valid blocks */
+	u64 dirty_blocks;  /* Dirty blocks */
+};
+
+/* Count the space of a domain, without the lock since an estimate is fine */
+static void sum_domain(struct csl_device* dev, struct csl_domain* dom,
+		       struct csl_ftl_stats* sum) {
+	sum->free_segs += READ_ONCE(dom->nr_free_segs);
+	sum->retiring_segs += READ_ONCE(dom->nr_retiring);
+
+	for (unsigned int i = 0; i < dom->nr_segs; i++) {
+		struct csl_segment* seg = &dom->segs[i];
+		unsigned int valid = READ_ONCE(seg->nr_valid);
+
+		sum->valid_blocks += valid;
+		switch (READ_ONCE(seg->state)) {
+		case CSL_SEG_CLOSED:
+		case CSL_SEG_COLLECTING:
+		case CSL_SEG_RETIRING:
+			sum->dirty_blocks += SEG_UNITS(dev) - valid;
+			break;
+		default:
+			break;
+		}
+	}
+}
+
+/* Print the counters of every hardware queue */
+static int hctx_show(struct seq_file* m, void* v) {
+	struct csl_device* dev = m->private;
+	struct blk_mq_hw_ctx* hctx;
+	unsigned long i;
+
+	queue_for_each_hw_ctx(dev->queue, hctx, i) {
+		struct csl_stats sum = {};
+
+		if (!hctx->driver_data)
+			continue;
+
+		sum_hctx(hctx->driver_data, &sum);
+		seq_printf(m,
+			   "hctx%lu reads %llu writes %llu discards %llu "
+			   "flushes %llu errors %llu read_bytes %llu "
+			   "write_bytes %llu unmapped_read_bytes %llu "
+			   "locks %llu lock_wait_ns %llu lock_hold_ns %llu\n",
+			   i, sum.nr_reads, sum.nr_writes, sum.nr_discards,
+			   sum.nr_flushes, sum.nr_errors, sum.read_bytes,
+			   sum.write_bytes, sum.unmapped_read_bytes,
+			   sum.nr_locks, sum.lock_wait_ns, sum.lock_hold_ns);
+	}
+
+	return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(hctx);
+
+/* Print the latency histogram of every hardware queue that has one */
+static int latency_show(struct seq_file* m, void* v) {
+	struct csl_device* dev = m->private;
+	struct blk_mq_hw_ctx* hctx;
+	unsigned long i;
+
+	queue_for_each_hw_ctx(dev->queue, hctx, i) {
+		struct csl_stats sum = {};
+
+		if (!hctx->driver_data)
+			continue;
+
+		sum_hctx(hctx->driver_data, &sum);
+		seq_printf(m, "hctx%lu", i);
+		for (unsigned int b = 0; b < CSL_LAT_BUCKETS; b++) {
+			if (!sum.lat[b])
+				continue;
+			if (b == CSL_LAT_BUCKETS - 1)
+				seq_printf(m, " >=%lluns:%llu", 1ULL << (b - 1),
+					   sum.lat[b]);
+			else
+				seq_printf(m, " <%lluns:%llu", 1ULL << b,
+					   sum.lat[b]);
+		}
+		seq_putc(m, '\n');
+	}
+
+	return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(latency);
+
+/* Print the space and garbage collection counters of every domain */
+static int ftl_show(struct seq_file* m, void* v) {
+	struct csl_device* dev = m->private;
+	u64 waf = write_amplification(dev);
+
+	for (unsigned int i = 0; i < dev->nr_domains; i++) {
+		struct csl_domain* dom = &dev->domains[i];
+		struct csl_ftl_stats sum = {};
+
+		sum_domain(dev, dom, &sum);
+		seq_printf(m,
+			   "domain%u free_segs %llu retiring_segs %llu "
+			   "valid_blocks %llu dirty_blocks %llu collected %llu "
+			   "host_writes %llu gc_writes %llu\n",
+			   i, sum.free_segs, sum.retiring_segs,
+			   sum.valid_blocks, sum.dirty_blocks,
+			   READ_ONCE(dom->nr_collected),
+			   READ_ONCE(dom->nr_host_writes),
+			   READ_ONCE(dom->nr_gc_writes));
+	}
+
+	seq_printf(m, "gc_runs %llu waf %llu.%02llu",
+		   READ_ONCE(dev->nr_gc_runs), waf / 100, waf % 100);
+	if (dev->dirty)
+		seq_printf(m, " dirty_chunks %u",
+			   bitmap_weight(dev->dirty, NR_CHUNKS(dev)));
+	seq_putc(m, '\n');
+
+	return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(ftl);
+
+/**
+ * stats_debugfs_init - Create the stats files of a device in debugfs
+ *
+ * @dev: Device pointer, with its debugfs directory
+ *
+ * hctx and latency hold the counters and the latency histogram of every
+ * hardware queue, ftl the space of every domain.
+ */
+void stats_debugfs_init(struct csl_device* dev) {
+	debugfs_create_file("hctx", 0400, dev->debugfs, dev, &hctx_fops);
+	debugfs_create_file("latency", 0400, dev->debugfs, dev, &latency_fops);
+	debugfs_create_file("ftl", 0400, dev->debugfs, dev, &ftl_fops);
+}
+
+/* Show one counter summed over the hardware queues */
+#define CSL_STATS_ATTR(_name, _field)                                       \
+	static ssize_t _name##_show(struct device* d,                       \
+				    struct device_attribute* attr,          \
+				    char* buf) {                            \
+		struct csl_stats sum;                                       \
+                                                                            \
+		sum_device(dev_to_disk(d)->private_data, &sum);             \
+		return sysfs_emit(buf, "%llu\n", sum._field);               \
+	}                                                                   \
+	static DEVICE_ATTR_RO(_name)
+
+CSL_STATS_ATTR(reads, nr_reads);
+CSL_STATS_ATTR(writes, nr_writes);
+CSL_STATS_ATTR(discards, nr_discards);
+CSL_STATS_ATTR(flushes, nr_flushes);
+CSL_STATS_ATTR(errors, nr_errors);
+CSL_STATS_ATTR(read_bytes, read_bytes);
+CSL_STATS_ATTR(write_bytes, write_bytes);
+CSL_STATS_ATTR(unmapped_read_bytes, unmapped_read_bytes);
+CSL_STATS_ATTR(lock_wait_ns, lock_wait_ns);
+CSL_STATS_ATTR(lock_hold_ns, lock_hold_ns);
+
+/* Show the garbage collector passes, segments collected and sectors migrated */
+static ssize_t gc_show(struct device* d, struct device_attribute* attr,
+		       char* buf) {
+	struct csl_device* dev = dev_to_disk(d)->private_data;
+	u64 collected = 0, migrated = 0;
+
+	for (unsigned int i = 0; i < dev->nr_domains; i++) {
+		collected += READ_ONCE(dev->domains[i].nr_collected);
+		migrated += READ_ONCE(dev->domains[i].nr_gc_writes);
+	}
+
+	return sysfs_emit(buf, "%llu %llu %llu\n", READ_ONCE(dev->nr_gc_runs),
+			  collected, migrated << (dev->unit_shift));
+}
+static DEVICE_ATTR_RO(gc);
+
+/* Show the write amplification factor */
+static ssize_t write_amplification_show(struct device* d,
+					struct device_attribute* attr,
+					char* buf) {
+	u64 waf = write_amplification(dev_to_disk(d)->private_data);
+
+	return sysfs_emit(buf, "%llu.%02llu\n", waf / 100, waf % 100);
+}
+static DEVICE_ATTR_RO(write_amplification);
+
+/* Show the free and retiring segments, then the valid and dirty blocks */
+static ssize_t space_show(struct device* d, struct device_attribute* attr,
+			  char* buf) {
+	struct csl_device* dev = dev_to_disk(d)->private_data;
+	struct csl_ftl_stats sum = {};
+
+	for (unsigned int i = 0; i < dev->nr_domains; i++)
+		sum_domain(dev, &dev->domains[i], &sum);
+
+	return sysfs_emit(buf, "%llu %llu %llu %llu\n", sum.free_segs,
+			  sum.retiring_segs, sum.valid_blocks,
+			  sum.dirty_blocks);
+}
+static DEVICE_ATTR_RO(space);
+
+static struct attribute* csl_stats_attrs[] = {
+    &dev_attr_reads.attr,
+    &dev_attr_writes.attr,
+    &dev_attr_discards.attr,
+    &dev_attr_flushes.attr,
+    &dev_attr_errors.attr,
+    &dev_attr_read_bytes.attr,
+    &dev_attr_write_bytes.attr,
+    &dev_attr_unmapped_read_bytes.attr,
+    &dev_attr_lock_wait_ns.attr,
+    &dev_attr_lock_hold_ns.attr,
+    &dev_attr_gc.attr,
+    &dev_attr_write_amplification.attr,
+    &dev_attr_space.attr,
+    NULL,
+};
+
+static const struct attribute_group csl_stats_group = {
+    .name = "stats",
+    .attrs = csl_stats_attrs,
+};
+
+const struct attribute_group* csl_disk_groups[] = {
+    &csl_stats_group,
+    NULL,
+};
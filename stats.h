@@ -0,0 +1,36 @@
+#include <linux/blk-mq.h>
+#include <linux/percpu.h>
+#include <linux/sysfs.h>
+#include <linux/types.h>
+#include "type.h"
+
+#ifndef __CSL_STATS_OPS
+#define __CSL_STATS_OPS
+
+/* Attributes of the disk, in /sys/block/cslN/stats */
+extern const struct attribute_group* csl_disk_groups[];
+
+int stats_init_hctx(struct csl_hctx* ch);
+void stats_exit_hctx(struct csl_hctx* ch);
+void stats_complete(struct csl_hctx* ch, struct request* rq, int ret,
+		    unsigned int nr_bytes, u64 start_ns);
+void stats_debugfs_init(struct csl_device* dev);
+
+/* Account a domain lock taken on the dispatch path */
+static inline void stats_lock(struct csl_hctx* ch, u64 wait_ns) {
+	this_cpu_inc(ch->stats->nr_locks);
+	this_cpu_add(ch->stats->lock_wait_ns, wait_ns);
+}
+
+/* Account the time a domain lock was held on the dispatch path */
+static inline void stats_unlock(struct csl_hctx* ch, u64 hold_ns) {
+	this_cpu_add(ch->stats->lock_hold_ns, hold_ns);
+}
+
+/* Account bytes read from units that were never written */
+static inline void stats_unmapped_read(struct csl_hctx* ch,
+				       unsigned int nr_bytes) {
+	this_cpu_add(ch->stats->unmapped_read_bytes, nr_bytes);
+}
+
+#endif
@@ -0,0 +1,1003 @@
+/*
+ * stress - Concurrent verify-and-stress test of a csl device
+ *
+ * Every thread keeps its own io_uring full of O_DIRECT reads and writes,
+ * without any synchronization between the threads. Part of the requests go
+ * to a small region shared by all threads, so writes overlap each other and
+ * the reads, and the others to a private slice of every thread.
+ *
+ * Every block written carries its address, the writer and its sequence
+ * number, and a checksum of the block. A block read back must be intact, at
+ * its address, and written by a write that was submitted and not yet
+ * overwritten when the read was submitted: a write that completed before is
+ * replaced only by a write that completed after it started. The whole device
+ * is verified once more after the run.
+ *
+ * The device can be flushed periodically while the threads run. A crash test
+ * then freezes the persistent state of a debug build of the driver under
+ * load, reloads the device, and verifies that every block is at least as new
+ * as the last flush that completed before the crash made it.
+ *
+ *   make stress STRESS_ARGS="-t 16 -q 64 -r 30"
+ *   make stress STRESS_ARGS="-C -R 'make unload load RESET_DEVICE=0 \
+ *	LOAD_ARGS=__backing_file=/var/tmp/csl0'"
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <libgen.h>
+#include <linux/fs.h>
+#include <linux/io_uring.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#define DEVICE_PATH "/dev/csl0"
+#define CRASH_PATH "/sys/kernel/debug/%s/crash"
+#define RELOAD_COMMAND "make unload load RESET_DEVICE=0"
+
+#define STRESS_MAGIC 0x53525453 /* "STRS" */
+#define STRESS_MAX_DEPTH 1024
+#define STRESS_MAX_BLOCKS 256
+#define STRESS_LAT_BUCKETS 32
+#define STRESS_MAX_REPORTS 16
+
+/* Writes of a thread whose completion time is kept, must exceed the depth */
+#define STRESS_RECORDS (1U << 16)
+
+typedef uint8_t u8;
+typedef uint32_t u32;
+typedef uint64_t u64;
+
+/**
+ * struct stamp - Header at the start of every block written
+ * @magic: 				STRESS_MAGIC
+ * @crc: 				CRC32C of the block with this field zero
+ * @lba: 				Block address
+ * @seq: 				Sequence number of the write in its thread
+ * @tid: 				Thread of the write
+ * @run: 				Identifier of the run
+ */
+struct stamp {
+	u32 magic; /* Magic number */
+	u32 crc;   /* Block checksum */
+	u64 lba;   /* Block address */
+	u64 seq;   /* Write sequence number */
+	u32 tid;   /* Writer thread */
+	u32 run;   /* Run identifier */
+};
+
+/**
+ * struct record - Completion time of a write
+ * @seq: 				Sequence number of the write
+ * @done: 				Clock at completion, 0 while in flight
+ */
+struct record {
+	u64 seq;  /* Write sequence number */
+	u64 done; /* Completion clock */
+};
+
+/**
+ * struct latency - Latency of completed requests
+ * @nr: 				Number of requests
+ * @bytes: 				Bytes transferred
+ * @sum_ns: 				Sum of latencies
+ * @max_ns: 				Highest latency
+ * @hist: 				Histogram, bucket i counts latencies below
+ * 					2^i ns and the last one the rest
+ */
+struct latency {
+	u64 nr;				/* Requests */
+	u64 bytes;			/* Bytes */
+	u64 sum_ns;			/* Latency sum */
+	u64 max_ns;			/* Highest latency */
+	u64 hist[STRESS_LAT_BUCKETS];	/* Latency histogram */
+};
+
+/**
+ * struct slot - Request in flight
+ * @write: 				Write or read
+ * @lba: 				First block address
+ * @nr: 				Number of blocks
+ * @seq: 				Sequence number of a write
+ * @start: 				Clock at submission of a write
+ * @start_ns: 				Submission time
+ * @buf: 				Data
+ * @floor: 				Clock of the last write of every block
+ * 					completed before a read was submitted
+ */
+struct slot {
+	bool write;	/* Write or read */
+	u64 lba;	/* First block */
+	unsigned int nr; /* Number of blocks */
+	u64 seq;	/* Write sequence number */
+	u64 start;	/* Submission clock */
+	u64 start_ns;	/* Submission time */
+	u8* buf;	/* Data */
+	u64* floor;	/* Committed clock of every block */
+};
+
+/**
+ * struct uring - Submission and completion queues of an io_uring
+ */
+struct uring {
+	int fd;
+	unsigned int *sq_head, *sq_tail, *sq_mask, *sq_array;
+	unsigned int *cq_head, *cq_tail, *cq_mask;
+	struct io_uring_sqe* sqes;
+	struct io_uring_cqe* cqes;
+};
+
+struct stress;
+
+/**
+ * struct worker - Thread of the test
+ * @stress: 				Test state
+ * @thread: 				Thread
+ * @id: 				Thread index
+ * @ring: 				io_uring of the thread
+ * @slots: 				Requests, one per entry of the queue
+ * @free: 				Indexes of the free slots
+ * @nr_free: 				Number of free slots
+ * @rand: 				Random state
+ * @seq: 				Sequence number of the last write submitted
+ * @evicted: 				Highest completion clock of the writes
+ * 					whose record was reused
+ * @records: 				Completion clock of the last writes
+ * @first: 				First block of the private slice
+ * @nr_private: 			Number of blocks of the private slice
+ * @lat: 				Latency of reads and writes
+ * @verified: 				Blocks verified
+ */
+struct worker {
+	struct stress* stress;	/* Test state */
+	pthread_t thread;	/* Thread */
+	unsigned int id;	/* Thread index */
+	struct uring ring;	/* io_uring */
+	struct slot* slots;	/* Requests */
+	unsigned int* free;	/* Free slots */
+	unsigned int nr_free;	/* Number of free slots */
+	u64 rand;		/* Random state */
+	u64 seq;		/* Last write sequence number */
+	u64 evicted;		/* Completion bound of old writes */
+	struct record* records;	/* Completion of the last writes */
+	u64 first;		/* First private block */
+	u64 nr_private;		/* Private blocks */
+	struct latency lat[2];	/* Read and write latency */
+	u64 verified;		/* Blocks verified */
+};
+
+/**
+ * struct stress - Test state
+ */
+struct stress {
+	const char* path;	   /* Device path */
+	int fd;			   /* Device */
+	unsigned int block_size;   /* Logical block size */
+	u64 nr_blocks;		   /* Blocks tested */
+	u64 nr_shared;		   /* Blocks of the shared region */
+	unsigned int nr_threads;   /* Number of threads */
+	unsigned int depth;	   /* Queue depth of every thread */
+	unsigned int max_blocks;   /* Blocks of the largest request */
+	unsigned int write_percent; /* Share of writes */
+	unsigned int shared_percent; /* Share of shared requests */
+	unsigned int runtime;	   /* Seconds */
+	unsigned int flush_ms;	   /* Milliseconds between flushes */
+	bool crash;		   /* Crash test */
+	const char* reload;	   /* Command that reloads the device */
+	u32 run;		   /* Run identifier */
+	u64 clock;		   /* Event clock */
+	u64* committed;		   /* Clock of the last completed write */
+	u64* flushing;		   /* Committed clocks of a flush */
+	u64* durable;		   /* Committed clocks of the last flush */
+	u64 nr_flushes;		   /* Flushes completed */
+	bool stop;		   /* Threads stop submitting */
+	struct worker* workers;	   /* Threads */
+
+	u64 nr_io_errors;	   /* Failed or short requests */
+	u64 nr_corrupt;		   /* Blocks that fail their checksum */
+	u64 nr_misdirected;	   /* Blocks of another address */
+	u64 nr_stale;		   /* Blocks of an overwritten write */
+	u64 nr_lost;		   /* Blocks of no write after a write */
+	u64 nr_future;		   /* Blocks of a write never submitted */
+	u64 nr_reported;	   /* Errors printed */
+};
+
+static u32 crc_table[256];
+
+static void crc32c_init(void) {
+	for (u32 i = 0; i < 256; i++) {
+		u32 crc = i;
+
+		for (int j = 0; j < 8; j++)
+			crc = crc & 1 ? (crc >> 1) ^ 0x82f63b78 : crc >> 1;
+		crc_table[i] = crc;
+	}
+}
+
+static u32 crc32c(const u8* data, size_t len) {
+	u32 crc = ~0U;
+
+	while (len--)
+		crc = crc_table[(crc ^ *data++) & 0xff] ^ (crc >> 8);
+
+	return ~crc;
+}
+
+static u64 now_ns(void) {
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (u64)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/* Next event of the clock shared by all threads */
+static u64 tick(struct stress* s) {
+	return __atomic_add_fetch(&s->clock, 1, __ATOMIC_SEQ_CST);
+}
+
+/* xorshift64* */
+static u64 next_rand(struct worker* w) {
+	w->rand ^= w->rand >> 12;
+	w->rand ^= w->rand << 25;
+	w->rand ^= w->rand >> 27;
+	return w->rand * 0x2545f4914f6cdd1dULL;
+}
+
+static int uring_setup(struct uring* r, unsigned int entries) {
+	struct io_uring_params p = {0};
+	size_t sq_len, cq_len;
+	u8 *sq, *cq;
+
+	r->fd = syscall(__NR_io_uring_setup, entries, &p);
+	if (r->fd < 0)
+		return -errno;
+
+	sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+	cq_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	if (p.features & IORING_FEAT_SINGLE_MMAP)
+		sq_len = cq_len = sq_len > cq_len ? sq_len : cq_len;
+
+	sq = mmap(NULL, sq_len, PROT_READ | PROT_WRITE,
+		  MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+	if (sq == MAP_FAILED)
+		return -errno;
+
+	cq = sq;
+	if (!(p.features & IORING_FEAT_SINGLE_MMAP)) {
+		cq = mmap(NULL, cq_len, PROT_READ | PROT_WRITE,
+			  MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_CQ_RING);
+		if (cq == MAP_FAILED)
+			return -errno;
+	}
+
+	r->sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe),
+		       PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+		       r->fd, IORING_OFF_SQES);
+	if (r->sqes == MAP_FAILED)
+		return -errno;
+
+	r->sq_head = (unsigned int*)(sq + p.sq_off.head);
+	r->sq_tail = (unsigned int*)(sq + p.sq_off.tail);
+	r->sq_mask = (unsigned int*)(sq + p.sq_off.ring_mask);
+	r->sq_array = (unsigned int*)(sq + p.sq_off.array);
+	r->cq_head = (unsigned int*)(cq + p.cq_off.head);
+	r->cq_tail = (unsigned int*)(cq + p.cq_off.tail);
+	r->cq_mask = (unsigned int*)(cq + p.cq_off.ring_mask);
+	r->cqes = (struct io_uring_cqe*)(cq + p.cq_off.cqes);
+
+	return 0;
+}
+
+/* Queue a read or a write of a slot, submitted by uring_enter() */
+static void uring_queue(struct uring* r, int fd, struct slot* sl,
+			unsigned int idx, unsigned int block_size) {
+	unsigned int tail = *r->sq_tail;
+	unsigned int i = tail & *r->sq_mask;
+	struct io_uring_sqe* sqe = &r->sqes[i];
+
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->opcode = sl->write ? IORING_OP_WRITE : IORING_OP_READ;
+	sqe->fd = fd;
+	sqe->addr = (unsigned long)sl->buf;
+	sqe->len = sl->nr * block_size;
+	sqe->off = sl->lba * block_size;
+	sqe->user_data = idx;
+	r->sq_array[i] = i;
+
+	__atomic_store_n(r->sq_tail, tail + 1, __ATOMIC_RELEASE);
+}
+
+static int uring_enter(struct uring* r, unsigned int submit,
+		       unsigned int wait) {
+	int ret;
+
+	do {
+		ret = syscall(__NR_io_uring_enter, r->fd, submit, wait,
+			      wait ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+	} while (ret < 0 && errno == EINTR);
+
+	return ret < 0 ? -errno : ret;
+}
+
+/* Report an error of a block, the first ones in detail */
+static void report(struct stress* s, u64* counter, const char* what,
+		   u64 lba, const struct stamp* st, u64 floor) {
+	__atomic_add_fetch(counter, 1, __ATOMIC_RELAXED);
+	if (__atomic_fetch_add(&s->nr_reported, 1, __ATOMIC_RELAXED)
+	    >= STRESS_MAX_REPORTS)
+		return;
+
+	fprintf(stderr,
+		"%s block %llu: magic %#x lba %llu thread %u seq %llu, "
+		"last write committed at clock %llu\n",
+		what, (unsigned long long)lba, st->magic,
+		(unsigned long long)st->lba, st->tid,
+		(unsigned long long)st->seq, (unsigned long long)floor);
+}
+
+/**
+ * write_done - Upper bound of the completion clock of a write
+ *
+ * @w: Thread of the write
+ * @seq: Sequence number of the write
+ *
+ * The record of a write is reused STRESS_RECORDS writes later, long after it
+ * completed, so the completion clock of an older write is bounded by the
+ * highest one of the reused records.
+ *
+ * Return: completion clock, UINT64_MAX while the write is in flight
+ */
+static u64 write_done(struct worker* w, u64 seq) {
+	struct record* rec = &w->records[seq & (STRESS_RECORDS - 1)];
+	u64 done;
+
+	if (__atomic_load_n(&rec->seq, __ATOMIC_ACQUIRE) != seq)
+		return __atomic_load_n(&w->evicted, __ATOMIC_ACQUIRE);
+
+	done = __atomic_load_n(&rec->done, __ATOMIC_ACQUIRE);
+	return done ? done : UINT64_MAX;
+}
+
+/**
+ * verify_block - Verify a block read back
+ *
+ * @s: Test state
+ * @data: Block data
+ * @lba: Block address
+ * @floor: Submission clock of the last write of the block that completed
+ * before the read was submitted, 0 if there is none
+ *
+ * The block may hold the data of that write, or of any write that completed
+ * after it was submitted, but never of one that completed before.
+ */
+static void verify_block(struct stress* s, u8* data, u64 lba, u64 floor) {
+	struct stamp* st = (struct stamp*)data;
+	u32 crc = st->crc;
+	u64 seq;
+
+	if (st->magic != STRESS_MAGIC || st->run != s->run) {
+		if (floor)
+			report(s, &s->nr_lost, "lost write", lba, st, floor);
+		return;
+	}
+
+	st->crc = 0;
+	if (crc32c(data, s->block_size) != crc || st->tid >= s->nr_threads) {
+		st->crc = crc;
+		report(s, &s->nr_corrupt, "corrupt", lba, st, floor);
+		return;
+	}
+	st->crc = crc;
+
+	if (st->lba != lba) {
+		report(s, &s->nr_misdirected, "misdirected", lba, st, floor);
+		return;
+	}
+
+	seq = __atomic_load_n(&s->workers[st->tid].seq, __ATOMIC_ACQUIRE);
+	if (!st->seq || st->seq > seq) {
+		report(s, &s->nr_future, "unsubmitted write", lba, st, floor);
+		return;
+	}
+
+	if (write_done(&s->workers[st->tid], st->seq) <= floor)
+		report(s, &s->nr_stale, "stale", lba, st, floor);
+}
+
+/* Fill a block of a write with its stamp and data derived from it */
+static void fill_block(struct stress* s, struct worker* w, u8* data, u64 lba,
+		       u64 seq) {
+	struct stamp* st = (struct stamp*)data;
+	u64 x = ((seq * 0x9e3779b97f4a7c15ULL) ^ lba ^ ((u64)w->id << 48)) | 1;
+
+	for (size_t i = sizeof(*st); i < s->block_size; i += sizeof(x)) {
+		x ^= x << 13;
+		x ^= x >> 7;
+		x ^= x << 17;
+		memcpy(data + i, &x, sizeof(x));
+	}
+
+	*st = (struct stamp){
+	    .magic = STRESS_MAGIC,
+	    .lba = lba,
+	    .seq = seq,
+	    .tid = w->id,
+	    .run = s->run,
+	};
+	st->crc = crc32c(data, s->block_size);
+}
+
+/**
+ * prepare - Choose the next request of a slot
+ *
+ * @s: Test state
+ * @w: Thread
+ * @sl: Slot
+ *
+ * A write takes the next sequence number and resets the record it reuses,
+ * and a read takes the clock of the last committed write of its blocks
+ * before it is submitted.
+ */
+static void prepare(struct stress* s, struct worker* w, struct slot* sl) {
+	bool shared = !w->nr_private
+		      || next_rand(w) % 100 < s->shared_percent;
+	u64 first = shared ? 0 : w->first;
+	u64 len = shared ? s->nr_shared : w->nr_private;
+
+	sl->nr = 1 + next_rand(w) % (len < s->max_blocks ? len : s->max_blocks);
+	sl->lba = first + next_rand(w) % (len - sl->nr + 1);
+	sl->write = next_rand(w) % 100 < s->write_percent;
+
+	if (sl->write) {
+		u64 seq = w->seq + 1;
+		struct record* rec = &w->records[seq & (STRESS_RECORDS - 1)];
+
+		if (rec->done > w->evicted)
+			__atomic_store_n(&w->evicted, rec->done,
+					 __ATOMIC_RELEASE);
+		__atomic_store_n(&rec->done, 0, __ATOMIC_RELEASE);
+		__atomic_store_n(&rec->seq, seq, __ATOMIC_RELEASE);
+		__atomic_store_n(&w->seq, seq, __ATOMIC_RELEASE);
+
+		sl->seq = seq;
+		for (unsigned int i = 0; i < sl->nr; i++)
+			fill_block(s, w, sl->buf + i * s->block_size,
+				   sl->lba + i, seq);
+		sl->start = tick(s);
+	} else {
+		for (unsigned int i = 0; i < sl->nr; i++)
+			sl->floor[i] = __atomic_load_n(
+			    &s->committed[sl->lba + i], __ATOMIC_ACQUIRE);
+	}
+
+	sl->start_ns = now_ns();
+}
+
+/* Account the latency of a completed request */
+static void account(struct latency* lat, u64 ns, u64 bytes) {
+	unsigned int bucket = ns ? 64 - __builtin_clzll(ns) : 0;
+
+	if (bucket >= STRESS_LAT_BUCKETS)
+		bucket = STRESS_LAT_BUCKETS - 1;
+
+	lat->nr++;
+	lat->bytes += bytes;
+	lat->sum_ns += ns;
+	if (ns > lat->max_ns)
+		lat->max_ns = ns;
+	lat->hist[bucket]++;
+}
+
+/**
+ * complete - Handle a completed request
+ *
+ * @s: Test state
+ * @w: Thread
+ * @sl: Slot
+ * @res: Result of the request
+ *
+ * A completed write records its completion clock, then commits its
+ * submission clock to its blocks. A read verifies its blocks.
+ */
+static void complete(struct stress* s, struct worker* w, struct slot* sl,
+		     int res) {
+	u64 ns = now_ns() - sl->start_ns;
+
+	if (res != (int)(sl->nr * s->block_size)) {
+		__atomic_add_fetch(&s->nr_io_errors, 1, __ATOMIC_RELAXED);
+		if (__atomic_fetch_add(&s->nr_reported, 1, __ATOMIC_RELAXED)
+		    < STRESS_MAX_REPORTS)
+			fprintf(stderr, "%s of %u blocks at %llu: %s\n",
+				sl->write ? "write" : "read", sl->nr,
+				(unsigned long long)sl->lba,
+				res < 0 ? strerror(-res) : "short");
+		return;
+	}
+
+	account(&w->lat[sl->write], ns, res);
+
+	if (sl->write) {
+		struct record* rec =
+		    &w->records[sl->seq & (STRESS_RECORDS - 1)];
+
+		__atomic_store_n(&rec->done, tick(s), __ATOMIC_RELEASE);
+		for (unsigned int i = 0; i < sl->nr; i++) {
+			u64* c = &s->committed[sl->lba + i];
+			u64 old = __atomic_load_n(c, __ATOMIC_RELAXED);
+
+			while (old < sl->start
+			       && !__atomic_compare_exchange_n(
+				   c, &old, sl->start, true, __ATOMIC_RELEASE,
+				   __ATOMIC_RELAXED))
+				;
+		}
+		return;
+	}
+
+	for (unsigned int i = 0; i < sl->nr; i++)
+		verify_block(s, sl->buf + i * s->block_size, sl->lba + i,
+			     sl->floor[i]);
+	w->verified += sl->nr;
+}
+
+/* Reap the completed requests and free their slots */
+static unsigned int reap(struct stress* s, struct worker* w) {
+	struct uring* r = &w->ring;
+	unsigned int head = *r->cq_head, nr = 0;
+
+	while (head != __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE)) {
+		struct io_uring_cqe* cqe = &r->cqes[head & *r->cq_mask];
+		unsigned int idx = cqe->user_data;
+
+		complete(s, w, &w->slots[idx], cqe->res);
+		w->free[w->nr_free++] = idx;
+		head++;
+		nr++;
+	}
+	__atomic_store_n(r->cq_head, head, __ATOMIC_RELEASE);
+
+	return nr;
+}
+
+static void* worker_thread(void* arg) {
+	struct worker* w = arg;
+	struct stress* s = w->stress;
+	unsigned int inflight = 0;
+
+	while (!__atomic_load_n(&s->stop, __ATOMIC_RELAXED) || inflight) {
+		unsigned int submit = 0;
+		int ret;
+
+		while (w->nr_free && !__atomic_load_n(&s->stop,
+						      __ATOMIC_RELAXED)) {
+			unsigned int idx = w->free[--w->nr_free];
+
+			prepare(s, w, &w->slots[idx]);
+			uring_queue(&w->ring, s->fd, &w->slots[idx], idx,
+				    s->block_size);
+			submit++;
+		}
+
+		ret = uring_enter(&w->ring, submit, inflight + submit ? 1 : 0);
+		if (ret < 0) {
+			fprintf(stderr, "io_uring_enter: %s\n", strerror(-ret));
+			exit(2);
+		}
+
+		inflight += submit;
+		inflight -= reap(s, w);
+	}
+
+	return NULL;
+}
+
+static int worker_init(struct stress* s, struct worker* w, unsigned int id) {
+	size_t len = (size_t)s->max_blocks * s->block_size;
+	u64 nr_private = (s->nr_blocks - s->nr_shared) / s->nr_threads;
+	int ret;
+
+	w->stress = s;
+	w->id = id;
+	w->rand = 0x9e3779b97f4a7c15ULL * (id + 1) ^ s->run;
+	w->first = s->nr_shared + id * nr_private;
+	w->nr_private = nr_private;
+	w->slots = calloc(s->depth, sizeof(*w->slots));
+	w->free = calloc(s->depth, sizeof(*w->free));
+	w->records = calloc(STRESS_RECORDS, sizeof(*w->records));
+	if (!w->slots || !w->free || !w->records)
+		return -ENOMEM;
+
+	for (unsigned int i = 0; i < s->depth; i++) {
+		struct slot* sl = &w->slots[i];
+
+		sl->floor = calloc(s->max_blocks, sizeof(u64));
+		if (posix_memalign((void**)&sl->buf, 4096, len) || !sl->floor)
+			return -ENOMEM;
+		w->free[w->nr_free++] = i;
+	}
+
+	ret = uring_setup(&w->ring, s->depth);
+	if (ret)
+		fprintf(stderr, "io_uring_setup: %s\n", strerror(-ret));
+
+	return ret;
+}
+
+/**
+ * flush_device - Flush the device and note the writes it made durable
+ *
+ * @s: Test state
+ *
+ * Every write that completed before the flush was submitted is durable once
+ * it completes.
+ */
+static void flush_device(struct stress* s) {
+	for (u64 lba = 0; lba < s->nr_blocks; lba++)
+		s->flushing[lba] =
+		    __atomic_load_n(&s->committed[lba], __ATOMIC_ACQUIRE);
+
+	if (fsync(s->fd)) {
+		perror("flush");
+		s->nr_io_errors++;
+		return;
+	}
+
+	memcpy(s->durable, s->flushing, s->nr_blocks * sizeof(u64));
+	s->nr_flushes++;
+}
+
+/* Let the threads run for the runtime, flushing periodically */
+static void run_threads(struct stress* s, u64 start) {
+	u64 end = start + s->runtime * 1000000000ULL;
+	struct timespec ts = {
+	    .tv_sec = s->flush_ms / 1000,
+	    .tv_nsec = (s->flush_ms % 1000) * 1000000L,
+	};
+
+	if (!s->flush_ms) {
+		sleep(s->runtime);
+		return;
+	}
+
+	while (now_ns() < end) {
+		nanosleep(&ts, NULL);
+		flush_device(s);
+	}
+}
+
+/**
+ * crash_device - Freeze the persistent state of the device
+ *
+ * @s: Test state
+ *
+ * Return: 0 on success, -1 on failure
+ */
+static int crash_device(struct stress* s) {
+	char* name = strdup(s->path);
+	char path[256];
+	int fd;
+
+	snprintf(path, sizeof(path), CRASH_PATH, basename(name));
+	free(name);
+
+	fd = open(path, O_WRONLY);
+	if (fd < 0 || write(fd, "1", 1) != 1) {
+		fprintf(stderr, "%s: %s, the crash test needs a debug build\n",
+			path, strerror(errno));
+		if (fd >= 0)
+			close(fd);
+		return -1;
+	}
+
+	close(fd);
+	return 0;
+}
+
+/**
+ * verify_device - Verify every block once all requests completed
+ *
+ * @s: Test state
+ * @floors: Submission clock of the last write of every block that must be
+ * on the device
+ *
+ * Return: number of blocks verified
+ */
+static u64 verify_device(struct stress* s, u64* floors) {
+	size_t len = (size_t)STRESS_MAX_BLOCKS * s->block_size;
+	u64 verified = 0;
+	u8* buf;
+
+	if (posix_memalign((void**)&buf, 4096, len))
+		return 0;
+
+	for (u64 lba = 0; lba < s->nr_blocks; lba += STRESS_MAX_BLOCKS) {
+		u64 nr = s->nr_blocks - lba < STRESS_MAX_BLOCKS
+			     ? s->nr_blocks - lba
+			     : STRESS_MAX_BLOCKS;
+		ssize_t ret = pread(s->fd, buf, nr * s->block_size,
+				    lba * s->block_size);
+
+		if (ret != (ssize_t)(nr * s->block_size)) {
+			fprintf(stderr, "read of %llu blocks at %llu: %s\n",
+				(unsigned long long)nr,
+				(unsigned long long)lba,
+				ret < 0 ? strerror(errno) : "short");
+			s->nr_io_errors++;
+			continue;
+		}
+
+		for (u64 i = 0; i < nr; i++)
+			verify_block(s, buf + i * s->block_size, lba + i,
+				     floors[lba + i]);
+		verified += nr;
+	}
+
+	free(buf);
+	return verified;
+}
+
+/* Upper bound of the latency below which @percent of the requests are */
+static u64 percentile(struct latency* lat, double percent) {
+	u64 sum = 0;
+
+	for (unsigned int i = 0; i < STRESS_LAT_BUCKETS; i++) {
+		sum += lat->hist[i];
+		if (sum && sum >= lat->nr * percent / 100)
+			return 1ULL << i < lat->max_ns ? 1ULL << i
+							: lat->max_ns;
+	}
+
+	return lat->max_ns;
+}
+
+static void print_latency(const char* name, struct latency* lat, double sec) {
+	if (!lat->nr) {
+		printf("%s: none\n", name);
+		return;
+	}
+
+	printf("%s: %.0f IOPS, %.1f MiB/s, latency mean %.1f us, "
+	       "p50 < %.1f us, p99 < %.1f us, p99.9 < %.1f us, max %.1f us\n",
+	       name, lat->nr / sec, lat->bytes / sec / (1 << 20),
+	       lat->sum_ns / 1e3 / lat->nr, percentile(lat, 50) / 1e3,
+	       percentile(lat, 99) / 1e3, percentile(lat, 99.9) / 1e3,
+	       lat->max_ns / 1e3);
+}
+
+static void merge_latency(struct latency* dst, struct latency* src) {
+	dst->nr += src->nr;
+	dst->bytes += src->bytes;
+	dst->sum_ns += src->sum_ns;
+	if (src->max_ns > dst->max_ns)
+		dst->max_ns = src->max_ns;
+	for (unsigned int i = 0; i < STRESS_LAT_BUCKETS; i++)
+		dst->hist[i] += src->hist[i];
+}
+
+static int open_device(struct stress* s, u64 size_mb) {
+	struct stat st;
+	u64 size;
+	int bs;
+
+	s->fd = open(s->path, O_RDWR | O_DIRECT);
+	if (s->fd < 0 || fstat(s->fd, &st)) {
+		perror(s->path);
+		return -1;
+	}
+
+	if (S_ISBLK(st.st_mode)) {
+		if (ioctl(s->fd, BLKGETSIZE64, &size)
+		    || ioctl(s->fd, BLKSSZGET, &bs)) {
+			perror(s->path);
+			return -1;
+		}
+	} else {
+		size = st.st_size;
+		bs = 512;
+	}
+
+	if (size_mb && size_mb << 20 < size)
+		size = size_mb << 20;
+
+	s->block_size = bs;
+	s->nr_blocks = size / bs;
+	if (s->block_size < sizeof(struct stamp) || !s->nr_blocks) {
+		fprintf(stderr, "%s: too small to test\n", s->path);
+		return -1;
+	}
+
+	return 0;
+}
+
+static void usage(const char* prog) {
+	fprintf(stderr,
+		"Usage: %s [options] [device]\n"
+		"  -t N     threads (default 8)\n"
+		"  -q N     queue depth of every thread (default 32)\n"
+		"  -b N     blocks of the largest request (default 8)\n"
+		"  -w N     writes in percent (default 50)\n"
+		"  -o N     requests to the shared region in percent "
+		"(default 50)\n"
+		"  -s KB    size of the shared region (default 1024)\n"
+		"  -S MB    size of the device tested (default all)\n"
+		"  -r SEC   runtime (default 10)\n"
+		"  -f MS    flush interval, 0 for none (default 0, 100 with -C)\n"
+		"  -C       crash the device at the end and verify it reloaded\n"
+		"  -R CMD   command that reloads the device after the crash\n"
+		"           (default \"" RELOAD_COMMAND "\")\n"
+		"The device defaults to " DEVICE_PATH ".\n",
+		prog);
+}
+
+int main(int argc, char** argv) {
+	struct stress s = {
+	    .path = DEVICE_PATH,
+	    .nr_threads = 8,
+	    .depth = 32,
+	    .max_blocks = 8,
+	    .write_percent = 50,
+	    .shared_percent = 50,
+	    .runtime = 10,
+	    .flush_ms = ~0U,
+	    .reload = RELOAD_COMMAND,
+	};
+	struct latency lat[2] = {0};
+	u64 shared_kb = 1024, size_mb = 0, nr_blocks, verified = 0, final;
+	u64 errors;
+	u64 start;
+	double sec;
+	int opt;
+
+	while ((opt = getopt(argc, argv, "t:q:b:w:o:s:S:r:f:CR:h")) != -1) {
+		switch (opt) {
+		case 't':
+			s.nr_threads = strtoul(optarg, NULL, 0);
+			break;
+		case 'q':
+			s.depth = strtoul(optarg, NULL, 0);
+			break;
+		case 'b':
+			s.max_blocks = strtoul(optarg, NULL, 0);
+			break;
+		case 'w':
+			s.write_percent = strtoul(optarg, NULL, 0);
+			break;
+		case 'o':
+			s.shared_percent = strtoul(optarg, NULL, 0);
+			break;
+		case 's':
+			shared_kb = strtoull(optarg, NULL, 0);
+			break;
+		case 'S':
+			size_mb = strtoull(optarg, NULL, 0);
+			break;
+		case 'r':
+			s.runtime = strtoul(optarg, NULL, 0);
+			break;
+		case 'f':
+			s.flush_ms = strtoul(optarg, NULL, 0);
+			break;
+		case 'C':
+			s.crash = true;
+			break;
+		case 'R':
+			s.reload = optarg;
+			break;
+		default:
+			usage(argv[0]);
+			return opt == 'h' ? 0 : 2;
+		}
+	}
+	if (optind < argc)
+		s.path = argv[optind];
+	if (s.flush_ms == ~0U)
+		s.flush_ms = s.crash ? 100 : 0;
+
+	if (!s.nr_threads || !s.depth || s.depth > STRESS_MAX_DEPTH
+	    || !s.max_blocks || s.max_blocks > STRESS_MAX_BLOCKS
+	    || s.write_percent > 100 || s.shared_percent > 100) {
+		usage(argv[0]);
+		return 2;
+	}
+
+	crc32c_init();
+	if (open_device(&s, size_mb))
+		return 2;
+
+	s.nr_shared = (shared_kb << 10) / s.block_size;
+	if (!s.nr_shared)
+		s.nr_shared = 1;
+	if (s.nr_shared > s.nr_blocks)
+		s.nr_shared = s.nr_blocks;
+	s.run = now_ns() ^ getpid();
+	s.committed = calloc(s.nr_blocks, sizeof(u64));
+	s.flushing = calloc(s.nr_blocks, sizeof(u64));
+	s.durable = calloc(s.nr_blocks, sizeof(u64));
+	s.workers = calloc(s.nr_threads, sizeof(*s.workers));
+	if (!s.committed || !s.flushing || !s.durable || !s.workers) {
+		fprintf(stderr, "Out of memory\n");
+		return 2;
+	}
+
+	for (unsigned int i = 0; i < s.nr_threads; i++)
+		if (worker_init(&s, &s.workers[i], i))
+			return 2;
+
+	printf("%s: %llu MiB, %u byte blocks, %u threads, queue depth %u, "
+	       "1-%u blocks, %u%% writes, %u%% to %llu shared blocks\n",
+	       s.path, (unsigned long long)(s.nr_blocks * s.block_size >> 20),
+	       s.block_size, s.nr_threads, s.depth, s.max_blocks,
+	       s.write_percent, s.shared_percent,
+	       (unsigned long long)s.nr_shared);
+
+	start = now_ns();
+	for (unsigned int i = 0; i < s.nr_threads; i++) {
+		if (pthread_create(&s.workers[i].thread, NULL, worker_thread,
+				   &s.workers[i])) {
+			fprintf(stderr, "Failed to create thread %u\n", i);
+			return 2;
+		}
+	}
+
+	run_threads(&s, start);
+	if (s.crash && crash_device(&s))
+		return 2;
+	__atomic_store_n(&s.stop, true, __ATOMIC_RELAXED);
+
+	for (unsigned int i = 0; i < s.nr_threads; i++) {
+		pthread_join(s.workers[i].thread, NULL);
+		merge_latency(&lat[0], &s.workers[i].lat[0]);
+		merge_latency(&lat[1], &s.workers[i].lat[1]);
+		verified += s.workers[i].verified;
+	}
+	sec = (now_ns() - start) / 1e9;
+
+	if (s.crash) {
+		nr_blocks = s.nr_blocks;
+		close(s.fd);
+		printf("crashed after %llu flushes, reloading: %s\n",
+		       (unsigned long long)s.nr_flushes, s.reload);
+		fflush(stdout);
+		if (system(s.reload) || open_device(&s, size_mb)
+		    || s.nr_blocks != nr_blocks) {
+			fprintf(stderr, "Failed to reload %s\n", s.path);
+			return 2;
+		}
+		final = verify_device(&s, s.durable);
+	} else {
+		final = verify_device(&s, s.committed);
+	}
+
+	print_latency("read", &lat[0], sec);
+	print_latency("write", &lat[1], sec);
+	printf("verified: %llu blocks while running, %llu after%s, "
+	       "%llu flushes\n",
+	       (unsigned long long)verified, (unsigned long long)final,
+	       s.crash ? " the crash" : "", (unsigned long long)s.nr_flushes);
+	printf("errors: %llu io, %llu corrupt, %llu misdirected, %llu stale, "
+	       "%llu lost, %llu unsubmitted\n",
+	       (unsigned long long)s.nr_io_errors,
+	       (unsigned long long)s.nr_corrupt,
+	       (unsigned long long)s.nr_misdirected,
+	       (unsigned long long)s.nr_stale, (unsigned long long)s.nr_lost,
+	       (unsigned long long)s.nr_future);
+
+	errors = s.nr_io_errors + s.nr_corrupt + s.nr_misdirected
+		 + s.nr_stale + s.nr_lost + s.nr_future;
+	close(s.fd);
+
+	return errors ? 1 : 0;
+}
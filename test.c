@@ -8,7 +8,7 @@
 #include <errno.h>
 #include <pthread.h>
 
-#define DEVICE_PATH "/dev/csl"
+#define DEVICE_PATH "/dev/csl0"
 #define SECTOR_SIZE 512
 #define NUM_THREADS 4
 #define NUM_SECTORS 10
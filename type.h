@@ -1,41 +1,127 @@
+#include <linux/atomic.h>
 #include <linux/blk-mq.h>
 #include <linux/blkdev.h>
+#include <linux/cache.h>
 #include <linux/list.h>
 #include <linux/mutex.h>
+#include <linux/percpu.h>
+#include <linux/rcupdate.h>
 #include <linux/rwlock.h>
 #include <linux/semaphore.h>
+#include <linux/spinlock.h>
 #include <linux/types.h>
-#include <linux/xarray.h>
 #include <linux/rwsem.h>
+#include <linux/wait.h>
 
 #ifndef __CSL_DEV_TYPES
 #define __CSL_DEV_TYPES
 
+/* Segment index of no segment */
+#define CSL_NO_SEG UINT_MAX
+
+/* States of a segment */
+#define CSL_SEG_FREE 0
+#define CSL_SEG_OPEN 1
+#define CSL_SEG_CLOSED 2
+#define CSL_SEG_RETIRING 3
+#define CSL_SEG_COLLECTING 4
+
 /**
- * struct sector_list_entry - Sector list entry structure
- * @idx: 	Pysical sector index
- * @list: 	List head
+ * struct csl_segment - Erase unit of the physical space
+ * @nr_valid: 				Number of blocks that hold mapped data
+ * @nr_pending: 			Number of blocks reserved by writes that
+ * 					are not published yet
+ * @state: 				Segment state
+ * @seq: 				Close sequence number, for the age of the
+ * 					segment
+ * @gp: 				Grace period cookie of a retiring segment
+ * @node: 				NUMA node of the chunk of the segment
+ * @lsn: 				Journal records that must be durable before a
+ * 					retiring segment is reused
+ * @list: 				Entry in the free list of its node, or in
+ * 					the retiring list of the domain
+ * @heap_child: 			First child in the victim heap
+ * @heap_next: 				Next sibling in the victim heap
+ * @heap_prev: 				Previous sibling, or parent of a first
+ * 					child, in the victim heap
  */
-struct sector_list_entry {
-	int idx;
-	struct list_head list;
+struct csl_segment {
+	unsigned int nr_valid;	 /* Number of valid blocks */
+	unsigned int nr_pending; /* Number of reserved blocks */
+	unsigned int state;	 /* Segment state */
+	int node;		 /* NUMA node of chunk */
+	unsigned long seq;	 /* Close sequence number */
+	unsigned long gp;	 /* Grace period of retiring segment */
+	u64 lsn;		 /* Journal records of retiring segment */
+	struct list_head list;	 /* Free or retiring list entry */
+	unsigned int heap_child; /* First child in victim heap */
+	unsigned int heap_next;	 /* Next sibling in victim heap */
+	unsigned int heap_prev;	 /* Previous sibling or parent */
 };
 
 /**
- * struct sector_mapping_entry - Sector mapping entry structure
- * @l_idx: 	Logical sector index
- * @p_idx: 	Physical sector index
+ * struct csl_open - Open segment of a NUMA node
+ * @seg: 				Segment the writes append to
+ * @cursor: 				Next block of the segment
  */
-struct sector_mapping_entry {
-	int l_idx;
-	int p_idx;
+struct csl_open {
+	unsigned int seg;    /* Segment of writes */
+	unsigned int cursor; /* Next block of writes */
 };
 
 /**
- * struct csl_device - CSL append only ramdisk device structure
- * @tag_set: 				Tag set for multiqueue
- * @disk: 				General disk structure
- * @queue: 				Request queue
+ * struct csl_jrec - Journal record of a map update
+ * @unit: 				First logical unit index
+ * @p_idx: 				First physical block index, or
+ * 					CSL_UNMAPPED for an unmap
+ * @nr: 				Number of units
+ */
+struct csl_jrec {
+	u32 unit;  /* First logical unit */
+	u32 p_idx; /* First physical block */
+	u32 nr;	   /* Number of units */
+};
+
+/**
+ * struct csl_journal - Journal of the map updates of a domain
+ * @bufs: 				Record buffers, one is appended to while
+ * 					the other is written to the log
+ * @active: 				Buffer appended to
+ * @nr: 				Number of records in the active buffer
+ * @first_lsn: 				Sequence number of the first record of the
+ * 					active buffer
+ * @lsn: 				Sequence number of the next record
+ * @ckpt_lsn: 				First record not covered by the checkpoint
+ * 					being written
+ * @flush_nr: 				Number of records of the buffer being
+ * 					written
+ * @flush_lsn: 				Sequence number of its first record
+ * @flushed_lsn: 			First record not written to the log
+ * @durable_lsn: 			First record not durable yet
+ * @overflow: 				Records were dropped since the last
+ * 					checkpoint
+ * @nr_dropped: 			Number of dropped records
+ *
+ * Records are appended under the domain lock, so the journal needs no lock
+ * of its own.
+ */
+struct csl_journal {
+	struct csl_jrec* bufs[2]; /* Record buffers */
+	unsigned int active;	  /* Buffer appended to */
+	unsigned int nr;	  /* Records in active buffer */
+	u64 first_lsn;		  /* First record sequence number */
+	u64 lsn;		  /* Next record sequence number */
+	u64 ckpt_lsn;		  /* Checkpoint sequence number */
+	unsigned int flush_nr;	  /* Records being written */
+	u64 flush_lsn;		  /* First record being written */
+	u64 flushed_lsn;	  /* Flushed sequence number */
+	u64 durable_lsn;	  /* Durable sequence number */
+	bool overflow;		  /* Records were dropped */
+	u64 nr_dropped;		  /* Number of dropped records */
+};
+
+/**
+ * struct csl_domain - Independently locked slice of the FTL
  * @reader_cnt_mutex: 			Mutex for reader count
  * 					- only for mutex and semaphore option
  * @rw_mutex: 				Mutex for read-write lock
@@ -43,16 +129,45 @@ struct sector_mapping_entry {
  * @reader_nr: 				Reader count
  * 					- only for mutex and semaphore option
  * @rwlock: 				Read-write lock
- * @map: 				Map for logical to physical sector index
- * @freelist: 				Free physical sector list
- * @dirtylist: 				Dirty physical sector list
- * @size: 				Device capacity in sectors
- * @data: 				Data buffer address
+ * @segs: 				Segments of the domain
+ * @base: 				First physical block of the domain
+ * @nr_segs: 				Number of segments
+ * @nr_free_segs: 			Number of free segments
+ * @nr_retiring: 			Number of segments waiting for an RCU
+ * 					grace period
+ * @free_segs: 				Free segments of every NUMA node
+ * @retiring: 				Retiring segments, in retirement order
+ * @victims: 				Victim heap of every valid count, the
+ * 					closed segments ordered by age
+ * @opens: 				Open segment of every NUMA node
+ * @gc_seg: 				Segment the garbage collector appends to
+ * @gc_cursor: 				Next block of the collector segment
+ * @seq: 				Number of segments closed so far
+ * @nr_host_writes: 			Number of blocks written by the host
+ * @nr_gc_writes: 			Number of blocks migrated by the garbage
+ * 					collector
+ * @nr_node_blocks: 			Number of blocks allocated on every NUMA
+ * 					node
+ * @nr_remote_blocks: 			Number of blocks allocated on another node
+ * 					than the writer's one
+ * @nr_collected: 			Number of segments collected
+ * @jnl: 				Journal of the map updates
+ *
+ * The logical space is striped over the domains by LBA and every domain owns
+ * an equally sized range of physical sectors, so writes to different domains
+ * never share a lock. A domain also owns the map entries of its stripes.
+ * Readers do not take the lock at all; they resolve the map under RCU, so a
+ * collected segment is only reused after a grace period. A block is one
+ * mapping unit of the device, and the physical range is split into segments
+ * that are written sequentially and reclaimed as a whole. The segments of a
+ * domain are spread over the NUMA nodes, and writes append to an open
+ * segment of their own node.
+ *
+ * Free segments are kept in a list per node, and the closed segments in a
+ * heap per valid count, so neither the writes nor the garbage collector scan
+ * the segments of the domain.
  */
-struct csl_device {
-	struct blk_mq_tag_set* tag_set; /* Tag set for multiqueue */
-	struct gendisk* disk;		/* General disk structure */
-	struct request_queue* queue;	/* Request queue */
+struct csl_domain {
 #ifdef _USE_MUTEX
 	struct mutex reader_cnt_mutex; /* Mutex for reader count */
 	struct mutex rw_mutex;	     /* Mutex for read-write lock */
@@ -66,10 +181,230 @@ struct csl_device {
 #else
 	rwlock_t rwlock; /* Read-write lock */
 #endif
-	struct xarray map;	    /* Map for block index */
-	struct list_head freelist;  /* Free block list */
-	struct list_head dirtylist; /* Dirty block list */
-	size_t size;		    /* Device capacity in sectors */
-	uint8_t* data;		    /* Data buffer */
+	struct csl_segment* segs;   /* Segments */
+	u32 base;		    /* First physical block */
+	unsigned int nr_segs;	    /* Number of segments */
+	unsigned int nr_free_segs;  /* Number of free segments */
+	unsigned int nr_retiring;   /* Number of retiring segments */
+	struct list_head* free_segs; /* Free segments of every node */
+	struct list_head retiring;  /* Retiring segments */
+	unsigned int* victims;	    /* Victim heap of every valid count */
+	struct csl_open* opens;	    /* Open segment of every node */
+	unsigned int gc_seg;	    /* Segment of garbage collector */
+	unsigned int gc_cursor;	    /* Next block of garbage collector */
+	unsigned long seq;	    /* Close sequence number */
+	u64 nr_host_writes;	    /* Blocks written by host */
+	u64 nr_gc_writes;	    /* Blocks migrated by garbage collector */
+	u64* nr_node_blocks;	    /* Blocks allocated on every node */
+	u64 nr_remote_blocks;	    /* Blocks allocated on remote node */
+	u64 nr_collected;	    /* Segments collected */
+	struct csl_journal jnl;	    /* Journal of map updates */
+} ____cacheline_aligned_in_smp;
+
+/**
+ * struct csl_rq_iter - Position in the data segments of a request
+ * @bio: 				Current bio
+ * @iter: 				Position in the current bio
+ */
+struct csl_rq_iter {
+	struct bio* bio;	/* Current bio */
+	struct bvec_iter iter;	/* Position in the current bio */
+};
+
+/**
+ * struct csl_extent - Physical blocks reserved for a request
+ * @it: 				Request data of the extent
+ * @unit: 				First logical unit index
+ * @p_idx: 				First physical block index
+ * @nr: 				Number of units
+ */
+struct csl_extent {
+	struct csl_rq_iter it; /* Request data of the extent */
+	unsigned long unit;    /* First logical unit */
+	u32 p_idx;	       /* First physical block */
+	unsigned int nr;       /* Number of units */
+};
+
+/* Number of extents a request reserves before it has to publish them */
+#define CSL_CMD_EXTENTS 16
+
+/* Delay before a batched request without a free block is dispatched again */
+#define CSL_REQUEUE_DELAY_MS 3
+
+/**
+ * struct csl_cmd - Driver data of a request
+ * @start_ns: 				Time the request was dispatched at
+ * @nr_extents: 			Number of reserved extents
+ * @extents: 				Reserved extents, filled and published
+ * 					without holding the lock in between
+ * @next: 				Next deferred write of a batch
+ */
+struct csl_cmd {
+	u64 start_ns;				     /* Dispatch time */
+	unsigned int nr_extents;		     /* Number of extents */
+	struct csl_extent extents[CSL_CMD_EXTENTS]; /* Reserved extents */
+	struct csl_cmd* next;			     /* Next deferred write */
+};
+
+/* Latency histogram buckets, bucket i counts latencies below 2^i ns and the
+ * last one the longer ones */
+#define CSL_LAT_BUCKETS 32
+
+/**
+ * struct csl_stats - Counters of a hardware queue on one CPU
+ * @nr_reads: 				Number of read requests
+ * @nr_writes: 				Number of write requests
+ * @nr_discards: 			Number of discard and write zeroes requests
+ * @nr_flushes: 			Number of flush requests
+ * @nr_errors: 				Number of failed requests
+ * @read_bytes: 			Bytes read
+ * @write_bytes: 			Bytes written
+ * @unmapped_read_bytes: 		Bytes read from unmapped units
+ * @nr_locks: 				Number of domain locks taken on dispatch
+ * @lock_wait_ns: 			Time waited for the domain locks
+ * @lock_hold_ns: 			Time the domain locks were held
+ * @lat: 				Histogram of the request latencies
+ *
+ * The counters are only updated by the CPU they belong to, so the dispatch
+ * path never shares a cacheline for them, and they are summed on read.
+ */
+struct csl_stats {
+	u64 nr_reads;			/* Read requests */
+	u64 nr_writes;			/* Write requests */
+	u64 nr_discards;		/* Discard requests */
+	u64 nr_flushes;			/* Flush requests */
+	u64 nr_errors;			/* Failed requests */
+	u64 read_bytes;			/* Bytes read */
+	u64 write_bytes;		/* Bytes written */
+	u64 unmapped_read_bytes;	/* Bytes read unmapped */
+	u64 nr_locks;			/* Domain locks taken */
+	u64 lock_wait_ns;		/* Lock wait time */
+	u64 lock_hold_ns;		/* Lock hold time */
+	u64 lat[CSL_LAT_BUCKETS];	/* Latency histogram */
+};
+
+/* Tags of every hardware queue by default */
+#define CSL_DEFAULT_QUEUE_DEPTH 128
+
+/* Number of blocks a write frontier is refilled with */
+#define CSL_FRONTIER_BLOCKS 32
+
+/**
+ * struct csl_hctx - Hardware queue data
+ * @dev: 				Device pointer
+ * @node: 				NUMA node of the hardware queue
+ * @poll_lock: 				Lock of the polled requests
+ * @poll_list: 				Handled requests of a poll queue, waiting
+ * 					to be completed by the poll callback
+ * @stats: 				Per-CPU counters of the hardware queue
+ * @frontiers: 				Write frontier of every domain, that is
+ * 					the next reserved physical block and the
+ * 					number of reserved blocks left
+ *
+ * Every hardware queue appends to its own run of reserved blocks in each
+ * domain, so writes from different queues allocate without sharing a
+ * cacheline, and only refill the run from the domain in batches.
+ */
+struct csl_hctx {
+	struct csl_device* dev;	 /* Device pointer */
+	int node;		 /* NUMA node */
+	spinlock_t poll_lock;	 /* Lock of polled requests */
+	struct list_head poll_list; /* Requests to complete on poll */
+	struct csl_stats __percpu* stats; /* Counters */
+	atomic64_t frontiers[]; /* Write frontier of every domain */
+};
+
+/* Length of the metadata and journal paths of a device */
+#define CSL_PATH_LEN 256
+
+/**
+ * struct csl_device - CSL append only ramdisk device structure
+ * @list: 				Entry in the list of devices
+ * @id: 				Device index, used as minor number
+ * @meta_path: 				Paths of the two metadata snapshot slots
+ * @snap_slot: 				Slot of the latest snapshot
+ * @snap_gen: 				Generation of the latest snapshot
+ * @tag_set: 				Tag set for multiqueue
+ * @nr_poll_queues: 			Hardware queues completed by polling
+ * @disk: 				General disk structure
+ * @queue: 				Request queue
+ * @domains: 				FTL domains selected by LBA
+ * @nr_domains: 			Number of domains (power of two)
+ * @unit_shift: 			Mapping unit size in sectors as power of two
+ * @nr_segs: 				Number of segments of every domain
+ * @gc_policy: 				Victim selection policy
+ * @gc_thread: 				Garbage collector thread
+ * @gc_wait: 				Wait queue of the garbage collector
+ * @gc_kick: 				Garbage collector has work to do
+ * @gc_low_segs: 			Free segments to wake the collector at
+ * @gc_high_segs: 			Free segments to stop collecting at
+ * @nr_gc_runs: 			Number of garbage collector passes
+ * @map: 				Map for logical to physical unit index
+ * @p2l: 				Reverse map for physical to logical unit
+ * 					index, to migrate valid blocks
+ * @size: 				Device capacity in sectors
+ * @nr_sectors: 			Number of logical sectors
+ * @chunks: 				Chunk table of the data buffer
+ * @jnl_path: 				Path of the journal log
+ * @jnl_file: 				Journal log, NULL if the journal is off
+ * @jnl_pos: 				End of the journal log
+ * @jnl_size: 				Records of a journal buffer
+ * @jnl_thread: 			Journal thread
+ * @jnl_wait: 				Wait queue of the journal thread
+ * @jnl_kick: 				Journal thread has work to do
+ * @jnl_ckpt_interval: 			Jiffies between two checkpoints
+ * @jnl_replayed: 			Records replayed on load
+ * @nr_checkpoints: 			Number of checkpoints written
+ * @backing: 				Backing file, NULL without one
+ * @dirty: 				Chunks not written back yet
+ * @flush_lock: 			Lock of the waiting flush requests
+ * @flush_rqs: 				Requests waiting for the data and the map
+ * 					to be durable
+ * @crashed: 				Persistent state frozen by a simulated
+ * 					crash, in debug builds
+ * @debugfs: 				Debugfs directory of the device
+ */
+struct csl_device {
+	struct list_head list;		/* Entry in the device list */
+	unsigned int id;		/* Device index */
+	char meta_path[2][CSL_PATH_LEN]; /* Metadata snapshot paths */
+	unsigned int snap_slot;		/* Slot of latest snapshot */
+	u64 snap_gen;			/* Generation of latest snapshot */
+	struct blk_mq_tag_set* tag_set; /* Tag set for multiqueue */
+	unsigned int nr_poll_queues;	/* Number of poll queues */
+	struct gendisk* disk;		/* General disk structure */
+	struct request_queue* queue;	/* Request queue */
+	struct csl_domain* domains;	/* FTL domains */
+	unsigned int nr_domains;	/* Number of domains */
+	unsigned int unit_shift;	/* Mapping unit size */
+	unsigned int nr_segs;		/* Number of segments per domain */
+	unsigned int gc_policy;		/* Victim selection policy */
+	struct task_struct* gc_thread;	/* Garbage collector thread */
+	wait_queue_head_t gc_wait;	/* Wait queue of garbage collector */
+	bool gc_kick;			/* Garbage collector has work */
+	unsigned int gc_low_segs;	/* Low watermark */
+	unsigned int gc_high_segs;	/* High watermark */
+	u64 nr_gc_runs;			/* Garbage collector passes */
+	u32* map;			/* Map for block index */
+	u32* p2l;			/* Reverse map for block index */
+	size_t size;			/* Device capacity in sectors */
+	sector_t nr_sectors;		/* Number of logical sectors */
+	void** chunks;			/* Chunk table of data buffer */
+	char jnl_path[CSL_PATH_LEN];	/* Journal log path */
+	struct file* jnl_file;		/* Journal log */
+	loff_t jnl_pos;			/* End of journal log */
+	unsigned int jnl_size;		/* Records of a journal buffer */
+	struct task_struct* jnl_thread;	/* Journal thread */
+	wait_queue_head_t jnl_wait;	/* Wait queue of journal thread */
+	bool jnl_kick;			/* Journal thread has work */
+	unsigned long jnl_ckpt_interval; /* Checkpoint interval */
+	u64 jnl_replayed;		/* Records replayed on load */
+	u64 nr_checkpoints;		/* Number of checkpoints */
+	struct file* backing;		/* Backing file */
+	unsigned long* dirty;		/* Chunks to write back */
+	spinlock_t flush_lock;		/* Lock of flush requests */
+	struct list_head flush_rqs;	/* Waiting flush requests */
+	bool crashed;			/* Persistent state is frozen */
+	struct dentry* debugfs;		/* Debugfs directory */
 };
 #endif
\ No newline at end of file